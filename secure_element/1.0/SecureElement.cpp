@@ -10,6 +10,8 @@
  * See the License for the specific language governing permissions and limitations under the License.
 
  ****************************************************************************/
+#define ATRACE_TAG ATRACE_TAG_HAL
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,7 +22,12 @@
 #include <libgen.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
 #include <log/log.h>
+#include <cutils/trace.h>
+#include <hwbinder/IPCThreadState.h>
 
 #include "se-gto/libse-gto.h"
 #include "SecureElement.h"
@@ -31,6 +38,8 @@ namespace secure_element {
 namespace V1_0 {
 namespace implementation {
 
+using ::android::hardware::IPCThreadState;
+
 #ifndef BASIC_CHANNEL
 #define BASIC_CHANNEL 0x00
 #endif
@@ -45,10 +54,36 @@ namespace implementation {
 
 uint8_t getResponse[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
 static struct se_gto_ctx *ctx;
+
+static std::atomic<int> halCalls;
+
+/* Held while ctx is freed, and by dump which may run on any binder thread */
+static std::mutex ctxLock;
+
+/* Times HAL operation into latency histograms and system trace, until end of scope */
+struct LatencyScope {
+    struct se_gto_ctx *c;
+    int op, ins, channel;
+    uint64_t start;
+
+    LatencyScope(const char *name, int op, int ins = -1, int channel = -1)
+        : c(ctx), op(op), ins(ins), channel(channel), start(se_gto_latency_start()) {
+        ATRACE_BEGIN(name);
+        ATRACE_INT("se-gto HAL calls", ++halCalls);
+    }
+    ~LatencyScope() {
+        /* Histograms are process-wide, context entered with may have been
+         * freed by deinitializeSE(): only publish through it if still in use */
+        se_gto_latency_end(c == ctx ? c : NULL, op, ins, channel, start);
+        ATRACE_INT("se-gto HAL calls", --halCalls);
+        ATRACE_END();
+    }
+};
+
 bool debug_log_enabled = false;
+bool session_resume_enabled = false;
 
 SecureElement::SecureElement(const char* ese_name){
-    nbrOpenChannel = 0;
     ctx = NULL;
 
     if (strcmp(ese_name, "eSE2") == 0) {
@@ -62,14 +97,13 @@ int SecureElement::resetSE(){
     int n;
 
     isBasicChannelOpen = false;
-    nbrOpenChannel = 0;
 
     ALOGD("SecureElement:%s se_gto_reset start", __func__);
     n = se_gto_reset(ctx, atr, sizeof(atr));
     if (n >= 0) {
         atr_size = n;
         ALOGD("SecureElement:%s received ATR of %d bytes\n", __func__, n);
-        dump_bytes("ATR: ", ':',  atr, n, stdout);
+        dump_bytes("ATR", atr, n);
     } else {
         ALOGE("SecureElement:%s Failed to reset and get ATR: %s\n", __func__, strerror(errno));
     }
@@ -77,19 +111,67 @@ int SecureElement::resetSE(){
     return n;
 }
 
+int SecureElement::resumeSE(){
+    int n;
+
+    isBasicChannelOpen = false;
+
+    ALOGD("SecureElement:%s se_gto_resume start", __func__);
+    n = se_gto_resume(ctx, atr, sizeof(atr));
+    if (n >= 0) {
+        atr_size = n;
+        ALOGD("SecureElement:%s resumed with ATR of %d bytes\n", __func__, n);
+    } else {
+        ALOGD("SecureElement:%s No resume, SE will be reset: %s\n", __func__, strerror(errno));
+    }
+
+    return n;
+}
+
+int SecureElement::recoverSE(){
+    struct timespec start, end;
+    struct se_gto_channel_info info;
+    int before = se_gto_channel_count(ctx);
+    int n;
+
+    if (!session_resume_enabled)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = se_gto_channel_resume(ctx, atr, sizeof(atr));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (n >= 0) {
+        atr_size = n;
+        isBasicChannelOpen = se_gto_channel_get_info(ctx, BASIC_CHANNEL, &info) == 0 &&
+                             info.state == SE_GTO_CHANNEL_OPEN;
+        ALOGD("SecureElement:%s %d of %d channels resumed in %ld ms", __func__,
+              se_gto_channel_count(ctx), before,
+              (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+    } else {
+        ALOGE("SecureElement:%s Failed to resume channels: %s\n", __func__, strerror(errno));
+    }
+
+    return n;
+}
+
 sp<V1_0::ISecureElementHalCallback> SecureElement::internalClientCallback = nullptr;
 int SecureElement::initializeSE() {
 
     int n;
+    struct timespec start, end;
+    bool resumed = false;
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
 
     if (checkSeUp) {
         ALOGD("SecureElement:%s Already initialized", __func__);
-        ALOGD("SecureElement:%s end", __func__);
+        ALOGV("SecureElement:%s end", __func__);
         return EXIT_SUCCESS;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     if (se_gto_new(&ctx) < 0) {
         ALOGE("SecureElement:%s se_gto_new FATAL:%s", __func__,strerror(errno));
 
@@ -104,7 +186,14 @@ int SecureElement::initializeSE() {
         return EXIT_FAILURE;
     }
 
-    if (resetSE() < 0) {
+    /* SE stayed powered if HAL process was restarted */
+    if (isFirstInit) {
+        isFirstInit = false;
+        resumed = resumeSE() >= 0;
+    }
+
+    if (!resumed && resetSE() < 0) {
+        std::lock_guard<std::mutex> lock(ctxLock);
         se_gto_close(ctx);
         ctx = NULL;
         return EXIT_FAILURE;
@@ -112,13 +201,18 @@ int SecureElement::initializeSE() {
 
     checkSeUp = true;
 
-    ALOGD("SecureElement:%s end", __func__);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ALOGD("SecureElement:%s SE ready in %ld ms with %s", __func__,
+          (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000),
+          resumed ? "RESYNCH" : "RESET");
+
+    ALOGV("SecureElement:%s end", __func__);
     return EXIT_SUCCESS;
 }
 
 Return<void> SecureElement::init(const sp<::android::hardware::secure_element::V1_0::ISecureElementHalCallback>& clientCallback) {
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
     if (clientCallback == nullptr) {
         ALOGE("SecureElement:%s clientCallback == nullptr", __func__);
         return Void();
@@ -137,7 +231,7 @@ Return<void> SecureElement::init(const sp<::android::hardware::secure_element::V
         clientCallback->onStateChange(true);
     }
 
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
 
     return Void();
 }
@@ -155,6 +249,9 @@ Return<bool> SecureElement::isCardPresent() {
 }
 
 Return<void> SecureElement::transmit(const hidl_vec<uint8_t>& data, transmit_cb _hidl_cb) {
+    LatencyScope latency(__func__, SE_GTO_OP_TRANSMIT,
+                         data.size() >= 4 ? data[1] : -1,
+                         data.size() >= 4 ? se_gto_cla_channel(data[0]) : -1);
 
     uint8_t *apdu;
     uint8_t *resp;
@@ -167,20 +264,25 @@ Return<void> SecureElement::transmit(const hidl_vec<uint8_t>& data, transmit_cb
 
     hidl_vec<uint8_t> result;
 
-    if (checkSeUp && nbrOpenChannel != 0) {
+    if (checkSeUp && se_gto_channel_count(ctx) != 0) {
         if (apdu != NULL) {
             memcpy(apdu, data.data(), data.size());
-            dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+            dump_bytes("CMD", apdu, apdu_len);
             resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         }
 
-        if (resp_len < 0) {
+        if (resp_len < 0 && (errno == ETIME || errno == ECANCELED)) {
+            /* Command aborted on deadline, link is still up */
+            ALOGE("SecureElement:%s: APDU aborted: %s", __func__, strerror(errno));
+        } else if (resp_len < 0) {
             ALOGE("SecureElement:%s: transmit failed", __func__);
-            if (deinitializeSE() != SecureElementStatus::SUCCESS) {
+            /* Give clients their channels back, only this APDU is lost */
+            if ((recoverSE() < 0 || se_gto_channel_count(ctx) == 0) &&
+                deinitializeSE() != SecureElementStatus::SUCCESS) {
                 ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
             }
         } else {
-            dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+            dump_bytes("RESP", resp, resp_len);
             result.resize(resp_len);
             memcpy(&result[0], resp, resp_len);
         }
@@ -194,12 +296,20 @@ Return<void> SecureElement::transmit(const hidl_vec<uint8_t>& data, transmit_cb
 }
 
 Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid, uint8_t p2, openLogicalChannel_cb _hidl_cb) {
-    ALOGD("SecureElement:%s start", __func__);
+    LatencyScope latency(__func__, SE_GTO_OP_OPEN_LOGICAL_CHANNEL);
+    ALOGV("SecureElement:%s start", __func__);
 
     LogicalChannelResponse resApduBuff;
     resApduBuff.channelNumber = 0xff;
     memset(&resApduBuff, 0x00, sizeof(resApduBuff));
 
+    /* Checked before bringing link up, ctx is NULL while it is down */
+    if (se_gto_select_cache_lookup(ctx, aid.data(), aid.size(), p2)) {
+        ALOGD("SecureElement:%s: AID known to be absent", __func__);
+        _hidl_cb(resApduBuff, SecureElementStatus::NO_SUCH_ELEMENT_ERROR);
+        return Void();
+    }
+
     if (!checkSeUp) {
         if (initializeSE() != EXIT_SUCCESS) {
             ALOGE("SecureElement:%s: Failed to re-initialise the eSE HAL", __func__);
@@ -236,14 +346,14 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid, uin
         apdu[index++] = 0x00;
         apdu[index++] = 0x01;
 
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
 
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s Manage channel resp_len = %d", __func__,resp_len);
     }
 
     if (resp_len >= 0)
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
 
     if (resp_len < 0) {
@@ -256,12 +366,22 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid, uin
         if(resp) free(resp);
         _hidl_cb(resApduBuff, mSecureElementStatus);
         return Void();
-    } else if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00) {
+    } else if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00 &&
+               se_gto_channel_open(ctx, resp[0], aid.data(), aid.size(), p2,
+                                   IPCThreadState::self()->getCallingPid()) == 0) {
         resApduBuff.channelNumber = resp[0];
-        nbrOpenChannel++;
         mSecureElementStatus = SecureElementStatus::SUCCESS;
     } else {
-        if (resp[resp_len - 2] == 0x6A && resp[resp_len - 1] == 0x81) {
+        if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00 && resp_len > 2) {
+            /* Channel opened on card but not addressable by CLA, close it */
+            ALOGE("SecureElement:%s: channel %d out of range, closing", __func__, resp[0]);
+            apdu[0] = 0x00;
+            apdu[1] = 0x70;
+            apdu[2] = 0x80;
+            apdu[3] = resp[0];
+            se_gto_apdu_transmit(ctx, apdu, 4, resp, 65536);
+            mSecureElementStatus = SecureElementStatus::CHANNEL_NOT_AVAILABLE;
+        } else if (resp[resp_len - 2] == 0x6A && resp[resp_len - 1] == 0x81) {
             mSecureElementStatus = SecureElementStatus::CHANNEL_NOT_AVAILABLE;
         }else if (resp[resp_len - 2] == 0x68 && resp[resp_len - 1] == 0x81) {
             mSecureElementStatus = SecureElementStatus::CHANNEL_NOT_AVAILABLE;
@@ -292,7 +412,7 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid, uin
 
     if (apdu != NULL && resp!=NULL) {
         index = 0;
-        apdu[index++] = resApduBuff.channelNumber;
+        apdu[index++] = se_gto_channel_cla(0x00, resApduBuff.channelNumber);
         apdu[index++] = 0xA4;
         apdu[index++] = 0x04;
         apdu[index++] = p2;
@@ -302,7 +422,7 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid, uin
         apdu[index] = 0x00;
 
 send_logical:
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s selectApdu resp_len = %d", __func__,resp_len);
     }
@@ -314,7 +434,7 @@ send_logical:
         }
         mSecureElementStatus = SecureElementStatus::IOERROR;
     } else {
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
         if (resp[resp_len - 2] == 0x90 || resp[resp_len - 2] == 0x62 || resp[resp_len - 2] == 0x63) {
             resApduBuff.selectResponse.resize(getResponseOffset + resp_len);
@@ -327,13 +447,13 @@ send_logical:
             getResponseOffset += (resp_len - 2);
             getResponse[4] = resp[resp_len - 1];
             getResponse[0] = apdu[0];
-            dump_bytes("getResponse CMD: ", ':', getResponse, 5, stdout);
+            dump_bytes("getResponse CMD", getResponse, 5);
             free(apdu);
             apdu_len = 5;
             apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
             memset(resp, 0, resp_len);
             memcpy(apdu, getResponse, apdu_len);
-            apdu[0] = resApduBuff.channelNumber;
+            apdu[0] = se_gto_channel_cla(0x00, resApduBuff.channelNumber);
             goto send_logical;
         }
         else if (resp[resp_len - 2] == 0x6C) {
@@ -341,7 +461,7 @@ send_logical:
             memcpy(&resApduBuff.selectResponse[getResponseOffset], resp, resp_len - 2);
             getResponseOffset += (resp_len - 2);
             apdu[4] = resp[resp_len - 1];
-            dump_bytes("case2 getResponse CMD: ", ':', apdu, 5, stdout);
+            dump_bytes("case2 getResponse CMD", apdu, 5);
             memset(resp, 0, resp_len);
             goto send_logical;
         }
@@ -383,6 +503,7 @@ send_logical:
 }
 
 Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid, uint8_t p2, openBasicChannel_cb _hidl_cb) {
+    LatencyScope latency(__func__, SE_GTO_OP_OPEN_BASIC_CHANNEL);
     hidl_vec<uint8_t> result;
 
     SecureElementStatus mSecureElementStatus = SecureElementStatus::IOERROR;
@@ -400,6 +521,13 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid, uint8
         return Void();
     }
 
+    /* Checked before bringing link up, ctx is NULL while it is down */
+    if (se_gto_select_cache_lookup(ctx, aid.data(), aid.size(), p2)) {
+        ALOGD("SecureElement:%s: AID known to be absent", __func__);
+        _hidl_cb(result, SecureElementStatus::NO_SUCH_ELEMENT_ERROR);
+        return Void();
+    }
+
     if (!checkSeUp) {
         if (initializeSE() != EXIT_SUCCESS) {
             ALOGE("SecureElement:%s: Failed to re-initialise the eSE HAL", __func__);
@@ -433,7 +561,7 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid, uint8
         apdu[index] = 0x00;
 
 send_basic:
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s selectApdu resp_len = %d", __func__,resp_len);
     }
@@ -444,14 +572,15 @@ send_basic:
         }
         mSecureElementStatus = SecureElementStatus::IOERROR;
     } else {
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
         if (resp[resp_len - 2] == 0x90 || resp[resp_len - 2] == 0x62 || resp[resp_len - 2] == 0x63) {
             result.resize(getResponseOffset + resp_len);
             memcpy(&result[getResponseOffset], resp, resp_len);
 
             isBasicChannelOpen = true;
-            nbrOpenChannel++;
+            se_gto_channel_open(ctx, BASIC_CHANNEL, aid.data(), aid.size(), p2,
+                                IPCThreadState::self()->getCallingPid());
             mSecureElementStatus = SecureElementStatus::SUCCESS;
         }
         else if (resp[resp_len - 2] == 0x61) {
@@ -460,7 +589,7 @@ send_basic:
             getResponseOffset += (resp_len - 2);
             getResponse[4] = resp[resp_len - 1];
             getResponse[0] = apdu[0];
-            dump_bytes("getResponse CMD: ", ':', getResponse, 5, stdout);
+            dump_bytes("getResponse CMD", getResponse, 5);
             free(apdu);
             apdu_len = 5;
             apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
@@ -473,7 +602,7 @@ send_basic:
             memcpy(&result[getResponseOffset], resp, resp_len - 2);
             getResponseOffset += (resp_len - 2);
             apdu[4] = resp[resp_len - 1];
-            dump_bytes("case2 getResponse CMD: ", ':', apdu, 5, stdout);
+            dump_bytes("case2 getResponse CMD", apdu, 5);
             apdu_len = 5;
             memset(resp, 0, resp_len);
             goto send_basic;
@@ -500,7 +629,8 @@ send_basic:
 }
 
 Return<::android::hardware::secure_element::V1_0::SecureElementStatus> SecureElement::closeChannel(uint8_t channelNumber) {
-    ALOGD("SecureElement:%s start", __func__);
+    LatencyScope latency(__func__, SE_GTO_OP_CLOSE_CHANNEL);
+    ALOGV("SecureElement:%s start", __func__);
     SecureElementStatus mSecureElementStatus = SecureElementStatus::FAILED;
 
     uint8_t *apdu; //65536
@@ -511,17 +641,17 @@ Return<::android::hardware::secure_element::V1_0::SecureElementStatus> SecureEle
     if (!checkSeUp) {
         ALOGE("SecureElement:%s cannot closeChannel, HAL is deinitialized", __func__);
         mSecureElementStatus = SecureElementStatus::FAILED;
-        ALOGD("SecureElement:%s end", __func__);
+        ALOGV("SecureElement:%s end", __func__);
         return mSecureElementStatus;
     }
 
-    if (channelNumber < 0) {
+    if (channelNumber < 0 || channelNumber >= SE_GTO_MAX_CHANNELS) {
         ALOGE("SecureElement:%s Channel not supported", __func__);
         mSecureElementStatus = SecureElementStatus::FAILED;
     } else if (channelNumber == 0) {
         isBasicChannelOpen = false;
         mSecureElementStatus = SecureElementStatus::SUCCESS;
-        nbrOpenChannel--;
+        se_gto_channel_close(ctx, BASIC_CHANNEL);
     } else {
         apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
         resp = (uint8_t*)malloc(65536 * sizeof(uint8_t));
@@ -529,7 +659,7 @@ Return<::android::hardware::secure_element::V1_0::SecureElementStatus> SecureEle
         if (apdu != NULL) {
             uint8_t index = 0;
 
-            apdu[index++] = channelNumber;
+            apdu[index++] = se_gto_channel_cla(0x00, channelNumber);
             apdu[index++] = 0x70;
             apdu[index++] = 0x80;
             apdu[index++] = channelNumber;
@@ -545,7 +675,7 @@ Return<::android::hardware::secure_element::V1_0::SecureElementStatus> SecureEle
             }
         } else if ((resp[resp_len - 2] == 0x90) && (resp[resp_len - 1] == 0x00)) {
             mSecureElementStatus = SecureElementStatus::SUCCESS;
-            nbrOpenChannel--;
+            se_gto_channel_close(ctx, channelNumber);
         } else {
             mSecureElementStatus = SecureElementStatus::FAILED;
         }
@@ -553,45 +683,36 @@ Return<::android::hardware::secure_element::V1_0::SecureElementStatus> SecureEle
         if(resp) free(resp);
     }
 
-    if (nbrOpenChannel == 0 && isBasicChannelOpen == false) {
+    if (se_gto_channel_count(ctx) == 0 && isBasicChannelOpen == false) {
         ALOGD("SecureElement:%s All Channels are closed", __func__);
         if (deinitializeSE() != SecureElementStatus::SUCCESS) {
             ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
         }
     }
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
     return mSecureElementStatus;
 }
 
-void
-SecureElement::dump_bytes(const char *pf, char sep, const uint8_t *p, int n, FILE *out)
-{
-    const uint8_t *s = p;
-    char *msg;
-    int len = 0;
-    int input_len = n;
-
-    if (!debug_log_enabled) return;
+Return<void> SecureElement::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /* options */) {
+    const native_handle_t *handle = fd.getNativeHandle();
 
-    msg = (char*) malloc ( (pf ? strlen(pf) : 0) + input_len * 3 + 1);
-    if(!msg) {
-        errno = ENOMEM;
-        return;
-    }
+    if (handle == nullptr || handle->numFds < 1)
+        return Void();
 
-    if (pf) {
-        len += sprintf(msg , "%s" , pf);
-    }
-    while (input_len--) {
-        len += sprintf(msg + len, "%02X" , *s++);
-        if (input_len && sep) {
-            len += sprintf(msg + len, ":");
-        }
-    }
-    sprintf(msg + len, "\n");
-    ALOGD("SecureElement:%s ==> size = %d data = %s", __func__, n, msg);
+    /* Counters only, no exchange with Secure Element. Link is down and ctx
+     * NULL whenever no channel is open: process-wide counters are dumped */
+    std::lock_guard<std::mutex> lock(ctxLock);
+    if (se_gto_dump(ctx, handle->data[0]) < 0)
+        dprintf(handle->data[0], "se-gto: dump failed: %s\n", strerror(errno));
+    return Void();
+}
 
-    if(msg) free(msg);
+/* Hex encoded by log thread from a table, only when debug is enabled */
+void
+SecureElement::dump_bytes(const char *pf, const uint8_t *p, int n)
+{
+    if (debug_log_enabled && (n > 0))
+        se_gto_log_hex(ctx, pf, p, n);
 }
 
 int
@@ -615,7 +736,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
     int sw;
 
     if (verbose)
-        dump_bytes("APDU: ", ':', apdu, n, stdout);
+        dump_bytes("APDU", apdu, n);
 
 
     n = se_gto_apdu_transmit(ctx, apdu, n, resp, sizeof(resp));
@@ -623,7 +744,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
         ALOGE("SecureElement:%s FAILED: APDU transmit (%s).\n\n", __func__, strerror(errno));
         return -2;
     } else if (n < 2) {
-        dump_bytes("RESP: ", ':', resp, n, stdout);
+        dump_bytes("RESP", resp, n);
         ALOGE("SecureElement:%s FAILED: not enough data to have a status word.\n", __func__);
         return -2;
     }
@@ -632,7 +753,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
         sw = (resp[n - 2] << 8) | resp[n - 1];
         printf("%d bytes, SW=0x%04x\n", n - 2, sw);
         if (n > 2)
-            dump_bytes("RESP: ", ':', resp, n - 2, stdout);
+            dump_bytes("RESP", resp, n - 2);
     }
     return 0;
 }
@@ -675,6 +796,19 @@ SecureElement::parseConfigFile(FILE *f, int verbose)
                     se_gto_set_log_level(ctx, 3);
                 }
             }
+        } else if (strcmp("GTO_SESSION_RESUME", pch) == 0) {
+            pch = strtok(NULL, " =;");
+            ALOGD("SecureElement:%s Session resume : %s", __func__, pch);
+            if (pch != NULL) {
+                session_resume_enabled = (strcmp(pch, "enable") == 0);
+            }
+        } else if (strcmp("\n", pch) != 0) {
+            char *key = pch;
+            pch = strtok(NULL, " =;");
+            ALOGD("SecureElement:%s Option %s : %s", __func__, key, pch);
+            if (pch != NULL && se_gto_set_config(ctx, key, pch) < 0) {
+                ALOGE("SecureElement:%s Option %s ignored: %s", __func__, key, strerror(errno));
+            }
         }
     }
     return 0;
@@ -723,9 +857,11 @@ Return<::android::hardware::secure_element::V1_0::SecureElementStatus>
 SecureElement::deinitializeSE() {
     SecureElementStatus mSecureElementStatus = SecureElementStatus::FAILED;
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
 
     if(checkSeUp){
+        std::lock_guard<std::mutex> lock(ctxLock);
+
         if (se_gto_close(ctx) < 0) {
             mSecureElementStatus = SecureElementStatus::FAILED;
             internalClientCallback->onStateChange(false);
@@ -733,7 +869,6 @@ SecureElement::deinitializeSE() {
             ctx = NULL;
             mSecureElementStatus = SecureElementStatus::SUCCESS;
             isBasicChannelOpen = false;
-            nbrOpenChannel = 0;
         }
         checkSeUp = false;
     }else{
@@ -741,7 +876,7 @@ SecureElement::deinitializeSE() {
         mSecureElementStatus = SecureElementStatus::SUCCESS;
     }
 
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
     return mSecureElementStatus;
 }
 }  // namespace implementation
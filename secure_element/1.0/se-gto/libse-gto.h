@@ -19,12 +19,17 @@
  *
  * libse-gto to dialog with device T=1 protocol over SPI.
  *
- * This library is not thread safe on same context.
+ * Exchanges on a context are serialized, so that health monitor thread can
+ * share it with the caller. Configuration calls are not thread safe.
  */
 
 #ifndef LIBSE_GTO_H
 #define LIBSE_GTO_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -119,6 +124,19 @@ se_gto_log_fn *se_gto_get_log_fn(struct se_gto_ctx *ctx);
  */
 void se_gto_set_log_fn(struct se_gto_ctx *ctx, se_gto_log_fn *fn);
 
+/** Log bytes in hexadecimal at debug level.
+ *
+ * Bytes are copied, and encoded later by log thread, see GTO_LOG_ASYNC.
+ * Nothing is done below debug level.
+ *
+ * @param ctx  se-gto library context, may be NULL
+ * @param what label of line, kept by address: must be a string literal
+ * @param p    bytes to log
+ * @param n    number of bytes
+ */
+void se_gto_log_hex(struct se_gto_ctx *ctx, const char *what, const void *p,
+                    size_t n);
+
 void *se_gto_get_userdata(struct se_gto_ctx *ctx);
 
 /** Store custom userdata in the library context.
@@ -150,6 +168,98 @@ const char *se_gto_get_gtodev(struct se_gto_ctx *ctx);
  */
 void se_gto_set_gtodev(struct se_gto_ctx *ctx, const char *gtodev);
 
+/** Set library option by name.
+ *
+ * Options use the same names as in HAL configuration file:
+ *
+ *  - GTO_GETDATA_CACHE: comma separated list of GET DATA tags (P1-P2 as 4 hex
+ *    digits) whose response is static, such as 9F7F for CPLC. Responses
+ *    are then served from memory until next reset. Empty by default.
+ *  - GTO_STATE_FILE: path of a file where link parameters are saved after
+ *    each reset, for se_gto_resume() in a later process. Unset by default.
+ *  - GTO_HEALTH_MONITOR: idle time in milliseconds after which a background
+ *    thread probes Secure Element, 0 to disable. Disabled by default.
+ *  - GTO_APDU_DEADLINE: time in milliseconds given to each APDU sent with
+ *    se_gto_apdu_transmit(), 0 for none. None by default.
+ *  - GTO_WAIT_STRATEGY: how to wait for card blocks. "fixed" polls every
+ *    GTO_WAIT_POLL_US (2000 by default). "hybrid" polls without sleeping
+ *    for GTO_WAIT_SPIN_US (100), then sleeps from 50 us doubling up to
+ *    GTO_WAIT_BACKOFF_MAX_US (2000), then, once 10 times that has elapsed,
+ *    sleeps GTO_WAIT_SLEEP_US (5000) between polls. Default is "fixed".
+ *  - GTO_WAIT_PROFILE: "enable" to learn response time per command class
+ *    (CLA type, INS, P1, Lc range) and poll for the response first just
+ *    before it is expected. Learned times are kept in GTO_STATE_FILE if
+ *    set. Disabled by default.
+ *  - GTO_RT_POLICY: "fifo" or "rr" to run exchanges with real-time policy
+ *    SCHED_FIFO or SCHED_RR at GTO_RT_PRIORITY (1 to 99), "other" to keep
+ *    thread policy. GTO_RT_CPUS restricts exchanges to a list of CPUs such
+ *    as "4-7" or "2,3". GTO_RT_TIMER_SLACK_NS sets timer slack, 1 for the
+ *    tightest wake-up. Calling thread gets these settings for the time of
+ *    an exchange only. All unset by default.
+ *  - GTO_CLK_TUNE: "enable" to tune SPI clock speed from link errors. After
+ *    each window of 128 blocks received without checksum error or
+ *    retransmission, speed is raised by GTO_CLK_STEP_HZ (1/8 of driver speed
+ *    by default) up to GTO_CLK_MAX_HZ. More than GTO_CLK_ERROR_LIMIT (2)
+ *    errors in a window steps back down, a failed exchange goes back to
+ *    driver speed. Fastest speed is kept per device in GTO_STATE_FILE.
+ *    Driver must implement GTO_IOC_RD_CLK_SPEED and GTO_IOC_WR_CLK_SPEED,
+ *    whose request number is the same as GTO_IOC_WR_RESET: tuning is off
+ *    when speed cannot be read, and a write leaving speed unchanged is
+ *    taken as a reset: next APDU fails with @c errno set to ECONNRESET and
+ *    link is reset, so that channels are opened again.
+ *    Disabled by default.
+ *  - GTO_IFS_TUNE: "enable" to choose block size from measured throughput.
+ *    Link starts with largest blocks, 254 bytes or card IFSC. When blocks
+ *    are corrupted or sent again, smaller sizes (128, 64, 32) are tried
+ *    per direction and the one carrying most bytes per second is kept,
+ *    IFSD being negotiated again with card. Sizes up to 4089 bytes are
+ *    also tried with GTO_T1_PROTOCOL "gp". Disabled by default.
+ *  - GTO_T1_PROTOCOL: block format, "iso" for ISO7816-3 T=1 with RESET
+ *    request (default), or "gp" for GlobalPlatform T=1 over SPI/I2C: 2 bytes
+ *    length, blocks up to 4089 bytes, CRC ISO/IEC 13239, software reset then
+ *    CIP to read card parameters, whose historical bytes are returned as
+ *    ATR, and RELEASE request on close.
+ *  - GTO_NAD: NAD sent to endpoint, 2 hex digits, "12" by default, "21"
+ *    with GP. Several endpoints behind one device, such as eSE OS and a
+ *    vendor domain, each get their own context with a different NAD, and
+ *    their own GTO_STATE_FILE if any. Contexts on same device node share
+ *    its file descriptor, and exchanges of all endpoints are interleaved
+ *    one block at a time. GTO_CLK_TUNE applies to the whole device, so
+ *    should be enabled on one endpoint at most.
+ *  - GTO_TRACE_FILE: path of a file where APDUs and T=1 blocks are recorded
+ *    in binary, for gto_trace tool to decode. File is a ring of
+ *    GTO_TRACE_RECORDS records of 64 bytes (4096 by default), kept when HAL
+ *    crashes. GTO_TRACE_SAMPLE records one APDU exchange out of N (1 by
+ *    default). GTO_TRACE_PAYLOAD is "none", "redact" to keep only command
+ *    header, status word and S-BLOCK content (default), or "full" for first
+ *    28 bytes of each. Unset by default.
+ *  - GTO_PCAP_FILE: path of a pcapng file where every T=1 block and APDU
+ *    is appended with nanosecond timestamp, for Wireshark. Link type is
+ *    USER0 (147), with an 8 bytes header giving packet type, retransmission,
+ *    checksum error and WTX flags, retry count and wait time, see pcap.h.
+ *    Payload is not redacted. Unset by default.
+ *  - GTO_METRICS_FILE: path of a file mapped as a shared page where protocol
+ *    and health counters and latency histograms are copied at end of each
+ *    HAL operation, under a sequence lock, see metrics.h. Page is set up
+ *    once per process and counters keep adding up across contexts. Read by
+ *    gto_metrics tool without calling the HAL. Unset by default.
+ *  - GTO_LOG_ASYNC: "enable" to format log messages on a log thread, off
+ *    exchange path, or "disable" to format them on calling thread. Enabled
+ *    by default.
+ *  - GTO_LOG_RATE: messages logged per second from a same format, others
+ *    are counted and dropped, 0 for no limit. Errors and warnings are
+ *    always logged. Default is 20.
+ *
+ * @param ctx   se-gto library context.
+ * @param key   option name.
+ * @param value option value as read from configuration file.
+ *
+ * @c errno is set to ENOENT for an unknown option, EINVAL for a bad value.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_set_config(struct se_gto_ctx *ctx, const char *key, const char *value);
+
 /****************************** APDU protocol *******************************/
 
 /** Send reset command to Secure Element and return ATR bytes.
@@ -164,6 +274,23 @@ void se_gto_set_gtodev(struct se_gto_ctx *ctx, const char *gtodev);
  */
 int se_gto_reset(struct se_gto_ctx *ctx, void *atr, size_t r);
 
+/** Resume link with Secure Element left powered by a former process.
+ *
+ * Link parameters saved in GTO_STATE_FILE by last reset are restored, then
+ * sequence numbers are restarted with a RESYNCH request and IFSD is
+ * negotiated again. Logical channels recorded as open are closed. No reset
+ * is sent: on failure, caller is expected to use se_gto_reset().
+ *
+ * @param ctx se-gto library context
+ * @param atr byte buffer to receive saved ATR content
+ * @param r   length of ATR byte buffer.
+ *
+ * @c errno is set on error, ENODATA if there is no usable state.
+ *
+ * @returns number of bytes in @c atr buffer or -1 on error.
+ */
+int se_gto_resume(struct se_gto_ctx *ctx, void *atr, size_t r);
+
 /** Transmit APDU to Secure Element
  *
  * If needed to comply with request from command, multiple ISO7816 Get
@@ -187,6 +314,357 @@ int se_gto_reset(struct se_gto_ctx *ctx, void *atr, size_t r);
  */
 int se_gto_apdu_transmit(struct se_gto_ctx *ctx, const void *apdu, int n, void *resp, int r);
 
+/** Transmit APDU to Secure Element, giving up at deadline.
+ *
+ * Same as se_gto_apdu_transmit(), except that if response is not received
+ * by @c deadline, or if se_gto_apdu_cancel() is called meanwhile, command
+ * is aborted with an ABORT request from host. Secure Element is not reset:
+ * T=1 sequence numbers are resynchronized on next exchange.
+ *
+ * T=1 is half duplex: ABORT is only sent when host has the turn, in place
+ * of answer to a waiting time extension request or between blocks of a
+ * chain. While card processes the command without asking for more time,
+ * its block is awaited, so the exchange may end after deadline, with the
+ * response if it arrives meanwhile.
+ *
+ * @param deadline CLOCK_MONOTONIC absolute time, NULL for none.
+ *
+ * @c errno is set to ETIME on deadline, ECANCELED on cancel.
+ *
+ * @returns number of bytes filled in @c resp buffer. -1 on error.
+ */
+int se_gto_apdu_transmit_deadline(struct se_gto_ctx *ctx, const void *apdu, int n,
+                                  void *resp, int r, const struct timespec *deadline);
+
+/** Cancel APDU exchange in progress.
+ *
+ * Can be called from any thread. Exchange in progress in another thread
+ * fails with @c errno set to ECANCELED. Has no effect when nothing is
+ * being exchanged.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_apdu_cancel(struct se_gto_ctx *ctx);
+
+/**************************** Logical channels ******************************/
+
+/** Number of channels addressable through CLA byte, basic channel included.
+ *
+ * Channels 0 to 3 use first interindustry CLA coding, channels 4 to 19 use
+ * further interindustry CLA coding (ISO7816-4).
+ */
+#define SE_GTO_MAX_CHANNELS 20
+
+enum { SE_GTO_CHANNEL_CLOSED, SE_GTO_CHANNEL_OPEN };
+
+/** State of one entry in the channel table. */
+struct se_gto_channel_info {
+    int      state;        /**< SE_GTO_CHANNEL_CLOSED or SE_GTO_CHANNEL_OPEN */
+    uint8_t  aid[16];      /**< AID of selected application                */
+    uint8_t  aid_len;      /**< 0 when default application is selected     */
+    uint8_t  p2;           /**< P2 used by last SELECT by name             */
+    int      owner;        /**< Client identifier, process id for the HAL  */
+    uint64_t open_time_ms; /**< CLOCK_MONOTONIC time of channel opening    */
+    uint32_t apdu_count;   /**< APDU transmitted on the channel            */
+    uint32_t apdu_errors;  /**< APDU that failed at transport level        */
+};
+
+/** Encode channel number in CLA byte.
+ *
+ * @param cla     class byte in first interindustry coding, channel bits clear.
+ * @param channel channel number from 0 to SE_GTO_MAX_CHANNELS - 1.
+ *
+ * @returns CLA byte, or -1 if channel is out of range.
+ */
+int se_gto_channel_cla(int cla, int channel);
+
+/** Decode channel number from CLA byte.
+ *
+ * @param cla class byte, interindustry coding.
+ *
+ * @returns channel number.
+ */
+int se_gto_cla_channel(int cla);
+
+/** Record channel as open in channel table.
+ *
+ * Application selected on the channel is later updated by each successful
+ * SELECT by name transmitted on the channel.
+ *
+ * @param ctx     se-gto library context
+ * @param channel channel number returned by MANAGE CHANNEL, 0 for basic.
+ * @param aid     AID to be selected on channel, may be NULL if @c aid_len is 0.
+ * @param aid_len length of @c aid, at most 16 bytes.
+ * @param p2      P2 of SELECT command.
+ * @param owner   client identifier.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_channel_open(struct se_gto_ctx *ctx, int channel, const void *aid,
+                        size_t aid_len, int p2, int owner);
+
+/** Record channel as closed in channel table.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_channel_close(struct se_gto_ctx *ctx, int channel);
+
+/** Returns number of open channels, basic channel included.
+ *
+ * @param ctx se-gto library context, may be NULL.
+ */
+int se_gto_channel_count(struct se_gto_ctx *ctx);
+
+/** Copy channel table entry.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_channel_get_info(struct se_gto_ctx *ctx, int channel,
+                            struct se_gto_channel_info *info);
+
+/** Reset Secure Element and restore open channels.
+ *
+ * Channels open before reset are opened again with same channel number
+ * (MANAGE CHANNEL with P2 set) and their application is selected again
+ * with same AID and P2. A channel refused by card is left closed, clients
+ * can compare channel table before and after.
+ *
+ * When last exchange failed and T=1 layer already reset Secure Element to
+ * recover the link, channels are restored on top of that reset instead of
+ * resetting again.
+ *
+ * @param ctx se-gto library context
+ * @param atr byte buffer to receive ATR content
+ * @param r   length of ATR byte buffer.
+ *
+ * @c errno is set on error.
+ *
+ * @returns number of bytes in @c atr buffer or -1 on reset or transport
+ * error.
+ */
+int se_gto_channel_resume(struct se_gto_ctx *ctx, void *atr, size_t r);
+
+/************************* Negative SELECT cache ****************************/
+
+/** Check if application is known to be absent from Secure Element.
+ *
+ * SELECT by name answered with 6A82 is remembered for the device, per AID and
+ * P2, so that repeated probes for applications that are not installed can be
+ * answered without exchange with Secure Element. Entries are dropped on
+ * successful SELECT of the AID, on STORE DATA, INSTALL or LOAD commands, on
+ * every reset of Secure Element, and when ATR changes after se_gto_resume().
+ *
+ * Lookup does not need link to be up: with a NULL context, it answers for
+ * the device of last reset in the process, so that a client probing an
+ * absent application does not cause a context to be opened.
+ *
+ * @param ctx se-gto library context, or NULL when none is open
+ * @param aid AID to be selected
+ * @param len length of @c aid
+ * @param p2  P2 of SELECT command
+ *
+ * @returns 1 if SELECT is known to fail with 6A82, 0 otherwise.
+ */
+int se_gto_select_cache_lookup(struct se_gto_ctx *ctx, const void *aid,
+                               size_t len, int p2);
+
+/** Forget all applications known to be absent. */
+void se_gto_select_cache_flush(void);
+
+/** Returns negative SELECT cache counters.
+ *
+ * @param hits   number of lookups answered from cache, may be NULL.
+ * @param misses number of lookups not in cache, may be NULL.
+ */
+void se_gto_select_cache_stats(unsigned long *hits, unsigned long *misses);
+
+/***************************** Wait statistics ******************************/
+
+/** Cost of waiting for blocks from card, see GTO_WAIT_STRATEGY. */
+struct se_gto_wait_stats {
+    uint64_t blocks;         /**< Blocks waited for                          */
+    uint64_t polls;          /**< Readiness checks on device                 */
+    uint64_t wait_us;        /**< Time from start of wait until block seen   */
+    uint64_t wasted_us;      /**< Sum of last sleep before each block, upper
+                              *   bound of time block was ready unseen     */
+    uint32_t last_polls;     /**< Same for last block                        */
+    uint32_t last_wait_us;
+    uint32_t last_wasted_us;
+    uint64_t wakes;          /**< Sleeps between polls                       */
+    uint64_t late_us;        /**< Sum of wake-up delay past requested time,
+                              *   see GTO_RT_POLICY                         */
+    uint32_t late_max_us;    /**< Worst wake-up delay                        */
+    uint32_t last_late_us;   /**< Wake-up delay of last sleep                */
+};
+
+/** Copy wait statistics.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_get_wait_stats(struct se_gto_ctx *ctx, struct se_gto_wait_stats *stats);
+
+/**************************** Protocol statistics ***************************/
+
+/** Where time of APDU exchanges goes, and protocol events seen.
+ *
+ * All blocks of the exchange are included: chained blocks, requests,
+ * retransmissions, and reset after failure.
+ */
+struct se_gto_phase {
+    uint64_t send_us;     /**< Writing blocks to device                   */
+    uint64_t wait_us;     /**< Polling until card NAD is seen             */
+    uint64_t read_us;     /**< Reading rest of blocks after NAD           */
+    uint64_t polls;       /**< Readiness checks on device                 */
+    uint64_t wtx;         /**< Waiting time extensions asked by card      */
+    uint64_t retransmits; /**< Blocks sent again on error or timeout      */
+    uint64_t chk_errors;  /**< Blocks with bad checksum, either side      */
+    uint64_t resyncs;     /**< RESYNCH requests completed                 */
+    uint64_t resets;      /**< Resets of Secure Element                   */
+    uint64_t blocks_tx;
+    uint64_t blocks_rx;
+    uint64_t bytes_tx;    /**< Bytes written on the wire                  */
+    uint64_t bytes_rx;    /**< Bytes read on the wire, polls included     */
+};
+
+struct se_gto_stats {
+    uint64_t            transceives; /**< APDU exchanges with card        */
+    struct se_gto_phase last;        /**< Last APDU exchange              */
+    struct se_gto_phase total;       /**< Since se_gto_new(), resets too   */
+};
+
+/** Copy protocol statistics.
+ *
+ * Counters are always maintained, at the cost of a few clock readings per
+ * block.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_get_stats(struct se_gto_ctx *ctx, struct se_gto_stats *stats);
+
+/**************************** Latency histograms ****************************/
+
+/** HAL operations timed with se_gto_latency_start() and se_gto_latency_end() */
+enum {
+    SE_GTO_OP_TRANSMIT,
+    SE_GTO_OP_OPEN_LOGICAL_CHANNEL,
+    SE_GTO_OP_OPEN_BASIC_CHANNEL,
+    SE_GTO_OP_CLOSE_CHANNEL,
+    SE_GTO_OP_RESET,
+    SE_GTO_OP_COUNT
+};
+
+/** Key of histogram read with se_gto_get_latency() */
+enum {
+    SE_GTO_LATENCY_BY_OP,      /**< One of SE_GTO_OP_*               */
+    SE_GTO_LATENCY_BY_INS,     /**< INS byte of transmitted APDUs    */
+    SE_GTO_LATENCY_BY_CHANNEL, /**< Channel of transmitted APDUs     */
+};
+
+/** Distribution of durations, percentiles are within 25% of actual value. */
+struct se_gto_latency {
+    uint64_t count;   /**< Operations timed                   */
+    uint64_t sum_us;
+    uint32_t max_us;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t p999_us;
+};
+
+/** Returns start time of an operation, to be passed to se_gto_latency_end(). */
+uint64_t se_gto_latency_start(void);
+
+/** Record duration of a HAL operation.
+ *
+ * Safe to call from any thread without holding a lock. Histograms are
+ * shared by all contexts of the process and outlive them.
+ *
+ * @param ctx     se-gto library context, to publish GTO_METRICS_FILE, may be
+ *                NULL once context is freed
+ * @param op      one of SE_GTO_OP_*
+ * @param ins     INS of transmitted APDU, -1 if none
+ * @param channel channel of transmitted APDU, -1 if none
+ * @param start   value returned by se_gto_latency_start()
+ */
+void se_gto_latency_end(struct se_gto_ctx *ctx, int op, int ins, int channel,
+                        uint64_t start);
+
+/** Read latency histogram.
+ *
+ * Only the first 16 INS seen have their own histogram, later ones are
+ * reported together under any of them not in the first 16.
+ *
+ * @c errno is set on error.
+ *
+ * @param ctx se-gto library context, unused, may be NULL
+ * @param by  one of SE_GTO_LATENCY_BY_*
+ * @param key operation, INS or channel number
+ * @param lat filled with distribution, count is 0 if never seen
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_get_latency(struct se_gto_ctx *ctx, int by, int key,
+                       struct se_gto_latency *lat);
+
+/******************************** Dump **************************************/
+
+/** Write state of link and performance counters as text.
+ *
+ * Reports link parameters, power state, open channels, bus queue, protocol
+ * and health counters, select cache hits and latency percentiles, for
+ * binder dump. Context is only locked while state is copied, nothing is
+ * allocated. Caller must keep context from being closed meanwhile.
+ *
+ * @c errno is set on error.
+ *
+ * @param ctx se-gto library context, NULL to report process-wide select
+ *            cache and latency only
+ * @param fd  file descriptor to write to
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_dump(struct se_gto_ctx *ctx, int fd);
+
+/***************************** Health monitor *******************************/
+
+/** Link health as seen by background monitor, see GTO_HEALTH_MONITOR.
+ *
+ * Once the link has been idle for the configured period, it is probed with
+ * an IFS request. A probe slower than 4 times the fastest one is counted
+ * and logged only. A failed probe resets Secure Element when no channel is
+ * open. With channels open, nothing is reset behind clients: next APDU
+ * fails with @c errno set to ECONNRESET instead. When monitor is enabled,
+ * se_gto_close() no longer checks the link synchronously.
+ */
+struct se_gto_health {
+    uint32_t probes;          /**< IFS requests sent while idle           */
+    uint32_t probe_errors;    /**< Probes not answered                    */
+    uint32_t drift_warnings;  /**< Probes slower than 4 times baseline    */
+    uint32_t recoveries;      /**< Proactive resets, no channel open      */
+    uint32_t recovery_errors; /**< Recoveries that failed                 */
+    uint32_t rtt_last_us;     /**< Response time of last probe            */
+    uint32_t rtt_ewma_us;     /**< Moving average of probe response time  */
+    uint32_t rtt_base_us;     /**< Fastest probe seen, drift baseline     */
+};
+
+/** Copy health monitor counters.
+ *
+ * @c errno is set on error.
+ *
+ * @returns -1 on error, 0 otherwise.
+ */
+int se_gto_get_health(struct se_gto_ctx *ctx, struct se_gto_health *health);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
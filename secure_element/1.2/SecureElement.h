@@ -25,6 +25,7 @@ namespace V1_2 {
 namespace implementation {
 
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_memory;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
@@ -47,12 +48,13 @@ struct SecureElement : public ISecureElement , public hidl_death_recipient {
     Return<bool> isCardPresent() override;
     Return<::android::hardware::secure_element::V1_0::SecureElementStatus> closeChannel(uint8_t channelNumber) override;
     Return<::android::hardware::secure_element::V1_0::SecureElementStatus> reset() override;
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
 
 
     private:
-    uint8_t nbrOpenChannel = 0;
     bool isBasicChannelOpen = false;
     bool checkSeUp = false;
+    bool isFirstInit = true;
     uint8_t atr[32];
     uint8_t atr_size;
     char config_filename[100];
@@ -64,8 +66,10 @@ struct SecureElement : public ISecureElement , public hidl_death_recipient {
     void serviceDied(uint64_t, const wp<IBase>&) override;
     static int run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *resp, int n, int verbose);
     static int toint(char c);
-    static void dump_bytes(const char *pf, char sep, const uint8_t *p, int n, FILE *out);
+    static void dump_bytes(const char *pf, const uint8_t *p, int n);
     int resetSE();
+    int resumeSE();
+    int recoverSE();
     int openConfigFile(int verbose);
     int parseConfigFile(FILE *f, int verbose);
 };
@@ -10,6 +10,8 @@
  * See the License for the specific language governing permissions and limitations under the License.
 
  ****************************************************************************/
+#define ATRACE_TAG ATRACE_TAG_HAL
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,7 +22,11 @@
 #include <libgen.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
 #include <log/log.h>
+#include <cutils/trace.h>
 #include <android-base/properties.h>
 #include <dlfcn.h>
 
@@ -50,10 +56,36 @@ namespace se {
 
 uint8_t getResponse[5] = {0x00, 0xC0, 0x00, 0x00, 0x00};
 static struct se_gto_ctx *ctx;
+
+static std::atomic<int> halCalls;
+
+/* Held while ctx is freed, and by dump which may run on any binder thread */
+static std::mutex ctxLock;
+
+/* Times HAL operation into latency histograms and system trace, until end of scope */
+struct LatencyScope {
+    struct se_gto_ctx *c;
+    int op, ins, channel;
+    uint64_t start;
+
+    LatencyScope(const char *name, int op, int ins = -1, int channel = -1)
+        : c(ctx), op(op), ins(ins), channel(channel), start(se_gto_latency_start()) {
+        ATRACE_BEGIN(name);
+        ATRACE_INT("se-gto HAL calls", ++halCalls);
+    }
+    ~LatencyScope() {
+        /* Histograms are process-wide, context entered with may have been
+         * freed by deinitializeSE(): only publish through it if still in use */
+        se_gto_latency_end(c == ctx ? c : NULL, op, ins, channel, start);
+        ATRACE_INT("se-gto HAL calls", --halCalls);
+        ATRACE_END();
+    }
+};
+
 bool debug_log_enabled = false;
+bool session_resume_enabled = false;
 
 SecureElement::SecureElement(const char* ese_name){
-    nbrOpenChannel = 0;
     ctx = NULL;
 
     strncpy(ese_flag_name, ese_name, 4);
@@ -68,14 +100,13 @@ int SecureElement::resetSE(){
     int n;
 
     isBasicChannelOpen = false;
-    nbrOpenChannel = 0;
 
     ALOGD("SecureElement:%s se_gto_reset start", __func__);
     n = se_gto_reset(ctx, atr, sizeof(atr));
     if (n >= 0) {
         atr_size = n;
         ALOGD("SecureElement:%s received ATR of %d bytes\n", __func__, n);
-        dump_bytes("ATR: ", ':',  atr, n, stdout);
+        dump_bytes("ATR", atr, n);
     } else {
         ALOGE("SecureElement:%s Failed to reset and get ATR: %s\n", __func__, strerror(errno));
     }
@@ -83,19 +114,67 @@ int SecureElement::resetSE(){
     return n;
 }
 
+int SecureElement::resumeSE(){
+    int n;
+
+    isBasicChannelOpen = false;
+
+    ALOGD("SecureElement:%s se_gto_resume start", __func__);
+    n = se_gto_resume(ctx, atr, sizeof(atr));
+    if (n >= 0) {
+        atr_size = n;
+        ALOGD("SecureElement:%s resumed with ATR of %d bytes\n", __func__, n);
+    } else {
+        ALOGD("SecureElement:%s No resume, SE will be reset: %s\n", __func__, strerror(errno));
+    }
+
+    return n;
+}
+
+int SecureElement::recoverSE(){
+    struct timespec start, end;
+    struct se_gto_channel_info info;
+    int before = se_gto_channel_count(ctx);
+    int n;
+
+    if (!session_resume_enabled)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = se_gto_channel_resume(ctx, atr, sizeof(atr));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (n >= 0) {
+        atr_size = n;
+        isBasicChannelOpen = se_gto_channel_get_info(ctx, BASIC_CHANNEL, &info) == 0 &&
+                             info.state == SE_GTO_CHANNEL_OPEN;
+        ALOGD("SecureElement:%s %d of %d channels resumed in %ld ms", __func__,
+              se_gto_channel_count(ctx), before,
+              (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+    } else {
+        ALOGE("SecureElement:%s Failed to resume channels: %s\n", __func__, strerror(errno));
+    }
+
+    return n;
+}
+
 int SecureElement::initializeSE() {
 
     int n;
+    struct timespec start, end;
+    bool resumed = false;
     int ret = 0;
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
 
     if (checkSeUp) {
         ALOGD("SecureElement:%s Already initialized", __func__);
-        ALOGD("SecureElement:%s end", __func__);
+        ALOGV("SecureElement:%s end", __func__);
         return EXIT_SUCCESS;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     if (se_gto_new(&ctx) < 0) {
         ALOGE("SecureElement:%s se_gto_new FATAL:%s", __func__,strerror(errno));
 
@@ -110,7 +189,13 @@ int SecureElement::initializeSE() {
         return EXIT_FAILURE;
     }
 
-    ret = resetSE();
+    /* SE stayed powered if HAL process was restarted */
+    if (isFirstInit) {
+        isFirstInit = false;
+        resumed = resumeSE() >= 0;
+    }
+
+    ret = resumed ? 0 : resetSE();
 
     if (ret < 0 && (strncmp(ese_flag_name, "eSE2", 4) == 0)) {
         sleep(6);
@@ -118,6 +203,7 @@ int SecureElement::initializeSE() {
         ret = resetSE();
     }
     if (ret < 0) {
+        std::lock_guard<std::mutex> lock(ctxLock);
         se_gto_close(ctx);
         ctx = NULL;
         return EXIT_FAILURE;
@@ -125,13 +211,18 @@ int SecureElement::initializeSE() {
 
     checkSeUp = true;
 
-    ALOGD("SecureElement:%s end", __func__);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ALOGD("SecureElement:%s SE ready in %ld ms with %s", __func__,
+          (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000),
+          resumed ? "RESYNCH" : "RESET");
+
+    ALOGV("SecureElement:%s end", __func__);
     return EXIT_SUCCESS;
 }
 
 ScopedAStatus SecureElement::init(const std::shared_ptr<ISecureElementCallback>& clientCallback) {
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
     if (clientCallback == nullptr) {
         ALOGE("SecureElement:%s clientCallback == nullptr", __func__);
         return ScopedAStatus::fromExceptionCode(EX_NULL_POINTER);
@@ -147,7 +238,7 @@ ScopedAStatus SecureElement::init(const std::shared_ptr<ISecureElementCallback>&
         clientCallback->onStateChange(true, "SE Initialized");
     }
 
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
 
     return ScopedAStatus::ok();
 }
@@ -166,6 +257,9 @@ ScopedAStatus SecureElement::isCardPresent(bool* aidl_return) {
 }
 
 ScopedAStatus SecureElement::transmit(const std::vector<uint8_t>& data, std::vector<uint8_t>* aidl_return) {
+    LatencyScope latency(__func__, SE_GTO_OP_TRANSMIT,
+                         data.size() >= 4 ? data[1] : -1,
+                         data.size() >= 4 ? se_gto_cla_channel(data[0]) : -1);
 
     uint8_t *apdu;
     uint8_t *resp;
@@ -178,20 +272,25 @@ ScopedAStatus SecureElement::transmit(const std::vector<uint8_t>& data, std::vec
 
     std::vector<uint8_t> result;
 
-    if (checkSeUp && nbrOpenChannel != 0) {
+    if (checkSeUp && se_gto_channel_count(ctx) != 0) {
         if (apdu != NULL) {
             memcpy(apdu, data.data(), data.size());
-            dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+            dump_bytes("CMD", apdu, apdu_len);
             resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         }
 
-        if (resp_len < 0) {
+        if (resp_len < 0 && (errno == ETIME || errno == ECANCELED)) {
+            /* Command aborted on deadline, link is still up */
+            ALOGE("SecureElement:%s: APDU aborted: %s", __func__, strerror(errno));
+        } else if (resp_len < 0) {
             ALOGE("SecureElement:%s: transmit failed", __func__);
-            if (deinitializeSE() != SUCCESS) {
+            /* Give clients their channels back, only this APDU is lost */
+            if ((recoverSE() < 0 || se_gto_channel_count(ctx) == 0) &&
+                deinitializeSE() != SUCCESS) {
                 ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
             }
         } else {
-            dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+            dump_bytes("RESP", resp, resp_len);
             result.resize(resp_len);
             memcpy(&result[0], resp, resp_len);
             status = ScopedAStatus::ok();
@@ -207,10 +306,10 @@ ScopedAStatus SecureElement::transmit(const std::vector<uint8_t>& data, std::vec
 }
 
 ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid, int8_t p2, ::aidl::android::hardware::secure_element::LogicalChannelResponse* aidl_return) {
-    ALOGD("SecureElement:%s start", __func__);
+    LatencyScope latency(__func__, SE_GTO_OP_OPEN_LOGICAL_CHANNEL);
+    ALOGV("SecureElement:%s start", __func__);
 
     std::vector<uint8_t> resApduBuff;
-    size_t ext_channelNumber = 0xff;
     size_t channelNumber = 0xff;
     memset(&resApduBuff, 0x00, sizeof(resApduBuff));
 
@@ -218,6 +317,12 @@ ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid,
         return ScopedAStatus::fromExceptionCode(EX_ILLEGAL_STATE);
     }
 
+    /* Checked before bringing link up, ctx is NULL while it is down */
+    if (se_gto_select_cache_lookup(ctx, aid.data(), aid.size(), p2)) {
+        ALOGD("SecureElement:%s: AID known to be absent", __func__);
+        return ScopedAStatus::fromServiceSpecificError(NO_SUCH_ELEMENT_ERROR);
+    }
+
     if (!checkSeUp) {
         if (initializeSE() != EXIT_SUCCESS) {
             ALOGE("SecureElement:%s: Failed to re-initialise the eSE HAL", __func__);
@@ -252,14 +357,14 @@ ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid,
         apdu[index++] = 0x00;
         apdu[index++] = 0x01;
 
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
 
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s Manage channel resp_len = %d", __func__,resp_len);
     }
 
     if (resp_len >= 0)
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
 
     if (resp_len < 0) {
@@ -271,17 +376,22 @@ ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid,
         if(apdu) free(apdu);
         if(resp) free(resp);
         return ScopedAStatus::fromServiceSpecificError(mSecureElementStatus);
-    } else if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00) {
+    } else if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00 &&
+               se_gto_channel_open(ctx, resp[0], aid.data(), aid.size(), p2,
+                                   AIBinder_getCallingPid()) == 0) {
         channelNumber = resp[0];
-        if(channelNumber > 0x03) {
-          ext_channelNumber = 0x40 + channelNumber - 0x04;
-        } else {
-            ext_channelNumber = channelNumber;
-        }
-        nbrOpenChannel++;
         mSecureElementStatus = SUCCESS;
     } else {
-        if (resp[resp_len - 2] == 0x6A && resp[resp_len - 1] == 0x81) {
+        if (resp[resp_len - 2] == 0x90 && resp[resp_len - 1] == 0x00 && resp_len > 2) {
+            /* Channel opened on card but not addressable by CLA, close it */
+            ALOGE("SecureElement:%s: channel %d out of range, closing", __func__, resp[0]);
+            apdu[0] = 0x00;
+            apdu[1] = 0x70;
+            apdu[2] = 0x80;
+            apdu[3] = resp[0];
+            se_gto_apdu_transmit(ctx, apdu, 4, resp, 65536);
+            mSecureElementStatus = CHANNEL_NOT_AVAILABLE;
+        } else if (resp[resp_len - 2] == 0x6A && resp[resp_len - 1] == 0x81) {
             mSecureElementStatus = CHANNEL_NOT_AVAILABLE;
         }else if (resp[resp_len - 2] == 0x68 && resp[resp_len - 1] == 0x81) {
             mSecureElementStatus = CHANNEL_NOT_AVAILABLE;
@@ -311,7 +421,7 @@ ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid,
 
     if (apdu != NULL && resp!=NULL) {
         index = 0;
-        apdu[index++] = ext_channelNumber;
+        apdu[index++] = se_gto_channel_cla(0x00, channelNumber);
         apdu[index++] = 0xA4;
         apdu[index++] = 0x04;
         apdu[index++] = p2;
@@ -321,7 +431,7 @@ ScopedAStatus SecureElement::openLogicalChannel(const std::vector<uint8_t>& aid,
         apdu[index] = 0x00;
 
 send_logical:
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s selectApdu resp_len = %d", __func__,resp_len);
     }
@@ -333,7 +443,7 @@ send_logical:
         }
         mSecureElementStatus = IOERROR;
     } else {
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
         if (resp[resp_len - 2] == 0x90 || resp[resp_len - 2] == 0x62 || resp[resp_len - 2] == 0x63) {
             resApduBuff.resize(getResponseOffset + resp_len);
@@ -346,13 +456,13 @@ send_logical:
             getResponseOffset += (resp_len - 2);
             getResponse[4] = resp[resp_len - 1];
             getResponse[0] = apdu[0];
-            dump_bytes("getResponse CMD: ", ':', getResponse, 5, stdout);
+            dump_bytes("getResponse CMD", getResponse, 5);
             free(apdu);
             apdu_len = 5;
             apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
             memset(resp, 0, resp_len);
             memcpy(apdu, getResponse, apdu_len);
-            apdu[0] = ext_channelNumber;
+            apdu[0] = se_gto_channel_cla(0x00, channelNumber);
             goto send_logical;
         }
         else if (resp[resp_len - 2] == 0x6C) {
@@ -360,7 +470,7 @@ send_logical:
             memcpy(&resApduBuff[getResponseOffset], resp, resp_len - 2);
             getResponseOffset += (resp_len - 2);
             apdu[4] = resp[resp_len - 1];
-            dump_bytes("case2 getResponse CMD: ", ':', apdu, 5, stdout);
+            dump_bytes("case2 getResponse CMD", apdu, 5);
             memset(resp, 0, resp_len);
             goto send_logical;
         }
@@ -407,6 +517,7 @@ send_logical:
 }
 
 ScopedAStatus SecureElement::openBasicChannel(const std::vector<uint8_t>& aid, int8_t p2, std::vector<uint8_t>* aidl_return) {
+    LatencyScope latency(__func__, SE_GTO_OP_OPEN_BASIC_CHANNEL);
     std::vector<uint8_t> result;
 
     int mSecureElementStatus = IOERROR;
@@ -426,6 +537,12 @@ ScopedAStatus SecureElement::openBasicChannel(const std::vector<uint8_t>& aid, i
         return ScopedAStatus::fromServiceSpecificError(CHANNEL_NOT_AVAILABLE);
     }
 
+    /* Checked before bringing link up, ctx is NULL while it is down */
+    if (se_gto_select_cache_lookup(ctx, aid.data(), aid.size(), p2)) {
+        ALOGD("SecureElement:%s: AID known to be absent", __func__);
+        return ScopedAStatus::fromServiceSpecificError(NO_SUCH_ELEMENT_ERROR);
+    }
+
     if (!checkSeUp) {
         if (initializeSE() != EXIT_SUCCESS) {
             ALOGE("SecureElement:%s: Failed to re-initialise the eSE HAL", __func__);
@@ -457,7 +574,7 @@ ScopedAStatus SecureElement::openBasicChannel(const std::vector<uint8_t>& aid, i
         apdu[index] = 0x00;
 
 send_basic:
-        dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+        dump_bytes("CMD", apdu, apdu_len);
         resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
         ALOGD("SecureElement:%s selectApdu resp_len = %d", __func__,resp_len);
     }
@@ -468,14 +585,15 @@ send_basic:
         }
         mSecureElementStatus = IOERROR;
     } else {
-        dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+        dump_bytes("RESP", resp, resp_len);
 
         if (resp[resp_len - 2] == 0x90 || resp[resp_len - 2] == 0x62 || resp[resp_len - 2] == 0x63) {
             result.resize(getResponseOffset + resp_len);
             memcpy(&result[getResponseOffset], resp, resp_len);
 
             isBasicChannelOpen = true;
-            nbrOpenChannel++;
+            se_gto_channel_open(ctx, BASIC_CHANNEL, aid.data(), aid.size(), p2,
+                                AIBinder_getCallingPid());
             mSecureElementStatus = SUCCESS;
         }
         else if (resp[resp_len - 2] == 0x61) {
@@ -484,7 +602,7 @@ send_basic:
             getResponseOffset += (resp_len - 2);
             getResponse[4] = resp[resp_len - 1];
             getResponse[0] = apdu[0];
-            dump_bytes("getResponse CMD: ", ':', getResponse, 5, stdout);
+            dump_bytes("getResponse CMD", getResponse, 5);
             free(apdu);
             apdu_len = 5;
             apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
@@ -497,7 +615,7 @@ send_basic:
             memcpy(&result[getResponseOffset], resp, resp_len - 2);
             getResponseOffset += (resp_len - 2);
             apdu[4] = resp[resp_len - 1];
-            dump_bytes("case2 getResponse CMD: ", ':', apdu, 5, stdout);
+            dump_bytes("case2 getResponse CMD", apdu, 5);
             apdu_len = 5;
             memset(resp, 0, resp_len);
             goto send_basic;
@@ -525,7 +643,8 @@ send_basic:
 }
 
 ScopedAStatus SecureElement::closeChannel(int8_t channelNumber) {
-    ALOGD("SecureElement:%s start", __func__);
+    LatencyScope latency(__func__, SE_GTO_OP_CLOSE_CHANNEL);
+    ALOGV("SecureElement:%s start", __func__);
     int mSecureElementStatus = FAILED;
 
     uint8_t *apdu; //65536
@@ -536,38 +655,34 @@ ScopedAStatus SecureElement::closeChannel(int8_t channelNumber) {
     if (!checkSeUp) {
         ALOGE("SecureElement:%s cannot closeChannel, HAL is deinitialized", __func__);
         mSecureElementStatus = FAILED;
-        ALOGD("SecureElement:%s end", __func__);
+        ALOGV("SecureElement:%s end", __func__);
         return ScopedAStatus::fromServiceSpecificError(mSecureElementStatus);
     }
 
-    if (channelNumber < 0) {
+    if (channelNumber < 0 || channelNumber >= SE_GTO_MAX_CHANNELS) {
         ALOGE("SecureElement:%s Channel not supported", __func__);
         mSecureElementStatus = FAILED;
     } else if (channelNumber == 0) {
         isBasicChannelOpen = false;
         mSecureElementStatus = SUCCESS;
-        nbrOpenChannel--;
+        se_gto_channel_close(ctx, BASIC_CHANNEL);
     } else {
         apdu = (uint8_t*)malloc(apdu_len * sizeof(uint8_t));
         resp = (uint8_t*)malloc(65536 * sizeof(uint8_t));
 
         if (apdu != NULL) {
             uint8_t index = 0;
-            if(channelNumber > 0x03) {
-              apdu[index++] = 0x40 + channelNumber - 0x04;
-            } else {
-                apdu[index++] = channelNumber;
-            }
+            apdu[index++] = se_gto_channel_cla(0x00, channelNumber);
             apdu[index++] = 0x70;
             apdu[index++] = 0x80;
             apdu[index++] = channelNumber;
             apdu[index++] = 0x00;
             apdu_len = index;
 
-            dump_bytes("CMD: ", ':', apdu, apdu_len, stdout);
+            dump_bytes("CMD", apdu, apdu_len);
             resp_len = se_gto_apdu_transmit(ctx, apdu, apdu_len, resp, 65536);
             if (resp_len >= 0)
-                dump_bytes("RESP: ", ':', resp, resp_len, stdout);
+                dump_bytes("RESP", resp, resp_len);
         }
         if (resp_len < 0) {
             mSecureElementStatus = FAILED;
@@ -576,7 +691,7 @@ ScopedAStatus SecureElement::closeChannel(int8_t channelNumber) {
             }
         } else if ((resp[resp_len - 2] == 0x90) && (resp[resp_len - 1] == 0x00)) {
             mSecureElementStatus = SUCCESS;
-            nbrOpenChannel--;
+            se_gto_channel_close(ctx, channelNumber);
         } else {
             mSecureElementStatus = FAILED;
         }
@@ -584,46 +699,32 @@ ScopedAStatus SecureElement::closeChannel(int8_t channelNumber) {
         if(resp) free(resp);
     }
 
-    if (nbrOpenChannel == 0 && isBasicChannelOpen == false) {
+    if (se_gto_channel_count(ctx) == 0 && isBasicChannelOpen == false) {
         ALOGD("SecureElement:%s All Channels are closed", __func__);
         if (deinitializeSE() != SUCCESS) {
             ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
         }
     }
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
     if(mSecureElementStatus != SUCCESS) return ScopedAStatus::fromServiceSpecificError(mSecureElementStatus);
     else return ScopedAStatus::ok();
 }
 
+binder_status_t SecureElement::dump(int fd, const char** /* args */, uint32_t /* numArgs */) {
+    /* Counters only, no exchange with Secure Element. Link is down and ctx
+     * NULL whenever no channel is open: process-wide counters are dumped */
+    std::lock_guard<std::mutex> lock(ctxLock);
+    if (se_gto_dump(ctx, fd) < 0)
+        dprintf(fd, "se-gto: dump failed: %s\n", strerror(errno));
+    return STATUS_OK;
+}
+
+/* Hex encoded by log thread from a table, only when debug is enabled */
 void
-SecureElement::dump_bytes(const char *pf, char sep, const uint8_t *p, int n, FILE *out)
+SecureElement::dump_bytes(const char *pf, const uint8_t *p, int n)
 {
-    const uint8_t *s = p;
-    char *msg;
-    int len = 0;
-    int input_len = n;
-
-    if (!debug_log_enabled) return;
-
-    msg = (char*) malloc ( (pf ? strlen(pf) : 0) + input_len * 3 + 1);
-    if(!msg) {
-        errno = ENOMEM;
-        return;
-    }
-
-    if (pf) {
-        len += sprintf(msg , "%s" , pf);
-    }
-    while (input_len--) {
-        len += sprintf(msg + len, "%02X" , *s++);
-        if (input_len && sep) {
-            len += sprintf(msg + len, ":");
-        }
-    }
-    sprintf(msg + len, "\n");
-    ALOGD("SecureElement:%s ==> size = %d data = %s", __func__, n, msg);
-
-    if(msg) free(msg);
+    if (debug_log_enabled && (n > 0))
+        se_gto_log_hex(ctx, pf, p, n);
 }
 
 int
@@ -647,7 +748,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
     int sw;
 
     if (verbose)
-        dump_bytes("APDU: ", ':', apdu, n, stdout);
+        dump_bytes("APDU", apdu, n);
 
 
     n = se_gto_apdu_transmit(ctx, apdu, n, resp, sizeof(resp));
@@ -655,7 +756,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
         ALOGE("SecureElement:%s FAILED: APDU transmit (%s).\n\n", __func__, strerror(errno));
         return -2;
     } else if (n < 2) {
-        dump_bytes("RESP: ", ':', resp, n, stdout);
+        dump_bytes("RESP", resp, n);
         ALOGE("SecureElement:%s FAILED: not enough data to have a status word.\n", __func__);
         return -2;
     }
@@ -664,7 +765,7 @@ SecureElement::run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *re
         sw = (resp[n - 2] << 8) | resp[n - 1];
         printf("%d bytes, SW=0x%04x\n", n - 2, sw);
         if (n > 2)
-            dump_bytes("RESP: ", ':', resp, n - 2, stdout);
+            dump_bytes("RESP", resp, n - 2);
     }
     return 0;
 }
@@ -707,6 +808,19 @@ SecureElement::parseConfigFile(FILE *f, int verbose)
                     se_gto_set_log_level(ctx, 3);
                 }
             }
+        } else if (strcmp("GTO_SESSION_RESUME", pch) == 0) {
+            pch = strtok(NULL, " =;");
+            ALOGD("SecureElement:%s Session resume : %s", __func__, pch);
+            if (pch != NULL) {
+                session_resume_enabled = (strcmp(pch, "enable") == 0);
+            }
+        } else if (strcmp("\n", pch) != 0) {
+            char *key = pch;
+            pch = strtok(NULL, " =;");
+            ALOGD("SecureElement:%s Option %s : %s", __func__, key, pch);
+            if (pch != NULL && se_gto_set_config(ctx, key, pch) < 0) {
+                ALOGE("SecureElement:%s Option %s ignored: %s", __func__, key, strerror(errno));
+            }
         }
     }
     return 0;
@@ -742,9 +856,11 @@ SecureElement::openConfigFile(int verbose)
 int SecureElement::deinitializeSE() {
     int mSecureElementStatus = FAILED;
 
-    ALOGD("SecureElement:%s start", __func__);
+    ALOGV("SecureElement:%s start", __func__);
 
     if(checkSeUp){
+        std::lock_guard<std::mutex> lock(ctxLock);
+
         if (se_gto_close(ctx) < 0) {
             mSecureElementStatus = FAILED;
             internalClientCallback->onStateChange(false, "SE Initialized failed");
@@ -752,7 +868,6 @@ int SecureElement::deinitializeSE() {
             ctx = NULL;
             mSecureElementStatus = SUCCESS;
             isBasicChannelOpen = false;
-            nbrOpenChannel = 0;
         }
         checkSeUp = false;
     }else{
@@ -760,27 +875,49 @@ int SecureElement::deinitializeSE() {
         mSecureElementStatus = SUCCESS;
     }
 
-    ALOGD("SecureElement:%s end", __func__);
+    ALOGV("SecureElement:%s end", __func__);
     return mSecureElementStatus;
 }
 
 ScopedAStatus SecureElement::reset() {
+    LatencyScope latency(__func__, SE_GTO_OP_RESET);
 
     int status = FAILED;
-    ALOGD("SecureElement:%s start", __func__);
+    struct timespec start, end;
+    const char *mode = "soft";
 
-    if (deinitializeSE() != SUCCESS) {
-        ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
-    }
+    ALOGV("SecureElement:%s start", __func__);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    se_gto_select_cache_flush();
 
     internalClientCallback->onStateChange(false, "reset the SE");
 
-    if(initializeSE() == EXIT_SUCCESS) {
+    /* RESET S-block on current context, IFSD is negotiated again with it */
+    if (checkSeUp && resetSE() >= 0) {
         status = SUCCESS;
+    } else {
+        ALOGE("SecureElement:%s soft reset failed, reinitialize SE", __func__);
+        mode = "full";
+
+        if (deinitializeSE() != SUCCESS) {
+            ALOGE("SecureElement:%s deinitializeSE Failed", __func__);
+        }
+
+        if(initializeSE() == EXIT_SUCCESS) {
+            status = SUCCESS;
+        }
+    }
+
+    if (status == SUCCESS) {
         internalClientCallback->onStateChange(true, "SE Initialized");
     }
 
-    ALOGD("SecureElement:%s end", __func__);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ALOGD("SecureElement:%s %s reset in %ld ms", __func__, mode,
+          (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+
+    ALOGV("SecureElement:%s end", __func__);
 
     if(status != SUCCESS) return ScopedAStatus::fromServiceSpecificError(status);
     else return ScopedAStatus::ok();
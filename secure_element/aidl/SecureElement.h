@@ -37,12 +37,13 @@ struct SecureElement : public BnSecureElement {
     ScopedAStatus isCardPresent(bool* aidl_return) override;
     ScopedAStatus closeChannel(int8_t channelNumber) override;
     ScopedAStatus reset() override;
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
 
 
     private:
-    uint8_t nbrOpenChannel = 0;
     bool isBasicChannelOpen = false;
     bool checkSeUp = false;
+    bool isFirstInit = true;
     uint8_t atr[32];
     uint8_t atr_size;
     char config_filename[100];
@@ -52,8 +53,10 @@ struct SecureElement : public BnSecureElement {
     int deinitializeSE();
     static int run_apdu(struct se_gto_ctx *ctx, const uint8_t *apdu, uint8_t *resp, int n, int verbose);
     static int toint(char c);
-    static void dump_bytes(const char *pf, char sep, const uint8_t *p, int n, FILE *out);
+    static void dump_bytes(const char *pf, const uint8_t *p, int n);
     int resetSE();
+    int resumeSE();
+    int recoverSE();
     int openConfigFile(int verbose);
     int parseConfigFile(FILE *f, int verbose);
 };
@@ -0,0 +1,152 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * SPI device shared by endpoints of one Secure Element.
+ *
+ * Several logical endpoints may sit behind one device, such as eSE OS and
+ * a vendor domain, each addressed with its own NAD. Every endpoint has its
+ * own context, so its own T=1 sequence numbers and IFS, but contexts opened
+ * on the same device node in process share one file descriptor.
+ *
+ * T=1 is half duplex: once a block is sent, bus belongs to that endpoint
+ * until card answer is read. Bus is thus taken for a turn, one block and
+ * its answer, not for a whole APDU. Turns are granted in order asked, so
+ * that a long chain on one endpoint does not starve the others.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "bus.h"
+#include "spi.h"
+#include "systrace.h"
+
+#define BUS_MAX 4
+
+static pthread_mutex_t buses_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gto_bus  buses[BUS_MAX];
+
+static struct gto_bus *
+bus_find(const char *gtodev)
+{
+    for (int i = 0; i < BUS_MAX; i++)
+        if (buses[i].users &&
+            !strncmp(buses[i].gtodev, gtodev, sizeof(buses[i].gtodev)))
+            return &buses[i];
+    return NULL;
+}
+
+/* Open device, unless another endpoint already did */
+int
+bus_attach(struct se_gto_ctx *ctx)
+{
+    struct gto_bus *bus;
+    int             r = 0;
+
+    pthread_mutex_lock(&buses_lock);
+    bus = bus_find(ctx->gtodev);
+    if (bus) {
+        bus->users++;
+        ctx->t1.spi_fd = bus->fd;
+        ctx->t1.bus    = bus;
+        dbg("%s shared by %d endpoints\n", ctx->gtodev, bus->users);
+        goto out;
+    }
+
+    r = spi_setup(ctx);
+    if (r < 0)
+        goto out;
+
+    /* Device still usable alone if table is full */
+    for (int i = 0; i < BUS_MAX; i++)
+        if (!buses[i].users) {
+            bus = &buses[i];
+            break;
+        }
+    if (!bus) {
+        warn("no room to share %s\n", ctx->gtodev);
+        goto out;
+    }
+
+    memset(bus, 0, sizeof(*bus));
+    strncpy(bus->gtodev, ctx->gtodev, sizeof(bus->gtodev) - 1);
+    bus->fd    = ctx->t1.spi_fd;
+    bus->users = 1;
+    pthread_mutex_init(&bus->lock, NULL);
+    pthread_cond_init(&bus->cond, NULL);
+    ctx->t1.bus = bus;
+out:
+    pthread_mutex_unlock(&buses_lock);
+    return r;
+}
+
+/* Close device with last endpoint */
+void
+bus_detach(struct se_gto_ctx *ctx)
+{
+    struct gto_bus *bus = ctx->t1.bus;
+
+    pthread_mutex_lock(&buses_lock);
+    ctx->t1.bus = NULL;
+    if (bus && (--bus->users > 0))
+        ctx->t1.spi_fd = -1;
+    else {
+        (void)spi_teardown(ctx);
+        if (bus) {
+            pthread_cond_destroy(&bus->cond);
+            pthread_mutex_destroy(&bus->lock);
+        }
+    }
+    pthread_mutex_unlock(&buses_lock);
+}
+
+void
+bus_turn_begin(struct gto_bus *bus)
+{
+    unsigned long ticket;
+
+    if (!bus)
+        return;
+
+    pthread_mutex_lock(&bus->lock);
+    ticket = bus->next++;
+    if (ticket != bus->serving)
+        bus->waits++;
+    systrace_counter("se-gto bus queue", (int32_t)(bus->next - bus->serving));
+    while (ticket != bus->serving)
+        pthread_cond_wait(&bus->cond, &bus->lock);
+    bus->turns++;
+    pthread_mutex_unlock(&bus->lock);
+}
+
+void
+bus_turn_end(struct gto_bus *bus)
+{
+    if (!bus)
+        return;
+
+    pthread_mutex_lock(&bus->lock);
+    bus->serving++;
+    systrace_counter("se-gto bus queue", (int32_t)(bus->next - bus->serving));
+    pthread_cond_broadcast(&bus->cond);
+    pthread_mutex_unlock(&bus->lock);
+}
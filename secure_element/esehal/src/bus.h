@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * SPI device shared by endpoints of one Secure Element.
+ *
+ */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* One per device node in process, contexts of all endpoints attach to it */
+struct gto_bus {
+    char gtodev[64];
+    int  fd;
+    int  users; /* Contexts attached, slot free when 0 */
+
+    /* Turns are served in order asked, so that endpoints alternate */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned long   next;    /* Ticket of next turn asked */
+    unsigned long   serving; /* Ticket of turn on bus     */
+
+    uint64_t turns;
+    uint64_t waits; /* Turns that waited for another endpoint */
+};
+
+struct se_gto_ctx;
+
+int bus_attach(struct se_gto_ctx *ctx);
+void bus_detach(struct se_gto_ctx *ctx);
+void bus_turn_begin(struct gto_bus *bus);
+void bus_turn_end(struct gto_bus *bus);
+
+#endif /* BUS_H */
@@ -0,0 +1,297 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Logical channel table and ISO7816-4 CLA channel encoding.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "libse-gto-private.h"
+#include "channel.h"
+#include "state.h"
+
+#define INS_SELECT         0xA4
+#define INS_MANAGE_CHANNEL 0x70
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct se_gto_channel_info *
+channel_lookup(struct se_gto_ctx *ctx, int channel)
+{
+    if (!ctx || (channel < 0) || (channel >= SE_GTO_MAX_CHANNELS))
+        return NULL;
+    return &ctx->channels[channel];
+}
+
+/* 1 if status word ends a successful SELECT, possibly with more data */
+static int
+sw_is_select_ok(uint8_t sw1)
+{
+    return (sw1 == 0x90) || (sw1 == 0x61) || (sw1 == 0x62) || (sw1 == 0x63);
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_cla(int cla, int channel)
+{
+    if ((channel < 0) || (channel >= SE_GTO_MAX_CHANNELS))
+        return -1;
+
+    if (channel < 4)
+        /* First interindustry values: b2-b1 hold channel number */
+        return (cla & 0xFC) | channel;
+
+    /* Further interindustry values: b4-b1 hold channel number minus 4,
+     * b6 set if secure messaging was indicated in b4-b3, b5 is chaining.
+     */
+    return (cla & 0x80) | 0x40 | ((cla & 0x0C) ? 0x20 : 0) |
+           (cla & 0x10) | (channel - 4);
+}
+
+SE_GTO_EXPORT int
+se_gto_cla_channel(int cla)
+{
+    if (cla & 0x40)
+        return 4 + (cla & 0x0F);
+    return cla & 0x03;
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_open(struct se_gto_ctx *ctx, int channel, const void *aid,
+                    size_t aid_len, int p2, int owner)
+{
+    struct se_gto_channel_info *ch = channel_lookup(ctx, channel);
+
+    if (!ch || (aid_len > sizeof(ch->aid)) || (aid_len && !aid)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    memset(ch, 0, sizeof(*ch));
+    ch->state   = SE_GTO_CHANNEL_OPEN;
+    ch->aid_len = (uint8_t)aid_len;
+    if (aid_len)
+        memcpy(ch->aid, aid, aid_len);
+    ch->p2           = (uint8_t)p2;
+    ch->owner        = owner;
+    ch->open_time_ms = now_ms();
+    state_channel(ctx, channel, 1);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_close(struct se_gto_ctx *ctx, int channel)
+{
+    struct se_gto_channel_info *ch = channel_lookup(ctx, channel);
+
+    if (!ch) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ch->state = SE_GTO_CHANNEL_CLOSED;
+    state_channel(ctx, channel, 0);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_count(struct se_gto_ctx *ctx)
+{
+    int n = 0;
+
+    if (!ctx)
+        return 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (int i = 0; i < SE_GTO_MAX_CHANNELS; i++)
+        if (ctx->channels[i].state == SE_GTO_CHANNEL_OPEN)
+            n++;
+    pthread_mutex_unlock(&ctx->lock);
+    return n;
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_get_info(struct se_gto_ctx *ctx, int channel,
+                        struct se_gto_channel_info *info)
+{
+    struct se_gto_channel_info *ch = channel_lookup(ctx, channel);
+
+    if (!ch || !info) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    *info = *ch;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* Transmit command built here, outside of channel accounting */
+static int
+channel_command(struct se_gto_ctx *ctx, const uint8_t *apdu, int n, uint8_t *resp, int r)
+{
+    r = isot1_transceive(&ctx->t1, apdu, n, resp, r);
+    if ((r >= 0) && (r < 2))
+        r = -EBADMSG;
+    return r;
+}
+
+/* Open channel again after reset and select its application.
+ * Returns 1 if restored, 0 if refused by card, negative value on
+ * transport error.
+ */
+static int
+channel_reopen(struct se_gto_ctx *ctx, int channel,
+               const struct se_gto_channel_info *info)
+{
+    uint8_t apdu[5 + 16 + 1];
+    uint8_t resp[256 + 2];
+    int     r;
+
+    if (channel > 0) {
+        /* MANAGE CHANNEL open, asking for same channel number in P2 */
+        apdu[0] = 0x00;
+        apdu[1] = INS_MANAGE_CHANNEL;
+        apdu[2] = 0x00;
+        apdu[3] = (uint8_t)channel;
+        r = channel_command(ctx, apdu, 4, resp, sizeof(resp));
+        if (r < 0)
+            return r;
+        if ((resp[r - 2] != 0x90) || (resp[r - 1] != 0x00))
+            return 0;
+    }
+
+    if (info->aid_len) {
+        apdu[0] = (uint8_t)se_gto_channel_cla(0x00, channel);
+        apdu[1] = INS_SELECT;
+        apdu[2] = 0x04;
+        apdu[3] = info->p2;
+        apdu[4] = info->aid_len;
+        memcpy(apdu + 5, info->aid, info->aid_len);
+        apdu[5 + info->aid_len] = 0x00;
+        r = channel_command(ctx, apdu, 6 + info->aid_len, resp, sizeof(resp));
+        if (r < 0)
+            return r;
+        if (!sw_is_select_ok(resp[r - 2])) {
+            if (channel > 0) {
+                apdu[0] = (uint8_t)se_gto_channel_cla(0x00, channel);
+                apdu[1] = INS_MANAGE_CHANNEL;
+                apdu[2] = 0x80;
+                apdu[3] = (uint8_t)channel;
+                r = channel_command(ctx, apdu, 4, resp, sizeof(resp));
+                if (r < 0)
+                    return r;
+            }
+            return 0;
+        }
+    }
+
+    ctx->channels[channel] = *info;
+    state_channel(ctx, channel, 1);
+    return 1;
+}
+
+SE_GTO_EXPORT int
+se_gto_channel_resume(struct se_gto_ctx *ctx, void *atr, size_t r)
+{
+    struct se_gto_channel_info saved[SE_GTO_MAX_CHANNELS];
+    int                        n, err;
+
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    memcpy(saved, ctx->channels, sizeof(saved));
+
+    n = reset_after_failure(ctx, atr, r);
+
+    for (int i = 0; (n >= 0) && (i < SE_GTO_MAX_CHANNELS); i++) {
+        if (saved[i].state != SE_GTO_CHANNEL_OPEN)
+            continue;
+
+        err = channel_reopen(ctx, i, &saved[i]);
+        if (err < 0) {
+            err("failed to resume channel %d, %s\n", i, strerror(-err));
+            errno = -err;
+            n     = -1;
+        } else if (err == 0)
+            warn("channel %d not resumed, refused by card\n", i);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return n;
+}
+
+/* Card reset closes every logical channel and selects default application
+ * on the basic one, so no entry describes a client session any longer,
+ * basic channel included.
+ */
+void
+channel_clear_all(struct se_gto_ctx *ctx)
+{
+    memset(ctx->channels, 0, sizeof(ctx->channels));
+}
+
+/* Account APDU on the channel encoded in CLA, and track application
+ * selected by name on success.
+ */
+void
+channel_apdu_done(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                  const uint8_t *resp, int r)
+{
+    struct se_gto_channel_info *ch;
+
+    /* CLA 0xFF is invalid and does not carry a channel */
+    if (apdu[0] == 0xFF)
+        return;
+
+    ch = channel_lookup(ctx, se_gto_cla_channel(apdu[0]));
+    if (!ch || (ch->state != SE_GTO_CHANNEL_OPEN))
+        return;
+
+    ch->apdu_count++;
+    if (r < 2) {
+        ch->apdu_errors++;
+        return;
+    }
+
+    if ((apdu[1] == INS_SELECT) && (apdu[2] == 0x04) && (n > 5) &&
+        (apdu[4] <= sizeof(ch->aid)) && (5 + apdu[4] <= n) &&
+        sw_is_select_ok(resp[r - 2])) {
+        ch->aid_len = apdu[4];
+        memcpy(ch->aid, apdu + 5, apdu[4]);
+        ch->p2 = apdu[3];
+    }
+}
@@ -95,3 +95,12 @@ crc_ccitt(uint16_t crc, const void *s, size_t n)
         }
     return crc;
 }
+
+/* CRC-16/X-25 of ISO/IEC 13239, used by GlobalPlatform T=1 over SPI/I2C.
+ * Same polynomial as above, with final complement.
+ */
+unsigned
+crc_iso13239(const void *s, size_t n)
+{
+    return crc_ccitt(0xFFFF, s, n) ^ 0xFFFF;
+}
@@ -35,5 +35,6 @@
 
 unsigned lrc8(const void *s, size_t n);
 unsigned crc_ccitt(uint16_t crc,  const void *s, size_t n);
+unsigned crc_iso13239(const void *s, size_t n);
 
 #endif /* CHECKSUM_H */
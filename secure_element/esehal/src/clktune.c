@@ -0,0 +1,249 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * SPI clock speed tuning from link error rate.
+ *
+ * Driver comes up with a conservative clock speed. Once enabled, speed is
+ * raised by one step after each window of received blocks without checksum
+ * error or retransmission, up to configured maximum. A window with more
+ * errors than allowed steps back down, and that speed is not tried again
+ * for a while. An exchange failing at a raised speed goes back to driver
+ * speed at once.
+ *
+ * Fastest speed found is kept per device in state file, so that a new
+ * process starts from it.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "clktune.h"
+#include "spi.h"
+
+#define CLKTUNE_WINDOW_BLOCKS 128 /* Blocks received per evaluation        */
+#define CLKTUNE_RETRY_WINDOWS 64  /* Clean windows before bad speed retried */
+
+static uint64_t
+link_errors(struct t1_state *t1)
+{
+    return t1->chk_errors + t1->retransmits;
+}
+
+static void
+clktune_window(struct se_gto_ctx *ctx)
+{
+    ctx->clktune.blocks = ctx->t1.blocks_rx;
+    ctx->clktune.errors = link_errors(&ctx->t1);
+}
+
+static struct gto_state *
+clktune_state(struct se_gto_ctx *ctx)
+{
+    struct gto_state *st = ctx->state;
+
+    if (!st || strncmp(st->gtodev, ctx->gtodev, sizeof(st->gtodev)))
+        return NULL;
+    return st;
+}
+
+static void
+clktune_save(struct se_gto_ctx *ctx)
+{
+    struct clktune   *ct = &ctx->clktune;
+    struct gto_state *st = clktune_state(ctx);
+
+    if (!st)
+        return;
+    st->clk_base_hz = ct->base_hz;
+    st->clk_hz      = ct->good_hz;
+    st->clk_bad_hz  = ct->bad_hz;
+}
+
+/* Returns speed in use after request */
+static uint32_t
+clktune_set(struct se_gto_ctx *ctx, uint32_t hz)
+{
+    struct clktune *ct = &ctx->clktune;
+    uint32_t        now;
+    int             err;
+
+    err = spi_set_clock(ctx->t1.spi_fd, hz);
+    if (err >= 0)
+        err = spi_get_clock(ctx->t1.spi_fd, &now);
+    if (err < 0) {
+        warn("cannot set SPI clock to %u Hz, %s, tuning disabled\n", hz, strerror(-err));
+        ct->usable = 0;
+        return ct->hz;
+    }
+    if ((now == ct->hz) && (hz != ct->hz)) {
+        /* Write may have been taken as GTO_IOC_WR_RESET: link is reset on
+         * next exchange, and next client APDU fails so that HAL opens its
+         * channels again, as after any link failure
+         */
+        warn("SPI clock still %u Hz, Secure Element may have been reset, tuning disabled\n",
+             now);
+        ct->usable                 = 0;
+        ctx->t1.need_reset         = 1;
+        ctx->monitor.need_recovery = 1;
+        getdata_cache_clear(ctx);
+        state_reset_begin(ctx);
+        return now;
+    }
+
+    info("SPI clock %u Hz, was %u Hz\n", now, ct->hz);
+    ct->hz = now;
+    return now;
+}
+
+void
+clktune_open(struct se_gto_ctx *ctx)
+{
+    struct clktune   *ct = &ctx->clktune;
+    struct gto_state *st;
+    int               err;
+
+    ct->usable = 0;
+    if (!ct->enabled)
+        return;
+
+    err = spi_get_clock(ctx->t1.spi_fd, &ct->base_hz);
+    if (err < 0) {
+        warn("cannot read SPI clock, %s, tuning disabled\n", strerror(-err));
+        return;
+    }
+    ct->usable  = 1;
+    ct->hz      = ct->base_hz;
+    ct->good_hz = ct->base_hz;
+    ct->bad_hz  = 0;
+    ct->clean   = 0;
+
+    /* Former process may have left clock raised */
+    st = clktune_state(ctx);
+    if (st && st->clk_base_hz) {
+        ct->base_hz = st->clk_base_hz;
+        ct->bad_hz  = st->clk_bad_hz;
+        ct->good_hz = st->clk_hz;
+        if (ct->good_hz > ct->max_hz)
+            ct->good_hz = ct->max_hz;
+        if (ct->good_hz < ct->base_hz)
+            ct->good_hz = ct->base_hz;
+    }
+    if (ct->hz != ct->good_hz)
+        clktune_set(ctx, ct->good_hz);
+
+    clktune_window(ctx);
+    dbg("SPI clock %u Hz, driver %u Hz, tuned up to %u Hz\n", ct->hz,
+        ct->base_hz, ct->max_hz);
+}
+
+void
+clktune_close(struct se_gto_ctx *ctx)
+{
+    struct clktune *ct = &ctx->clktune;
+
+    /* Leave driver as found, next process restarts from saved speed */
+    if (ct->usable && (ct->hz != ct->base_hz))
+        clktune_set(ctx, ct->base_hz);
+    ct->usable = 0;
+}
+
+static void
+clktune_down(struct se_gto_ctx *ctx, uint32_t hz)
+{
+    struct clktune *ct = &ctx->clktune;
+
+    ct->bad_hz = ct->hz;
+    ct->clean  = 0;
+    if (hz < ct->base_hz)
+        hz = ct->base_hz;
+    if (ct->good_hz >= ct->bad_hz)
+        ct->good_hz = hz;
+    clktune_set(ctx, hz);
+    clktune_save(ctx);
+}
+
+static uint32_t
+clktune_step(struct clktune *ct)
+{
+    return ct->step_hz ? ct->step_hz : ct->base_hz / 8;
+}
+
+static void
+clktune_up(struct se_gto_ctx *ctx)
+{
+    struct clktune *ct  = &ctx->clktune;
+    uint32_t        old = ct->hz;
+    uint32_t        hz  = old + clktune_step(ct);
+
+    if (hz > ct->max_hz)
+        hz = ct->max_hz;
+    if ((hz <= old) || (ct->bad_hz && (hz >= ct->bad_hz)))
+        return;
+
+    if (clktune_set(ctx, hz) < hz)
+        /* Driver does not go as fast as requested */
+        ct->max_hz = ct->hz;
+}
+
+/* Called with context lock held, after each exchange */
+void
+clktune_after(struct se_gto_ctx *ctx, int r)
+{
+    struct clktune *ct = &ctx->clktune;
+    uint64_t        errors;
+
+    if (!ct->usable)
+        return;
+
+    if ((r < 0) && (r != -ECANCELED) && (r != -ETIME) && (ct->hz > ct->base_hz)) {
+        warn("exchange failed at SPI clock %u Hz, %s\n", ct->hz, strerror(-r));
+        clktune_down(ctx, ct->base_hz);
+        clktune_window(ctx);
+        return;
+    }
+
+    if (ctx->t1.blocks_rx - ct->blocks < CLKTUNE_WINDOW_BLOCKS)
+        return;
+    errors = link_errors(&ctx->t1) - ct->errors;
+    clktune_window(ctx);
+
+    if (errors > ct->error_limit) {
+        if (ct->hz > ct->base_hz) {
+            warn("%u link errors at SPI clock %u Hz\n", (unsigned)errors, ct->hz);
+            clktune_down(ctx, ct->hz - clktune_step(ct));
+        }
+        return;
+    }
+
+    if (ct->hz > ct->good_hz) {
+        ct->good_hz = ct->hz;
+        clktune_save(ctx);
+    }
+    if (ct->bad_hz && (++ct->clean >= CLKTUNE_RETRY_WINDOWS)) {
+        dbg("SPI clock %u Hz may be tried again\n", ct->bad_hz);
+        ct->bad_hz = 0;
+        ct->clean  = 0;
+        clktune_save(ctx);
+    }
+    if (errors == 0)
+        clktune_up(ctx);
+}
@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * SPI clock speed tuning from link error rate.
+ *
+ */
+
+#ifndef CLKTUNE_H
+#define CLKTUNE_H
+
+#include <stdint.h>
+
+struct clktune {
+    uint8_t  enabled;     /* Set in configuration                       */
+    uint8_t  usable;      /* Driver answers clock speed requests        */
+    unsigned max_hz;      /* Never go faster, driver speed if 0         */
+    unsigned step_hz;     /* Speed change, 1/8 of driver speed if 0     */
+    unsigned error_limit; /* Errors allowed per window                  */
+
+    uint32_t base_hz; /* Driver speed before tuning, fallback         */
+    uint32_t hz;      /* Current speed                                */
+    uint32_t good_hz; /* Fastest speed with errors within limit       */
+    uint32_t bad_hz;  /* Slowest speed seen over limit, 0 if none     */
+    unsigned clean;   /* Windows within limit since bad_hz was set    */
+
+    /* Link counters at start of window */
+    uint64_t blocks;
+    uint64_t errors;
+};
+
+struct se_gto_ctx;
+
+void clktune_open(struct se_gto_ctx *ctx);
+void clktune_close(struct se_gto_ctx *ctx);
+void clktune_after(struct se_gto_ctx *ctx, int r);
+
+#endif /* CLKTUNE_H */
@@ -0,0 +1,277 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Text report of link state and performance counters, for binder dump.
+ *
+ * State is copied on stack while context is locked, then written to file
+ * descriptor once lock is released: a slow reader never holds back APDU
+ * exchanges. Nothing is allocated, latency histograms are read without
+ * lock.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libse-gto-private.h"
+#include "bus.h"
+
+struct dump_snapshot {
+    uint8_t  proto;
+    uint8_t  chk_algo;
+    uint8_t  nad;
+    uint8_t  need_reset;
+    uint8_t  released;
+    int      wait_strategy;
+    uint16_t ifsc;
+    uint16_t ifsd;
+    uint16_t ifst;
+    unsigned bwt;
+    uint8_t  atr[32];
+    uint8_t  atr_length;
+
+    uint8_t  clk_enabled;
+    uint32_t clk_hz;
+    uint32_t clk_base_hz;
+
+    int           apdu_queue; /* Exchanges asked and not done                */
+    unsigned long bus_queue;  /* Turns asked and not served, current one too */
+    uint64_t      bus_turns;
+    uint64_t      bus_waits;
+
+    uint64_t blocks_rx;
+    uint64_t chk_errors;
+    uint64_t retransmits;
+    uint64_t transceives;
+
+    struct t1_phase last;
+    struct t1_phase total;
+
+    unsigned             monitor_ms;
+    uint8_t              monitor_suspended;
+    struct se_gto_health health;
+
+    struct se_gto_channel_info channels[SE_GTO_MAX_CHANNELS];
+};
+
+static void
+dump_snapshot(struct se_gto_ctx *ctx, struct dump_snapshot *s)
+{
+    struct t1_state *t1  = &ctx->t1;
+    struct gto_bus  *bus = t1->bus;
+
+    pthread_mutex_lock(&ctx->lock);
+    s->proto         = t1->proto;
+    s->chk_algo      = t1->chk_algo;
+    s->nad           = t1->nad;
+    s->need_reset    = t1->need_reset;
+    s->released      = t1->released;
+    s->wait_strategy = t1->wait.strategy;
+    s->ifsc          = t1->ifsc;
+    s->ifsd          = t1->ifsd;
+    s->ifst          = t1->ifst;
+    s->bwt           = t1->bwt;
+    s->atr_length    = t1->atr_length;
+    memcpy(s->atr, t1->atr, t1->atr_length);
+
+    s->clk_enabled = ctx->clktune.enabled && ctx->clktune.usable;
+    s->clk_hz      = ctx->clktune.hz;
+    s->clk_base_hz = ctx->clktune.base_hz;
+
+    s->blocks_rx   = t1->blocks_rx;
+    s->chk_errors  = t1->chk_errors;
+    s->retransmits = t1->retransmits;
+    s->transceives = t1->stats.transceives;
+    s->last        = t1->stats.last;
+    s->total       = t1->stats.total;
+
+    s->monitor_ms        = ctx->monitor.running ? ctx->monitor.period_ms : 0;
+    s->monitor_suspended = ctx->monitor.suspended;
+    s->health            = ctx->monitor.health;
+
+    memcpy(s->channels, ctx->channels, sizeof(s->channels));
+
+    s->apdu_queue = __atomic_load_n(&ctx->apdu_queue, __ATOMIC_RELAXED);
+    s->bus_queue  = 0;
+    s->bus_turns = s->bus_waits = 0;
+    if (bus) {
+        pthread_mutex_lock(&bus->lock);
+        s->bus_queue = bus->next - bus->serving;
+        s->bus_turns = bus->turns;
+        s->bus_waits = bus->waits;
+        pthread_mutex_unlock(&bus->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static const char *
+dump_hex(char *buf, size_t size, const uint8_t *p, size_t n)
+{
+    if (n > (size - 1) / 2)
+        n = (size - 1) / 2;
+    log_hex(buf, p, n);
+    return buf;
+}
+
+static void
+dump_phase(int fd, const char *name, const struct t1_phase *p)
+{
+    dprintf(fd, "  %-5s send %llu us, wait %llu us, read %llu us, %llu polls, "
+                "%llu/%llu blocks, %llu/%llu bytes\n",
+            name, (unsigned long long)(p->send_ns / 1000),
+            (unsigned long long)(p->wait_ns / 1000),
+            (unsigned long long)(p->read_ns / 1000),
+            (unsigned long long)p->polls, (unsigned long long)p->blocks_tx,
+            (unsigned long long)p->blocks_rx, (unsigned long long)p->bytes_tx,
+            (unsigned long long)p->bytes_rx);
+    dprintf(fd, "  %-5s %llu WTX, %llu retransmits, %llu checksum errors, "
+                "%llu resyncs, %llu resets\n",
+            "", (unsigned long long)p->wtx, (unsigned long long)p->retransmits,
+            (unsigned long long)p->chk_errors, (unsigned long long)p->resyncs,
+            (unsigned long long)p->resets);
+}
+
+static void
+dump_latency(int fd, const char *name, const struct se_gto_latency *lat)
+{
+    if (!lat->count)
+        return;
+
+    dprintf(fd, "  %-20s %8llu %8u %8u %8u %8u %8u\n", name,
+            (unsigned long long)lat->count, lat->p50_us, lat->p90_us,
+            lat->p99_us, lat->p999_us, lat->max_us);
+}
+
+static const char *const op_names[SE_GTO_OP_COUNT] = {
+    [SE_GTO_OP_TRANSMIT]             = "transmit",
+    [SE_GTO_OP_OPEN_LOGICAL_CHANNEL] = "openLogicalChannel",
+    [SE_GTO_OP_OPEN_BASIC_CHANNEL]   = "openBasicChannel",
+    [SE_GTO_OP_CLOSE_CHANNEL]        = "closeChannel",
+    [SE_GTO_OP_RESET]                = "reset",
+};
+
+SE_GTO_EXPORT int
+se_gto_dump(struct se_gto_ctx *ctx, int fd)
+{
+    static const char *const chk_names[] = { "LRC", "CRC", "CRC16" };
+    struct dump_snapshot     s;
+    struct se_gto_latency    lat;
+    struct timespec          ts;
+    uint64_t                 now_ms;
+    char                     hex[2 * 32 + 1];
+    char                     name[16];
+    unsigned long            hits, misses;
+
+    if (fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!ctx) {
+        dprintf(fd, "se-gto: link down, no context\n");
+        goto process;
+    }
+
+    dump_snapshot(ctx, &s);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    dprintf(fd, "se-gto %s\n", ctx->gtodev);
+    dprintf(fd, "link: %s, %s, NAD %02X, IFSC %u, IFSD %u, IFS limit %u, "
+                "BWT %u ms, %s wait\n",
+            s.proto == T1_PROTO_GP ? "GP" : "ISO",
+            s.chk_algo < 3 ? chk_names[s.chk_algo] : "?", s.nad, s.ifsc,
+            s.ifsd, s.ifst ? s.ifst : s.ifsc, s.bwt,
+            s.wait_strategy == T1_WAIT_HYBRID ? "hybrid" : "fixed");
+    if (s.clk_enabled)
+        dprintf(fd, "clock: %u Hz, driver %u Hz\n", s.clk_hz, s.clk_base_hz);
+    else
+        dprintf(fd, "clock: driver default\n");
+    dprintf(fd, "power: %s\n", s.need_reset ? "reset pending" :
+                               s.released   ? "released" : "active");
+    dprintf(fd, "atr: %s\n", dump_hex(hex, sizeof(hex), s.atr, s.atr_length));
+    dprintf(fd, "queue: %d APDUs\n", s.apdu_queue);
+    dprintf(fd, "bus: %lu queued, %llu turns, %llu waited\n", s.bus_queue,
+            (unsigned long long)s.bus_turns, (unsigned long long)s.bus_waits);
+
+    dprintf(fd, "channels:\n");
+    for (int i = 0; i < SE_GTO_MAX_CHANNELS; i++) {
+        const struct se_gto_channel_info *ch = &s.channels[i];
+
+        if (ch->state != SE_GTO_CHANNEL_OPEN)
+            continue;
+        dprintf(fd, "  %2d owner %d, AID %s, P2 %02X, %u APDUs, %u errors, "
+                    "open %llu s\n",
+                i, ch->owner, dump_hex(hex, sizeof(hex), ch->aid, ch->aid_len),
+                ch->p2, ch->apdu_count, ch->apdu_errors,
+                (unsigned long long)((now_ms - ch->open_time_ms) / 1000));
+    }
+
+    dprintf(fd, "errors: %llu blocks received, %llu checksum errors, "
+                "%llu retransmits\n",
+            (unsigned long long)s.blocks_rx, (unsigned long long)s.chk_errors,
+            (unsigned long long)s.retransmits);
+    dprintf(fd, "exchanges: %llu\n", (unsigned long long)s.transceives);
+    dump_phase(fd, "last", &s.last);
+    dump_phase(fd, "total", &s.total);
+
+    if (s.monitor_ms)
+        dprintf(fd, "health: probe after %u ms idle%s, %u probes, %u failed, "
+                    "%u slow, %u recoveries, %u failed, RTT %u us "
+                    "(average %u, base %u)\n",
+                s.monitor_ms, s.monitor_suspended ? " (suspended)" : "",
+                s.health.probes, s.health.probe_errors,
+                s.health.drift_warnings, s.health.recoveries,
+                s.health.recovery_errors, s.health.rtt_last_us,
+                s.health.rtt_ewma_us, s.health.rtt_base_us);
+    else
+        dprintf(fd, "health: monitor off\n");
+
+process:
+    /* Kept by process across contexts */
+    se_gto_select_cache_stats(&hits, &misses);
+    dprintf(fd, "select cache: %lu hits, %lu misses\n", hits, misses);
+
+    dprintf(fd, "latency:\n  %-20s %8s %8s %8s %8s %8s %8s\n", "(us)", "count",
+            "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < SE_GTO_OP_COUNT; i++) {
+        se_gto_get_latency(ctx, SE_GTO_LATENCY_BY_OP, i, &lat);
+        dump_latency(fd, op_names[i], &lat);
+    }
+    for (int i = 0; i <= LATENCY_INS_SLOTS; i++) {
+        int ins = latency_ins_get(i, &lat);
+
+        if (ins < 0)
+            continue;
+        if (ins == LATENCY_INS_OTHER)
+            snprintf(name, sizeof(name), "INS other");
+        else
+            snprintf(name, sizeof(name), "INS %02X", ins);
+        dump_latency(fd, name, &lat);
+    }
+    for (int i = 0; i < SE_GTO_MAX_CHANNELS; i++) {
+        se_gto_get_latency(ctx, SE_GTO_LATENCY_BY_CHANNEL, i, &lat);
+        snprintf(name, sizeof(name), "channel %d", i);
+        dump_latency(fd, name, &lat);
+    }
+    return 0;
+}
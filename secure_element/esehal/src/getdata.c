@@ -0,0 +1,166 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Cache of GET DATA responses for static data objects.
+ *
+ * Only tags listed in configuration are cached, such as CPLC (9F7F). The
+ * response is kept per tag, class, Le and application selected on the
+ * channel, until next reset of the Secure Element.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "getdata.h"
+
+#define INS_GET_DATA 0xCA
+
+/* Parse comma separated list of 4 hex digit tags, empty to disable */
+int
+getdata_cache_set_tags(struct se_gto_ctx *ctx, const char *value)
+{
+    struct getdata_cache *gdc = &ctx->getdata;
+    const char           *s   = value;
+    char                 *end;
+    unsigned long         tag;
+
+    gdc->ntags = 0;
+    getdata_cache_clear(ctx);
+
+    while (*s && (*s != '\n')) {
+        tag = strtoul(s, &end, 16);
+        if ((end == s) || (tag > 0xFFFF) || (gdc->ntags == GETDATA_MAX_TAGS)) {
+            gdc->ntags = 0;
+            return -EINVAL;
+        }
+        gdc->tags[gdc->ntags++] = (uint16_t)tag;
+        s = end;
+        if (*s == ',')
+            s++;
+    }
+    return 0;
+}
+
+void
+getdata_cache_clear(struct se_gto_ctx *ctx)
+{
+    ctx->getdata.nentries = 0;
+    ctx->getdata.used     = 0;
+}
+
+/* Returns channel number if command is a cacheable GET DATA, -1 otherwise */
+static int
+getdata_channel(struct se_gto_ctx *ctx, const uint8_t *apdu, int n)
+{
+    struct getdata_cache *gdc = &ctx->getdata;
+    uint16_t              tag;
+    uint8_t               cla = apdu[0];
+    int                   i;
+
+    if ((gdc->ntags == 0) || (apdu[1] != INS_GET_DATA) || (n < 4) || (n > 5))
+        return -1;
+
+    /* Never cache secure messaging */
+    if ((cla == 0xFF) || ((cla & 0x40) ? (cla & 0x20) : (cla & 0x0C)))
+        return -1;
+
+    tag = (apdu[2] << 8) | apdu[3];
+    for (i = 0; i < gdc->ntags; i++)
+        if (gdc->tags[i] == tag)
+            break;
+    if (i == gdc->ntags)
+        return -1;
+
+    return se_gto_cla_channel(cla);
+}
+
+static struct getdata_entry *
+getdata_find(struct se_gto_ctx *ctx, const uint8_t *apdu, int n, int channel)
+{
+    struct getdata_cache       *gdc = &ctx->getdata;
+    struct se_gto_channel_info *ch  = &ctx->channels[channel];
+    uint16_t                    tag = (apdu[2] << 8) | apdu[3];
+    uint8_t                     le  = (n == 5) ? apdu[4] : 0;
+
+    for (int i = 0; i < gdc->nentries; i++) {
+        struct getdata_entry *e = &gdc->entry[i];
+
+        if ((e->tag == tag) && (e->cla == (apdu[0] & 0x80)) && (e->le == le) &&
+            (e->aid_len == ch->aid_len) && !memcmp(e->aid, ch->aid, ch->aid_len))
+            return e;
+    }
+    return NULL;
+}
+
+/* Returns response length if served from cache, 0 otherwise */
+int
+getdata_cache_lookup(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                     uint8_t *resp, int r)
+{
+    struct getdata_entry *e;
+    int                   channel;
+
+    channel = getdata_channel(ctx, apdu, n);
+    if (channel < 0)
+        return 0;
+
+    e = getdata_find(ctx, apdu, n, channel);
+    if (!e || (e->length > r))
+        return 0;
+
+    memcpy(resp, ctx->getdata.arena + e->offset, e->length);
+    return e->length;
+}
+
+void
+getdata_cache_store(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                    const uint8_t *resp, int r)
+{
+    struct getdata_cache       *gdc = &ctx->getdata;
+    struct se_gto_channel_info *ch;
+    struct getdata_entry       *e;
+    int                         channel;
+
+    if ((r < 2) || (resp[r - 2] != 0x90) || (resp[r - 1] != 0x00))
+        return;
+
+    channel = getdata_channel(ctx, apdu, n);
+    if ((channel < 0) || getdata_find(ctx, apdu, n, channel))
+        return;
+
+    if ((gdc->nentries == GETDATA_MAX_ENTRIES) ||
+        ((size_t)r > sizeof(gdc->arena) - gdc->used))
+        return;
+
+    ch = &ctx->channels[channel];
+    e  = &gdc->entry[gdc->nentries++];
+    e->tag     = (apdu[2] << 8) | apdu[3];
+    e->cla     = apdu[0] & 0x80;
+    e->le      = (n == 5) ? apdu[4] : 0;
+    e->aid_len = ch->aid_len;
+    memcpy(e->aid, ch->aid, ch->aid_len);
+    e->offset  = (uint16_t)gdc->used;
+    e->length  = (uint16_t)r;
+
+    memcpy(gdc->arena + gdc->used, resp, r);
+    gdc->used += r;
+}
@@ -0,0 +1,63 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Cache of GET DATA responses for static data objects.
+ *
+ */
+
+#ifndef GETDATA_H
+#define GETDATA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GETDATA_MAX_TAGS    8
+#define GETDATA_MAX_ENTRIES 16
+#define GETDATA_ARENA_SIZE  1024
+
+struct getdata_cache {
+    uint16_t tags[GETDATA_MAX_TAGS]; /* Allowed P1-P2, empty when disabled */
+    int      ntags;
+
+    struct getdata_entry {
+        uint16_t tag;
+        uint8_t  cla; /* Class byte without channel number */
+        uint8_t  le;
+        uint8_t  aid_len;
+        uint8_t  aid[16]; /* Application selected on channel */
+        uint16_t offset;  /* Response position in arena */
+        uint16_t length;
+    } entry[GETDATA_MAX_ENTRIES];
+    int nentries;
+
+    /* Responses are packed one after the other */
+    uint8_t arena[GETDATA_ARENA_SIZE];
+    size_t  used;
+};
+
+struct se_gto_ctx;
+
+int getdata_cache_set_tags(struct se_gto_ctx *ctx, const char *value);
+void getdata_cache_clear(struct se_gto_ctx *ctx);
+int getdata_cache_lookup(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                         uint8_t *resp, int r);
+void getdata_cache_store(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                         const uint8_t *resp, int r);
+
+#endif /* GETDATA_H */
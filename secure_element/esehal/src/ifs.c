@@ -0,0 +1,175 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Block size selection from measured throughput.
+ *
+ * Link starts with largest blocks both sides support: IFSD 254, or 4089
+ * with GP, is requested after reset, and I-BLOCKs sent are as large as
+ * card IFSC.
+ * Large blocks need fewer exchanges, but a transmission error costs a
+ * whole block again. For each direction, payload bytes carried per second
+ * of bus time, retransmissions included, are measured per block size.
+ * When errors show up, next smaller size is tried, and the size with best
+ * throughput is kept. Larger blocks are tried again after a while without
+ * error.
+ *
+ * Size of blocks sent is only limited on host side. Size of blocks
+ * received is negotiated with card by IFS request.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "ifs.h"
+
+#define IFS_WINDOW_BLOCKS 32 /* Blocks per evaluation                        */
+#define IFS_ERROR_PCT     2  /* Error rate to try smaller blocks, percent    */
+#define IFS_PROBE_WINDOWS 16 /* Clean windows before larger blocks tried     */
+
+/* Sizes over 254 only with GP, see t1_max_ifs() */
+static const uint16_t ifs_sizes[IFS_LEVELS] = {
+    32, 64, 128, 254, 512, 1024, 2048, T1_GP_MAX_IFS
+};
+
+/* Better by more than 1/8, so that similar sizes do not alternate */
+static int
+ifs_better(uint32_t rate, uint32_t than)
+{
+    return rate > than + than / 8;
+}
+
+/* Smallest level that makes full use of limit set by other side */
+static int
+ifs_top(unsigned limit)
+{
+    int l = 0;
+
+    while ((l + 1 < IFS_LEVELS) && (ifs_sizes[l] < limit))
+        l++;
+    return l;
+}
+
+static void
+ifs_dir_init(struct ifs_dir *d, const struct t1_xfer *x, int top)
+{
+    memset(d, 0, sizeof(*d));
+    d->level = (uint8_t)top;
+    d->start = *x;
+}
+
+void
+ifs_init(struct se_gto_ctx *ctx)
+{
+    int top = ifs_top(t1_max_ifs(&ctx->t1));
+
+    ifs_dir_init(&ctx->ifs.tx, &ctx->t1.tx, top);
+    ifs_dir_init(&ctx->ifs.rx, &ctx->t1.rx, top);
+    ctx->t1.ifst = 0;
+}
+
+/* Returns level to use from now on */
+static int
+ifs_window(struct ifs_dir *d, const struct t1_xfer *x, int top)
+{
+    uint64_t blocks = x->blocks - d->start.blocks;
+    uint64_t errors = x->errors - d->start.errors;
+    uint64_t bytes  = x->bytes - d->start.bytes;
+    uint64_t ns     = x->ns - d->start.ns;
+    uint64_t rate;
+    int      l      = d->level;
+
+    if (l > top)
+        return top;
+    if (blocks < IFS_WINDOW_BLOCKS)
+        return l;
+    d->start = *x;
+    if (!ns)
+        return l;
+
+    rate = bytes * 1000000000ULL / ns;
+    if (rate > UINT32_MAX)
+        rate = UINT32_MAX;
+    if (d->rate[l])
+        d->rate[l] = d->rate[l] - d->rate[l] / 4 + (uint32_t)rate / 4;
+    else
+        d->rate[l] = (uint32_t)rate;
+
+    if (errors)
+        d->clean = 0;
+
+    if (l > 0) {
+        if (ifs_better(d->rate[l - 1], d->rate[l]))
+            return l - 1;
+        /* Retransmitting large blocks may cost more than smaller ones */
+        if (!d->rate[l - 1] && (errors * 100 > blocks * IFS_ERROR_PCT))
+            return l - 1;
+    }
+    if (l < top) {
+        if (ifs_better(d->rate[l + 1], d->rate[l]))
+            return l + 1;
+        if (!errors && (++d->clean >= IFS_PROBE_WINDOWS)) {
+            /* Link may be better now, measure again */
+            d->rate[l + 1] = 0;
+            return l + 1;
+        }
+    }
+    return l;
+}
+
+static void
+ifs_select(struct se_gto_ctx *ctx, struct ifs_dir *d, const struct t1_xfer *x,
+           int top, const char *what)
+{
+    int l = ifs_window(d, x, top);
+
+    if (l == d->level)
+        return;
+    info("%s blocks of %u bytes at most, %u bytes/s with %u bytes\n", what,
+         ifs_sizes[l], d->rate[d->level], ifs_sizes[d->level]);
+    d->level = (uint8_t)l;
+    d->clean = 0;
+}
+
+/* Called with context lock held, after each exchange */
+void
+ifs_after(struct se_gto_ctx *ctx, int r)
+{
+    struct ifs_manager *im = &ctx->ifs;
+    struct t1_state    *t1 = &ctx->t1;
+    uint16_t            ifsd;
+    int                 err;
+
+    if (!im->enabled)
+        return;
+
+    ifs_select(ctx, &im->tx, &t1->tx, ifs_top(t1->ifsc), "sending");
+    t1->ifst = ifs_sizes[im->tx.level];
+    ifs_select(ctx, &im->rx, &t1->rx, ifs_top(t1_max_ifs(t1)), "receiving");
+
+    /* Also after reset, which restores largest IFSD */
+    ifsd = ifs_sizes[im->rx.level];
+    if ((r >= 0) && (t1->ifsd != ifsd)) {
+        err = isot1_negotiate_ifsd(t1, ifsd);
+        if (err < 0)
+            warn("failed to negotiate IFSD %u, %s\n", ifsd, strerror(-err));
+    }
+}
@@ -0,0 +1,57 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Block size selection from measured throughput.
+ *
+ */
+
+#ifndef IFS_H
+#define IFS_H
+
+#include <stdint.h>
+
+#include "iso7816_t1.h"
+
+#define IFS_LEVELS 8
+
+/* Block size choice for one direction */
+struct ifs_dir {
+    uint8_t level; /* Index of block size in use */
+    uint8_t clean; /* Windows without error at this level */
+
+    /* Effective throughput per block size, bytes per second, 0 unknown */
+    uint32_t rate[IFS_LEVELS];
+
+    /* Transfer counters at start of window */
+    struct t1_xfer start;
+};
+
+struct ifs_manager {
+    uint8_t        enabled;
+    struct ifs_dir tx; /* I-BLOCK sent, limited by IFSC */
+    struct ifs_dir rx; /* I-BLOCK received, IFSD        */
+};
+
+struct se_gto_ctx;
+
+void ifs_init(struct se_gto_ctx *ctx);
+void ifs_after(struct se_gto_ctx *ctx, int r);
+
+#endif /* IFS_H */
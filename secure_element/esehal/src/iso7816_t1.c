@@ -31,17 +31,24 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <time.h>
 #include <log/log.h>
 
 #include "iso7816_t1.h"
 #include "checksum.h"
+#include "pcap.h"
+#include "probe.h"
+#include "systrace.h"
 #include "transport.h"
 
 #define T1_REQUEST_RESYNC 0x00
 #define T1_REQUEST_IFS    0x01
 #define T1_REQUEST_ABORT  0x02
 #define T1_REQUEST_WTX    0x03
+#define T1_REQUEST_CIP    0x04 /* GP: Communication Interface Parameters */
 #define T1_REQUEST_RESET  0x05 /* Custom RESET for SPI version */
+#define T1_REQUEST_RELEASE 0x06 /* GP: card may go to power saving */
+#define T1_REQUEST_SWR    0x0F /* GP: software reset */
 
 #define MAX_RETRIES 3
 
@@ -106,10 +113,25 @@ t1_close_send_window(struct t1_state *t1)
     t1->send.end = t1->send.start;
 }
 
+static void
+t1_set_block_length(struct t1_state *t1, uint8_t *buf, size_t n)
+{
+    if (t1->proto == T1_PROTO_GP)
+        buf[2] = (uint8_t)(n >> 8), buf[3] = (uint8_t)n;
+    else
+        buf[2] = (uint8_t)n;
+}
+
+static uint8_t *
+t1_inf(struct t1_state *t1, uint8_t *buf)
+{
+    return buf + t1_prologue_length(t1);
+}
+
 static int
 do_chk(struct t1_state *t1, uint8_t *buf)
 {
-    int n = 3 + buf[2];
+    int n = t1_prologue_length(t1) + t1_block_length(t1, buf);
 
     switch (t1->chk_algo) {
         case CHECKSUM_LRC:
@@ -123,6 +145,13 @@ do_chk(struct t1_state *t1, uint8_t *buf)
             buf[n++] = (uint8_t)(crc);
             break;
         }
+
+        case CHECKSUM_CRC16: {
+            uint16_t crc = crc_iso13239(buf, n);
+            buf[n++] = (uint8_t)(crc);
+            buf[n++] = (uint8_t)(crc >> 8);
+            break;
+        }
     }
     return n;
 }
@@ -130,7 +159,7 @@ do_chk(struct t1_state *t1, uint8_t *buf)
 static int
 chk_is_good(struct t1_state *t1, const uint8_t *buf)
 {
-    int n = 3 + buf[2];
+    int n = t1_prologue_length(t1) + t1_block_length(t1, buf);
     int match;
 
     switch (t1->chk_algo) {
@@ -144,12 +173,27 @@ chk_is_good(struct t1_state *t1, const uint8_t *buf)
             break;
         }
 
+        case CHECKSUM_CRC16: {
+            uint16_t crc = crc_iso13239(buf, n);
+            match = (crc == (buf[n] | (buf[n + 1] << 8)));
+            break;
+        }
+
         default:
             match = 0;
     }
     return match;
 }
 
+/* Card may also change IFSC in the middle of a chain */
+static ptrdiff_t
+t1_send_block_size(struct t1_state *t1)
+{
+    if (t1->ifst && (t1->ifst < t1->ifsc))
+        return t1->ifst;
+    return t1->ifsc;
+}
+
 static int
 write_iblock(struct t1_state *t1, uint8_t *buf)
 {
@@ -160,18 +204,19 @@ write_iblock(struct t1_state *t1, uint8_t *buf)
     if (n <= 0)
         return -EBADMSG;
 
-    if (n > t1->ifsc)
-        n = t1->ifsc, pcb = 0x20;
+    if (n > t1_send_block_size(t1))
+        n = t1_send_block_size(t1), pcb = 0x20;
     else
         pcb = 0;
+    t1->send.last = (uint16_t)n;
 
     if (t1->send.next)
         pcb |= 0x40;
 
     buf[0] = t1->nad;
     buf[1] = pcb;
-    buf[2] = (uint8_t)n;
-    memcpy(buf + 3, t1->send.start, (size_t)n);
+    t1_set_block_length(t1, buf, (size_t)n);
+    memcpy(t1_inf(t1, buf), t1->send.start, (size_t)n);
     return do_chk(t1, buf);
 }
 
@@ -182,30 +227,32 @@ write_rblock(struct t1_state *t1, int n, uint8_t *buf)
     buf[1] = 0x80 | (n & 3);
     if (t1->recv.next)
         buf[1] |= 0x10;
-    buf[2] = 0;
+    t1_set_block_length(t1, buf, 0);
     return do_chk(t1, buf);
 }
 
 static int
 write_request(struct t1_state *t1, int request, uint8_t *buf)
 {
+    uint8_t *inf = t1_inf(t1, buf);
+    size_t   n   = 0;
+    unsigned ifs;
+
     buf[0] = t1->nad;
     buf[1] = 0xC0 | request;
 
     request &= 0x1F;
     if (T1_REQUEST_IFS == request) {
         /* On response, resend card IFS, else this is request for device IFS */
-        buf[2] = 1;
-        if (buf[1] & 0x20)
-            buf[3] = t1->ifsc;
-        else
-            buf[3] = t1->ifsd;
-    } else if (T1_REQUEST_WTX == request) {
-        buf[2] = 1;
-        buf[3] = t1->wtx;
-    } else
-        buf[2] = 0;
-
+        ifs = (buf[1] & 0x20) ? t1->ifsc : t1->ifsd;
+        /* GP sizes over 254 take 2 bytes */
+        if (ifs > T1_ISO_MAX_IFS)
+            inf[n++] = (uint8_t)(ifs >> 8);
+        inf[n++] = (uint8_t)ifs;
+    } else if (T1_REQUEST_WTX == request)
+        inf[n++] = t1->wtx;
+
+    t1_set_block_length(t1, buf, n);
     return do_chk(t1, buf);
 }
 
@@ -214,8 +261,9 @@ ack_iblock(struct t1_state *t1)
 {
     ptrdiff_t n = t1_send_window_size(t1);
 
-    if (n > t1->ifsc)
-        n = t1->ifsc;
+    /* Size sent, IFSC may have changed since */
+    if (n > t1->send.last)
+        n = t1->send.last;
     t1->send.start += n;
 
     /* Next packet sequence number */
@@ -231,8 +279,8 @@ parse_iblock(struct t1_state *t1, uint8_t *buf)
 
     if (t1->recv.next == next) {
         t1->recv.next ^= 1;
-        t1_recv_window_append(t1, buf + 3, buf[2]);
-        t1->recv_size += buf[2];
+        t1_recv_window_append(t1, t1_inf(t1, buf), t1_block_length(t1, buf));
+        t1->recv_size += t1_block_length(t1, buf);
     }
 
     /* 1 if more to come */
@@ -253,13 +301,21 @@ parse_rblock(struct t1_state *t1, uint8_t *buf)
                 t1->retries = MAX_RETRIES;
                 ack_iblock(t1);
             } else {
+                t1->retransmits++;
+                T1_STAT_ADD(t1, retransmits, 1);
                 t1->retries--;
+                GTO_PROBE2(retry, -ETIMEDOUT, t1->retries);
                 if (t1->retries <= 0) r = -ETIMEDOUT;
             }
             break;
 
         case 1:
+            t1->chk_errors++;
+            t1->retransmits++;
+            T1_STAT_ADD(t1, chk_errors, 1);
+            T1_STAT_ADD(t1, retransmits, 1);
             t1->retries--;
+            GTO_PROBE2(retry, -EREMOTEIO, t1->retries);
             t1->send.next = next;
             r = -EREMOTEIO;
             /* CRC error on previous block, will resend */
@@ -284,10 +340,32 @@ parse_rblock(struct t1_state *t1, uint8_t *buf)
     return r;
 }
 
+/* IFS value of S(IFS) block, -1 if malformed */
+static int
+t1_ifs_value(struct t1_state *t1, uint8_t *buf)
+{
+    const uint8_t *inf = t1_inf(t1, buf);
+    size_t         len = t1_block_length(t1, buf);
+    int            ifs;
+
+    if (len == 1)
+        ifs = inf[0];
+    else if ((len == 2) && (t1->proto == T1_PROTO_GP))
+        ifs = (inf[0] << 8) | inf[1];
+    else
+        return -1;
+
+    if ((ifs == 0) || (ifs > (int)t1_max_ifs(t1)))
+        return -1;
+    return ifs;
+}
+
 static int
 parse_request(struct t1_state *t1, uint8_t *buf)
 {
-    int n = 0;
+    int    n   = 0;
+    size_t len = t1_block_length(t1, buf);
+    int    ifs;
 
     uint8_t request = buf[1] & 0x3F;
 
@@ -298,16 +376,15 @@ parse_request(struct t1_state *t1, uint8_t *buf)
             break;
 
         case T1_REQUEST_IFS:
-            if (buf[2] != 1)
-                n = -EBADMSG;
-            else if ((buf[3] == 0) || (buf[3] == 0xFF))
+            ifs = t1_ifs_value(t1, buf);
+            if (ifs < 0)
                 n = -EBADMSG;
             else
-                t1->ifsc = buf[3];
+                t1->ifsc = (uint16_t)ifs;
             break;
 
         case T1_REQUEST_ABORT:
-            if (buf[2] == 0) {
+            if (len == 0) {
                 t1->state.aborted = 1;
                 t1_close_send_window(t1);
                 t1_close_recv_window(t1);
@@ -316,11 +393,13 @@ parse_request(struct t1_state *t1, uint8_t *buf)
             break;
 
         case T1_REQUEST_WTX:
-            if (buf[2] > 1) {
+            if (len > 1) {
                 n = -EBADMSG;
                 break;
-            } else if (buf[2] == 1) {
-                t1->wtx = buf[3];
+            } else if (len == 1) {
+                T1_STAT_ADD(t1, wtx, 1);
+                t1->wtx = t1_inf(t1, buf)[0];
+                GTO_PROBE1(wtx, t1->wtx);
                 if (t1->wtx_max_value)
                     if (t1->wtx > WTX_MAX_VALUE)
                         t1->wtx = WTX_MAX_VALUE;
@@ -380,12 +459,59 @@ parse_atr(struct t1_state *t1)
         t1->ifsc = (uint8_t)ifsc;
 }
 
+/* GP CIP: PVER, IIN, PLID, PLP, DLLP and HB, all but PVER and PLID
+ * prefixed with their length. DLLP holds BWT (ms) and IFSC on 2 bytes each.
+ */
+static int
+parse_cip(struct t1_state *t1, const uint8_t *cip, size_t n)
+{
+    const uint8_t *dllp, *hb;
+    size_t         i;
+    unsigned       ifsc;
+
+    if ((n < 1 + 1) || (n > sizeof(t1->cip)))
+        return -EBADMSG;
+
+    i = 1;           /* PVER */
+    i += 1 + cip[i]; /* IIN  */
+    i += 1;          /* PLID */
+    if (i >= n)
+        return -EBADMSG;
+    i += 1 + cip[i]; /* PLP  */
+    if (i >= n)
+        return -EBADMSG;
+    dllp = cip + i;
+    i += 1 + cip[i];
+    if (i >= n)
+        return -EBADMSG;
+    hb = cip + i;
+    i += 1 + cip[i];
+    if ((i != n) || (dllp[0] < 4) || (hb[0] > sizeof(t1->atr)))
+        return -EBADMSG;
+
+    ifsc = (dllp[3] << 8) | dllp[4];
+    if ((ifsc == 0) || (ifsc > T1_GP_MAX_IFS))
+        return -EBADMSG;
+
+    memcpy(t1->cip, cip, n);
+    t1->cip_length = (uint8_t)n;
+
+    t1->bwt  = (dllp[1] << 8) | dllp[2];
+    t1->ifsc = (uint16_t)ifsc;
+
+    /* Historical bytes are what identifies card, as ATR does */
+    t1->atr_length = hb[0];
+    memcpy(t1->atr, hb + 1, hb[0]);
+    return 0;
+}
+
 /* 1 if expected response, 0 if reemit I-BLOCK, negative value is error */
 static int
 parse_response(struct t1_state *t1, uint8_t *buf)
 {
     int     r;
     uint8_t pcb = buf[1];
+    size_t  len = t1_block_length(t1, buf);
 
     r = 0;
 
@@ -397,26 +523,53 @@ parse_response(struct t1_state *t1, uint8_t *buf)
             switch (pcb) {
                 case T1_REQUEST_IFS:
 				    t1->need_ifsd_sync = 0;
-                    if ((buf[2] != 1) && (buf[3] != t1->ifsd))
+                    if ((len != 1) && (t1_ifs_value(t1, buf) != t1->ifsd))
                         r = -EBADMSG;
                     break;
 
                 case T1_REQUEST_RESET:
                     t1->need_reset = 0;
-                    if (buf[2] <= sizeof(t1->atr)) {
-                        t1->atr_length = buf[2];
+                    T1_STAT_ADD(t1, resets, 1);
+                    if (len <= sizeof(t1->atr)) {
+                        t1->atr_length = (uint8_t)len;
                         if (t1->atr_length)
-                            memcpy(t1->atr, buf + 3, t1->atr_length);
+                            memcpy(t1->atr, t1_inf(t1, buf), t1->atr_length);
                         parse_atr(t1);
                     } else
                         r = -EBADMSG;
                     break;
+
+                case T1_REQUEST_SWR:
+                    T1_STAT_ADD(t1, resets, 1);
+                    /* Reset completes with CIP */
+                    t1->send.next  = 0;
+                    t1->recv.next  = 0;
+                    break;
+
+                case T1_REQUEST_CIP:
+                    if (parse_cip(t1, t1_inf(t1, buf), len) < 0)
+                        r = -EBADMSG;
+                    else
+                        t1->need_reset = 0;
+                    break;
+
+                case T1_REQUEST_RELEASE:
+                    t1->released = 1;
+                    break;
                 case T1_REQUEST_RESYNC:
                     t1->need_resync = 0;
+                    T1_STAT_ADD(t1, resyncs, 1);
                     t1->send.next = 0;
                     t1->recv.next = 0;
                     break;
                 case T1_REQUEST_ABORT:
+                    /* Host ABORT acknowledged, chain dropped on both sides */
+                    t1->state.aborted = 1;
+                    t1_close_send_window(t1);
+                    t1_close_recv_window(t1);
+                    /* Sequence numbers restart on next exchange */
+                    t1->need_resync = 1;
+                    break;
 
                 default:
                     /* We never emitted those requests */
@@ -444,7 +597,8 @@ block_kind(const uint8_t *buf)
 static int
 read_block(struct t1_state *t1)
 {
-    int n;
+    uint8_t wtx = t1->wtx;
+    int     n, good;
 
     n = block_recv(t1, t1->buf, sizeof(t1->buf));
 
@@ -453,51 +607,134 @@ read_block(struct t1_state *t1)
     else if (n < 3)
         return -EBADMSG;
     else {
-        if (!chk_is_good(t1, t1->buf))
+        good = chk_is_good(t1, t1->buf);
+        pcap_block(t1, GTO_PCAP_BLOCK_RX, t1->buf, n,
+                   (good ? 0 : GTO_PCAP_BAD_CHECKSUM) |
+                   (wtx > 1 ? GTO_PCAP_WTX : 0),
+                   MAX_RETRIES - t1->retries, t1->wait.last_wait_us);
+        if (!good) {
+            GTO_PROBE1(chk_error, t1->buf[1]);
             return -EREMOTEIO;
+        }
 
         if (t1->buf[0] != t1->nadc)
             return -EBADMSG;
 
-        if (t1->buf[2] == 255)
+        if (t1_block_length(t1, t1->buf) > t1_max_ifs(t1))
             return -EBADMSG;
     }
 
     return n;
 }
 
+/* Account turn moving a block of a chain. Card answers at once, so turn
+ * time is the cost of block size, retransmissions included.
+ */
+static void
+t1_xfer_turn(struct t1_state *t1, struct t1_xfer *x,
+             const struct timespec *start, int n, size_t sent)
+{
+    struct timespec end;
+
+    if ((n == -EREMOTEIO) || (n == -ETIMEDOUT))
+        x->errors++;
+    else if (n < 0)
+        return;
+    else if (x == &t1->tx) {
+        /* Chained block acknowledged, or asked again */
+        if (block_kind(t1->buf) != T1_RBLOCK)
+            return;
+        if (t1->buf[1] & 0x0F)
+            x->errors++;
+        else
+            x->bytes += sent, x->blocks++;
+    } else {
+        if (block_kind(t1->buf) != T1_IBLOCK)
+            return;
+        x->bytes += t1_block_length(t1, t1->buf), x->blocks++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    x->ns += (end.tv_sec - start->tv_sec) * 1000000000LL +
+             (end.tv_nsec - start->tv_nsec);
+}
+
+/* Abort command from host side on cancel or deadline */
+static void
+t1_abort(struct t1_state *t1, int err)
+{
+    t1->abort_err     = err;
+    t1->state.request = 1;
+    t1->request       = T1_REQUEST_ABORT;
+    t1->retries       = MAX_RETRIES;
+}
+
+/* GP resets with SWR, then reads card parameters with CIP */
+static int
+t1_reset_request(struct t1_state *t1)
+{
+    return (t1->proto == T1_PROTO_GP) ? T1_REQUEST_SWR : T1_REQUEST_RESET;
+}
+
+static int
+t1_is_reset_request(int request)
+{
+    return (request == T1_REQUEST_RESET) || (request == T1_REQUEST_SWR) ||
+           (request == T1_REQUEST_CIP);
+}
+
 static int
 t1_loop(struct t1_state *t1)
 {
     int len;
-    int n = 0;
+    int n        = 0;
+    int received = 0;
+
+    struct t1_xfer *xfer;
+    struct timespec start;
+    size_t          sent;
 
     /* Will happen on first run */
     if (t1->need_reset) {
         t1->state.request = 1;
-        t1->request       = T1_REQUEST_RESET;
+        t1->request       = t1_reset_request(t1);
     } else if (t1->need_resync) {
         t1->state.request = 1;
         t1->request       = T1_REQUEST_RESYNC;
     }else if(t1->need_ifsd_sync){
 		t1->state.request = 1;
         t1->request = T1_REQUEST_IFS;
-        t1->ifsd    = 254;
+        t1->ifsd    = t1_max_ifs(t1);
 	}
 
     while (!t1->state.halt && t1->retries) {
+        /* Half duplex: give up only when host has the turn after a card
+         * block, in place of WTX response or of next block. Other card
+         * requests are answered first.
+         */
+        if (received && !t1->state.request &&
+            (!t1->state.reqresp || (t1->request == T1_REQUEST_WTX)) &&
+            ((n = isot1_interrupted(t1)) < 0)) {
+            t1->state.reqresp = 0;
+            t1_abort(t1, n);
+        }
+
         if (t1->state.request)
             n = write_request(t1, t1->request, t1->buf);
         else if (t1->state.reqresp) {
             n = write_request(t1, 0x20 | t1->request, t1->buf);
             /* If response is not seen, card will repost request */
             t1->state.reqresp = 0;
-        } else if (t1->state.badcrc)
+        } else if (t1->state.badcrc) {
             /* FIXME "1" -> T1_RBLOCK_CRC_ERROR */
             n = write_rblock(t1, 1, t1->buf);
-        else if (t1->state.timeout)
+            t1->retransmits++;
+            T1_STAT_ADD(t1, retransmits, 1);
+        } else if (t1->state.timeout) {
             n = write_rblock(t1, 0, t1->buf);
-        else if (t1_send_window_size(t1))
+            t1->retransmits++;
+            T1_STAT_ADD(t1, retransmits, 1);
+        } else if (t1_send_window_size(t1))
             n = write_iblock(t1, t1->buf);
         else if (t1->state.aborted)
             n = -EPIPE;
@@ -511,19 +748,47 @@ t1_loop(struct t1_state *t1)
         if (n < 0)
             break;
 
+        /* Chained I-BLOCK sent, or R-BLOCK asking for next one */
+        xfer = NULL;
+        if ((block_kind(t1->buf) == T1_IBLOCK) && (t1->buf[1] & 0x20))
+            xfer = &t1->tx;
+        else if (block_kind(t1->buf) == T1_RBLOCK)
+            xfer = &t1->rx;
+        sent = t1_block_length(t1, t1->buf);
+
+        /* Other endpoints wait until answer is read */
+        block_turn_begin(t1);
+        if (xfer)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+        systrace_begin("T=1 send");
         len = block_send(t1, t1->buf, n);
+        systrace_end();
         if (len < 0) {
+            block_turn_end(t1);
             /* failure to send is permanent, give up immediately */
             n = len;
             break;
         }
+        pcap_block(t1, GTO_PCAP_BLOCK_TX, t1->buf, n,
+                   t1->retries < MAX_RETRIES ? GTO_PCAP_RETRANSMIT : 0,
+                   MAX_RETRIES - t1->retries, 0);
 
+        systrace_begin("T=1 receive");
         n = read_block(t1);
+        systrace_end();
+        block_turn_end(t1);
+        if (xfer)
+            t1_xfer_turn(t1, xfer, &start, n, sent);
         if (n < 0) {
             t1->retries--;
+            GTO_PROBE2(retry, n, t1->retries);
+            systrace_counter("se-gto T=1 retries", MAX_RETRIES - t1->retries);
             switch (n) {
                 /* Error that trigger recovery */
                 case -EREMOTEIO:
+                    t1->chk_errors++;
+                    T1_STAT_ADD(t1, chk_errors, 1);
                     /* Emit checksum error R-BLOCK */
                     t1->state.badcrc = 1;
                     continue;
@@ -547,6 +812,8 @@ t1_loop(struct t1_state *t1)
             /* Shall never reach this line */
             break;
         }
+        t1->blocks_rx++;
+        received = 1;
 
         if (t1->state.badcrc)
             if ((t1->buf[1] & 0xEF) == 0x81) {
@@ -569,14 +836,25 @@ t1_loop(struct t1_state *t1)
 
                     case 1:
                         t1->state.request = 0;
+                        if (t1->request == T1_REQUEST_ABORT) {
+                            t1->state.halt = 1, n = t1->abort_err;
+                            continue;
+                        }
+                        if (t1->request == T1_REQUEST_SWR) {
+                            t1->state.request = 1;
+                            t1->request       = T1_REQUEST_CIP;
+                            t1->retries       = MAX_RETRIES;
+                            continue;
+                        }
                         /* Nothing to do ? leave */
                         if (t1_recv_window_free_size(t1) == 0)
                             t1->state.halt = 1, n = 0;
                         t1->retries = MAX_RETRIES;
-						if(t1->request       == T1_REQUEST_RESET) {
+						if ((t1->request == T1_REQUEST_RESET) ||
+						    (t1->request == T1_REQUEST_CIP)) {
 							t1->state.request = 1;
                             t1->request = T1_REQUEST_IFS;
-                            t1->ifsd    = 254;
+                            t1->ifsd    = t1_max_ifs(t1);
 							t1->need_ifsd_sync = 1;
 						}
                         continue;
@@ -638,6 +916,9 @@ t1_clear_states(struct t1_state *t1)
     t1->state.badcrc  = 0;
     t1->state.timeout = 0;
     t1->state.aborted = 0;
+    t1->abort_err     = 0;
+    t1->released      = 0;
+    t1->recovered     = 0;
 
     t1->wtx     = 1;
     t1->retries = MAX_RETRIES;
@@ -657,17 +938,28 @@ t1_init(struct t1_state *t1)
 {
     t1_clear_states(t1);
 
+    t1->proto    = T1_PROTO_ISO;
     t1->chk_algo = CHECKSUM_LRC;
     t1->ifsc     = 32;
     t1->ifsd     = 32;
     t1->bwt      = 300; /* milliseconds */
 
+    t1->wait.strategy       = T1_WAIT_FIXED;
+    t1->wait.poll_us        = 2000;
+    t1->wait.spin_us        = 100;
+    t1->wait.backoff_max_us = 2000;
+    t1->wait.sleep_us       = 5000;
+    t1->wait.timer_fd       = -1;
+
     t1->send.next = 0;
     t1->recv.next = 0;
 
     t1->need_reset = 1;
     t1->need_resync = 0;
     t1->spi_fd     = -1;
+    t1->bus        = NULL;
+    t1->trace      = NULL;
+    t1->pcap       = NULL;
 
     t1->wtx_max_rounds = MAX_WTX_ROUNDS;
     t1->wtx_max_value  = 1;
@@ -680,6 +972,9 @@ static void
 t1_release(struct t1_state *t1)
 {
     t1->state.halt = 1;
+    if (t1->wait.timer_fd >= 0)
+        close(t1->wait.timer_fd);
+    t1->wait.timer_fd = -1;
 }
 
 static void
@@ -699,57 +994,123 @@ static int
 t1_transceive(struct t1_state *t1, const void *snd_buf,
               size_t snd_len, void *rcv_buf, size_t rcv_len)
 {
-    int n, r;
+    const uint8_t *apdu = snd_buf, *resp = rcv_buf;
+    int            n, r;
+
+    if (snd_len >= 4)
+        GTO_PROBE5(apdu_begin, apdu[0], apdu[1], apdu[2], apdu[3], snd_len);
 
     t1_clear_states(t1);
+    memset(&t1->stats.call, 0, sizeof(t1->stats.call));
 
     t1_init_send_window(t1, snd_buf, snd_len);
     t1_init_recv_window(t1, rcv_buf, rcv_len);
 
+    /* Unless a request goes first, first block waited is APDU response */
+    t1->wait.first         = !t1->need_reset && !t1->need_resync;
+    t1->wait.first_wait_us = 0;
+
     n = t1_loop(t1);
     if (n == 0)
         /* Received APDU response */
         n = (int)t1_recv_window_size(t1);
     else if (n < 0  && t1->state.aborted != 1){
-        if (!(t1->state.request == 1 && t1->request == T1_REQUEST_RESET))
+        if (!(t1->state.request == 1 && t1_is_reset_request(t1->request)))
         {
+            /* Reset must not be aborted */
+            t1->interruptible = 0;
             /*Request Soft RESET to the secure element*/
             r = t1_reset(t1);
             if (r < 0) n = -0xDEAD; /*Fatal error meaning eSE is not responding to reset*/
+            else t1->recovered = 1;
         }
     }
+
+    t1->stats.transceives++;
+    t1->stats.last = t1->stats.call;
+    if (t1->stats.call.retransmits)
+        systrace_counter("se-gto T=1 retries", 0);
+
+    if (snd_len >= 4)
+        GTO_PROBE3(apdu_end, apdu[1], n,
+                   n >= 2 ? (resp[n - 2] << 8) | resp[n - 1] : 0);
     return n;
 }
 
 static int
 t1_negotiate_ifsd(struct t1_state *t1, int ifsd)
 {
+    int old = t1->ifsd;
+    int n;
+
     t1_clear_states(t1);
     t1->state.request = 1;
 
     t1->request = T1_REQUEST_IFS;
     t1->ifsd    = ifsd;
-    return t1_loop(t1);
+    n = t1_loop(t1);
+
+    /* Card keeps former IFSD, unless link was reset meanwhile: next
+     * negotiation sees the difference and tries again
+     */
+    if ((n < 0) && (t1->ifsd == ifsd) && !t1->need_reset)
+        t1->ifsd = old;
+    return n;
 }
 
 static int
 t1_reset(struct t1_state *t1)
 {
+    int n;
+
+    GTO_PROBE0(reset_begin);
     t1_clear_states(t1);
     t1->need_reset = 1;
 
-    return t1_loop(t1);
+    n = t1_loop(t1);
+    GTO_PROBE1(reset_end, n);
+    return n;
 }
 
 static int
 t1_resync(struct t1_state *t1)
 {
+    int n;
+
+    GTO_PROBE0(resync_begin);
     t1_clear_states(t1);
     t1->need_resync = 1;
 
+    n = t1_loop(t1);
+    GTO_PROBE1(resync_end, n);
+    return n;
+}
+
+/* Only GP has a request for card to release its interface */
+static int
+t1_sleep(struct t1_state *t1)
+{
+    if ((t1->proto != T1_PROTO_GP) || t1->need_reset)
+        return 0;
+
+    t1_clear_states(t1);
+    t1->state.request = 1;
+    t1->request       = T1_REQUEST_RELEASE;
     return t1_loop(t1);
 }
 
+static void
+t1_set_protocol(struct t1_state *t1, int proto)
+{
+    t1->proto      = (uint8_t)proto;
+    t1->chk_algo   = (proto == T1_PROTO_GP) ? CHECKSUM_CRC16 : CHECKSUM_LRC;
+    t1->ifsc       = 32;
+    t1->ifsd       = 32;
+    t1->ifst       = 0;
+    t1->cip_length = 0;
+    t1->need_reset = 1;
+}
+
 void
 isot1_init(struct t1_state *t1)
 {
@@ -768,6 +1129,12 @@ isot1_bind(struct t1_state *t1, int src, int dst)
     t1_bind(t1, src, dst);
 }
 
+void
+isot1_set_protocol(struct t1_state *t1, int proto)
+{
+    t1_set_protocol(t1, proto);
+}
+
 int
 isot1_transceive(struct t1_state *t1, const void *snd_buf,
                  size_t snd_len, void *rcv_buf, size_t rcv_len)
@@ -793,6 +1160,68 @@ isot1_resync(struct t1_state *t1)
     return t1_resync(t1);
 }
 
+int
+isot1_sleep(struct t1_state *t1)
+{
+    return t1_sleep(t1);
+}
+
+/* Following exchanges can be aborted on deadline, NULL for none, or cancel */
+void
+isot1_set_deadline(struct t1_state *t1, const struct timespec *deadline)
+{
+    if (deadline)
+        t1->deadline = *deadline;
+    else
+        t1->deadline.tv_sec = 0, t1->deadline.tv_nsec = 0;
+    __atomic_store_n(&t1->cancel, 0, __ATOMIC_RELAXED);
+    t1->interruptible = 1;
+}
+
+void
+isot1_clear_deadline(struct t1_state *t1)
+{
+    t1->interruptible   = 0;
+    t1->deadline.tv_sec = 0, t1->deadline.tv_nsec = 0;
+    __atomic_store_n(&t1->cancel, 0, __ATOMIC_RELAXED);
+}
+
+/* 1 if card was reset after last exchange failed, with no exchange since */
+int
+isot1_recovered(struct t1_state *t1)
+{
+    return t1->recovered;
+}
+
+/* -ECANCELED or -ETIME if exchange in progress must be aborted, 0 otherwise */
+int
+isot1_interrupted(struct t1_state *t1)
+{
+    struct timespec now;
+
+    if (!t1->interruptible || t1->abort_err)
+        return 0;
+
+    if (__atomic_load_n(&t1->cancel, __ATOMIC_RELAXED))
+        return -ECANCELED;
+
+    if (t1->deadline.tv_sec) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec > t1->deadline.tv_sec) ||
+            ((now.tv_sec == t1->deadline.tv_sec) &&
+             (now.tv_nsec >= t1->deadline.tv_nsec)))
+            return -ETIME;
+    }
+    return 0;
+}
+
+/* May be called from any thread while transceive is in progress */
+void
+isot1_cancel(struct t1_state *t1)
+{
+    __atomic_store_n(&t1->cancel, 1, __ATOMIC_RELAXED);
+}
+
 int
 isot1_get_atr(struct t1_state *t1, void *atr, size_t n)
 {
@@ -23,11 +23,81 @@
 #ifndef ISO7816_T1_H
 #define ISO7816_T1_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+enum { T1_WAIT_FIXED, T1_WAIT_HYBRID };
+
+/* Block format, set before first exchange */
+enum { T1_PROTO_ISO, T1_PROTO_GP };
+
+#define T1_ISO_MAX_IFS 254  /* LEN on 1 byte, 0xFF is invalid       */
+#define T1_GP_MAX_IFS  4089 /* GlobalPlatform T=1 over SPI/I2C, 0xFF9 */
+#define T1_CIP_MAX     64
+
+/* How block reception waits for card, and what it cost */
+struct t1_wait {
+    int      strategy;       /* T1_WAIT_FIXED or T1_WAIT_HYBRID             */
+    unsigned poll_us;        /* Fixed: period between polls                 */
+    unsigned spin_us;        /* Hybrid: poll without sleeping that long     */
+    unsigned backoff_max_us; /* Hybrid: then double sleep up to this        */
+    unsigned sleep_us;       /* Hybrid: after 10 x backoff_max, sleep this  */
+
+    int timer_fd; /* timerfd, -1 until first use */
+
+    unsigned hint_us;       /* Expected wait for response, first poll then */
+    uint8_t  first;         /* Next block is first response of exchange    */
+    uint32_t first_wait_us; /* Measured wait for it, 0 if not seen         */
+
+    uint64_t blocks;
+    uint64_t polls;
+    uint64_t wait_us;   /* From start of wait until block is seen          */
+    uint64_t wasted_us; /* Last sleep before block seen, upper bound of
+                         * time block was ready but not read              */
+    uint32_t last_polls;
+    uint32_t last_wait_us;
+    uint32_t last_wasted_us;
+
+    /* Scheduling jitter: how late thread woke up after each sleep */
+    uint64_t wakes;
+    uint64_t late_us;
+    uint32_t late_max_us;
+    uint32_t last_late_us;
+};
+
+/* Protocol cost of an exchange, every block included */
+struct t1_phase {
+    uint64_t send_ns;     /* Writing blocks to device              */
+    uint64_t wait_ns;     /* Polling until card NAD is seen        */
+    uint64_t read_ns;     /* Reading rest of block after NAD       */
+    uint64_t polls;
+    uint64_t wtx;         /* WTX requests from card                */
+    uint64_t retransmits; /* Blocks sent again on error or timeout */
+    uint64_t chk_errors;  /* Bad checksum, either side             */
+    uint64_t resyncs;
+    uint64_t resets;
+    uint64_t blocks_tx;
+    uint64_t blocks_rx;
+    uint64_t bytes_tx;
+    uint64_t bytes_rx;    /* Polled bytes included                 */
+};
+
+/* Counted in exchange in progress and since init at once */
+#define T1_STAT_ADD(t1, field, v) \
+    ((t1)->stats.call.field += (v), (t1)->stats.total.field += (v))
+
+struct gto_bus;
+struct trace;
+struct pcap_writer;
 
 struct t1_state {
     int spi_fd; /* File descriptor for transport */
 
+    struct gto_bus     *bus;   /* Shared with other endpoints, NULL if none */
+    struct trace       *trace; /* Block recorder, NULL if none */
+    struct pcap_writer *pcap;  /* Block capture, NULL if none */
+
     struct {
         /* Ordered by decreasing priority */
         unsigned halt    : 1;   /* Halt dispatch loop             */
@@ -38,15 +108,39 @@ struct t1_state {
         unsigned aborted : 1;   /* Abort was requested            */
     } state;
 
-    uint8_t ifsc; /* IFS for card        */
-    uint8_t ifsd; /* IFS for device      */
+    uint8_t  proto; /* T1_PROTO_ISO or T1_PROTO_GP */
+    uint16_t ifsc;  /* IFS for card        */
+    uint16_t ifsd;  /* IFS for device      */
+    uint16_t ifst;  /* Size limit of I-BLOCK sent, 0 for IFSC */
     uint8_t nad;  /* NAD byte for device */
     uint8_t nadc; /* NAD byte for card   */
     uint8_t wtx;  /* Read timeout scaler */
 
     unsigned bwt; /* Block Waiting Timeout */
 
-    uint8_t chk_algo; /* One of CHECKSUM_LRC or CHECKSUM_CRC                */
+    struct t1_wait wait;
+
+    /* Link errors since init */
+    uint64_t blocks_rx;   /* Blocks read with good checksum         */
+    uint64_t chk_errors;  /* Blocks with bad checksum, either side  */
+    uint64_t retransmits; /* Blocks sent again on error or timeout  */
+
+    /* Cost of chained I-BLOCKs per direction, see ifs.c */
+    struct t1_xfer {
+        uint64_t bytes;  /* Payload of blocks accepted by receiver    */
+        uint64_t ns;     /* Time from send to answer, errors included */
+        uint64_t blocks;
+        uint64_t errors; /* Blocks with bad checksum or sent again    */
+    } tx, rx;
+
+    struct {
+        uint64_t        transceives;
+        struct t1_phase call;  /* Exchange in progress          */
+        struct t1_phase last;  /* Last APDU exchange completed  */
+        struct t1_phase total; /* Every exchange, resets too    */
+    } stats;
+
+    uint8_t chk_algo; /* One of CHECKSUM_LRC, CHECKSUM_CRC or CHECKSUM_CRC16 */
     uint8_t retries;  /* Remaining retries in case of incorrect block       */
     uint8_t request;  /* Current pending request, valid only during request */
 
@@ -55,16 +149,28 @@ struct t1_state {
     int wtx_max_value;  /* Maximum value of WTX supported by host */
 
     uint8_t need_reset; /* Need to send a reset on first start            */
+    uint8_t released;   /* GP: card may sleep, until next exchange        */
+    uint8_t recovered;  /* Reset after failed exchange, until next one    */
     uint8_t need_resync; /* Need to send a reset on first start            */
 	uint8_t need_ifsd_sync; /* Need to send a IFSD request after RESET            */
+    struct timespec deadline; /* CLOCK_MONOTONIC, tv_sec 0 if none        */
+    uint8_t         interruptible; /* APDU exchange, deadline or cancel apply */
+    uint8_t         cancel;   /* Set by other thread, atomic access only */
+    int             abort_err; /* Reason of host ABORT in progress, or 0  */
+
     uint8_t atr[32];    /* ISO7816 defines ATR with a maximum of 32 bytes */
     uint8_t atr_length; /* Never over 32                                  */
 
+    /* GP: Communication Interface Parameters, historical bytes go to ATR */
+    uint8_t cip[T1_CIP_MAX];
+    uint8_t cip_length;
+
     /* Emission window */
     struct t1_send {
         const uint8_t *start;
         const uint8_t *end;
         uint8_t        next; /* N(S) */
+        uint16_t       last; /* Size of last I-BLOCK sent */
     } send;
 
     /* Reception window */
@@ -79,26 +185,55 @@ struct t1_state {
     size_t recv_size; /* Received number of bytes so far */
 
     /* Max size is:
-     *  - 3 bytes header,
-     *  - 254 bytes data,
+     *  - 3 bytes header, 4 with GP,
+     *  - 254 bytes data, 4089 with GP,
      *  - 2 bytes CRC
      *
-     * Use 255 bytes data in case of invalid block length of 255.
+     * Invalid block lengths up to 0xFFFF are never read past buffer.
      */
-    uint8_t buf[3 + 255 + 2];
+    uint8_t buf[4 + T1_GP_MAX_IFS + 2];
 };
 
-enum { CHECKSUM_LRC, CHECKSUM_CRC };
+/* CHECKSUM_CRC16 is the ISO/IEC 13239 one of GP, sent low byte first */
+enum { CHECKSUM_LRC, CHECKSUM_CRC, CHECKSUM_CRC16 };
+
+/* Prologue is NAD, PCB and LEN, on 2 bytes with GP */
+static inline size_t
+t1_prologue_length(const struct t1_state *t1)
+{
+    return (t1->proto == T1_PROTO_GP) ? 4 : 3;
+}
+
+static inline size_t
+t1_block_length(const struct t1_state *t1, const uint8_t *buf)
+{
+    if (t1->proto == T1_PROTO_GP)
+        return (buf[2] << 8) | buf[3];
+    return buf[2];
+}
+
+static inline unsigned
+t1_max_ifs(const struct t1_state *t1)
+{
+    return (t1->proto == T1_PROTO_GP) ? T1_GP_MAX_IFS : T1_ISO_MAX_IFS;
+}
 
 void isot1_init(struct t1_state *t1);
 void isot1_release(struct t1_state *t1);
 void isot1_bind(struct t1_state *t1, int src, int dst);
+void isot1_set_protocol(struct t1_state *t1, int proto);
 int isot1_transceive(struct t1_state *t1, const void *snd_buf,
                      size_t snd_len, void *rcv_buf, size_t rcv_len);
 int isot1_negotiate_ifsd(struct t1_state *t1, int ifsd);
 int isot1_reset(struct t1_state *t1);
 int isot1_resync(struct t1_state *t1);
+int isot1_sleep(struct t1_state *t1);
 int isot1_get_atr(struct t1_state *t1, void *atr, size_t n);
+void isot1_set_deadline(struct t1_state *t1, const struct timespec *deadline);
+void isot1_clear_deadline(struct t1_state *t1);
+void isot1_cancel(struct t1_state *t1);
+int isot1_interrupted(struct t1_state *t1);
+int isot1_recovered(struct t1_state *t1);
 
 /* for check.c */
 typedef struct t1_state t1_state_t;
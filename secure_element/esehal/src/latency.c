@@ -0,0 +1,284 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Latency histograms of HAL operations.
+ *
+ * Averages hide the rare stalls that break a contactless transaction, so
+ * durations are kept as histograms with buckets growing as powers of 2,
+ * each split in 4: any value is known within 25%, from microseconds to
+ * tens of seconds, in 100 counters.
+ *
+ * Every operation goes into the histogram of its kind. APDUs sent with
+ * transmit also go into histograms per INS byte and per channel. Only the
+ * first 16 INS seen get their own histogram, later ones share the last.
+ *
+ * Histograms are shared by all contexts of the process: HAL frees its
+ * context when last channel is closed or a transmit fails, and those
+ * operations must still be counted.
+ *
+ * HAL threads record without locking: each thread is given one of a few
+ * shards, updated with atomic operations, and shards are summed when
+ * histograms are read.
+ *
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "libse-gto-private.h"
+#include "latency.h"
+
+static struct latency latency;
+static uint32_t       latency_next_shard;
+static __thread int   latency_shard_id = -1;
+
+static struct latency_shard *
+latency_shard(struct latency *l)
+{
+    if (latency_shard_id < 0)
+        latency_shard_id = __atomic_fetch_add(&latency_next_shard, 1,
+                                              __ATOMIC_RELAXED) % LATENCY_SHARDS;
+    return &l->shard[latency_shard_id];
+}
+
+static unsigned
+latency_bucket(uint64_t us)
+{
+    unsigned e;
+
+    if (us < (1 << LATENCY_SUB_BITS))
+        return (unsigned)us;
+
+    e = 63 - __builtin_clzll(us);
+    if (e > LATENCY_MAX_LOG2)
+        return LATENCY_BUCKETS - 1;
+
+    return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+           ((us >> (e - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+static void
+latency_add(struct latency_histo *h, unsigned b, uint64_t us)
+{
+    uint32_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    uint32_t v   = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+    __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    while ((v > max) &&
+           !__atomic_compare_exchange_n(&h->max_us, &max, v, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Slot of INS, claimed on first use */
+static int
+latency_ins_slot(struct latency *l, int ins, int claim)
+{
+    uint16_t key = 0x100 | (ins & 0xFF);
+    uint16_t cur;
+
+    for (int i = 0; i < LATENCY_INS_SLOTS; i++) {
+        cur = __atomic_load_n(&l->ins_key[i], __ATOMIC_RELAXED);
+        if (cur == key)
+            return i;
+        if (cur)
+            continue;
+        if (!claim)
+            return -1;
+        if (__atomic_compare_exchange_n(&l->ins_key[i], &cur, key, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+            (cur == key))
+            return i;
+    }
+    return LATENCY_INS_SLOTS;
+}
+
+SE_GTO_EXPORT uint64_t
+se_gto_latency_start(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+SE_GTO_EXPORT void
+se_gto_latency_end(struct se_gto_ctx *ctx, int op, int ins, int channel,
+                   uint64_t start)
+{
+    struct latency_shard *s;
+    uint64_t              us;
+    unsigned              b;
+
+    if ((op < 0) || (op >= SE_GTO_OP_COUNT))
+        return;
+
+    us = se_gto_latency_start() - start;
+    b  = latency_bucket(us);
+    s  = latency_shard(&latency);
+
+    latency_add(&s->op[op], b, us);
+    if (ins >= 0)
+        latency_add(&s->ins[latency_ins_slot(&latency, ins, 1)], b, us);
+    if ((channel >= 0) && (channel < SE_GTO_MAX_CHANNELS))
+        latency_add(&s->channel[channel], b, us);
+
+    /* Busy context publishes when done */
+    if (!ctx)
+        metrics_publish(NULL);
+    else if (ctx->metrics.map && (pthread_mutex_trylock(&ctx->lock) == 0)) {
+        metrics_publish(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+/* Histogram of every shard at index of one of the arrays of shard */
+static void
+latency_merge(struct latency *l, size_t offset, struct latency_histo *h)
+{
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < LATENCY_SHARDS; i++) {
+        const struct latency_histo *s =
+            (const void *)((const uint8_t *)&l->shard[i] + offset);
+        uint32_t max = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            h->bucket[b] += __atomic_load_n(&s->bucket[b], __ATOMIC_RELAXED);
+        h->sum_us += __atomic_load_n(&s->sum_us, __ATOMIC_RELAXED);
+        if (max > h->max_us)
+            h->max_us = max;
+    }
+}
+
+/* Value under which lie per10k / 10000 of samples */
+static uint32_t
+latency_percentile(const struct latency_histo *h, uint64_t count, unsigned per10k)
+{
+    uint64_t rank = (count * per10k + 9999) / 10000, seen = 0;
+    uint32_t v;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= rank) {
+            v = latency_bucket_max(b);
+            return v < h->max_us ? v : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void
+latency_read(struct latency *l, size_t offset, struct se_gto_latency *lat)
+{
+    struct latency_histo h;
+
+    latency_merge(l, offset, &h);
+
+    lat->count = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+        lat->count += h.bucket[b];
+    lat->sum_us  = h.sum_us;
+    lat->max_us  = h.max_us;
+    lat->p50_us  = latency_percentile(&h, lat->count, 5000);
+    lat->p90_us  = latency_percentile(&h, lat->count, 9000);
+    lat->p99_us  = latency_percentile(&h, lat->count, 9900);
+    lat->p999_us = latency_percentile(&h, lat->count, 9990);
+}
+
+/* Histogram of operation, shards summed */
+void
+latency_op_histo(int op, struct latency_histo *h)
+{
+    latency_merge(&latency,
+                  offsetof(struct latency_shard, op[0]) +
+                  op * sizeof(struct latency_histo), h);
+}
+
+/* INS of slot, LATENCY_INS_OTHER for the shared one, -1 if never used */
+int
+latency_ins_get(int slot, struct se_gto_latency *lat)
+{
+    uint16_t key = 0;
+
+    if (slot < LATENCY_INS_SLOTS) {
+        key = __atomic_load_n(&latency.ins_key[slot], __ATOMIC_RELAXED);
+        if (!key)
+            return -1;
+    }
+
+    latency_read(&latency,
+                 offsetof(struct latency_shard, ins[0]) +
+                 slot * sizeof(struct latency_histo), lat);
+    return key ? (key & 0xFF) : LATENCY_INS_OTHER;
+}
+
+SE_GTO_EXPORT int
+se_gto_get_latency(struct se_gto_ctx *ctx, int by, int key,
+                   struct se_gto_latency *lat)
+{
+    size_t offset;
+    int    slot;
+
+    if (!lat) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (by) {
+        case SE_GTO_LATENCY_BY_OP:
+            if ((key < 0) || (key >= SE_GTO_OP_COUNT))
+                goto einval;
+            offset = offsetof(struct latency_shard, op[0]) +
+                     key * sizeof(struct latency_histo);
+            break;
+
+        case SE_GTO_LATENCY_BY_INS:
+            if ((key < 0) || (key > 0xFF))
+                goto einval;
+            slot = latency_ins_slot(&latency, key, 0);
+            if (slot < 0) {
+                memset(lat, 0, sizeof(*lat));
+                return 0;
+            }
+            offset = offsetof(struct latency_shard, ins[0]) +
+                     slot * sizeof(struct latency_histo);
+            break;
+
+        case SE_GTO_LATENCY_BY_CHANNEL:
+            if ((key < 0) || (key >= SE_GTO_MAX_CHANNELS))
+                goto einval;
+            offset = offsetof(struct latency_shard, channel[0]) +
+                     key * sizeof(struct latency_histo);
+            break;
+
+        default:
+            goto einval;
+    }
+
+    latency_read(&latency, offset, lat);
+    return 0;
+
+einval:
+    errno = EINVAL;
+    return -1;
+}
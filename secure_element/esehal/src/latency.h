@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Latency histograms of HAL operations.
+ *
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#include <se-gto/libse-gto.h>
+
+/* Exact up to 4 us, then 4 buckets per power of 2 up to 2^25 us (33 s) */
+#define LATENCY_SUB_BITS 2
+#define LATENCY_MAX_LOG2 25
+#define LATENCY_BUCKETS  ((LATENCY_MAX_LOG2 - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+#define LATENCY_SHARDS    4  /* Threads spread over that many copies */
+#define LATENCY_INS_SLOTS 16 /* INS seen first, others share one more */
+#define LATENCY_INS_OTHER 0x100
+
+struct latency_histo {
+    uint32_t bucket[LATENCY_BUCKETS];
+    uint64_t sum_us;
+    uint32_t max_us;
+};
+
+struct latency {
+    /* Updated with atomic operations only, merged on read */
+    struct latency_shard {
+        struct latency_histo op[SE_GTO_OP_COUNT];
+        struct latency_histo ins[LATENCY_INS_SLOTS + 1];
+        struct latency_histo channel[SE_GTO_MAX_CHANNELS];
+    } shard[LATENCY_SHARDS];
+
+    uint16_t ins_key[LATENCY_INS_SLOTS]; /* 0x100 | INS, 0 if free */
+};
+
+/* Highest value that falls in bucket */
+static inline uint32_t
+latency_bucket_max(unsigned b)
+{
+    unsigned e, sub;
+
+    if (b < (1 << LATENCY_SUB_BITS))
+        return b;
+
+    e   = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    sub = b & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((((1u << LATENCY_SUB_BITS) | sub) + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_op_histo(int op, struct latency_histo *h);
+int latency_ins_get(int slot, struct se_gto_latency *lat);
+
+#endif /* LATENCY_H */
@@ -24,8 +24,21 @@
 #ifndef LIBSE_GTO_PRIVATE_H
 #define LIBSE_GTO_PRIVATE_H
 
+#include <pthread.h>
+
 #include <se-gto/libse-gto.h>
 #include "iso7816_t1.h"
+#include "clktune.h"
+#include "getdata.h"
+#include "ifs.h"
+#include "latency.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "pcap.h"
+#include "profile.h"
+#include "rt.h"
+#include "state.h"
+#include "trace.h"
 
 #define SE_GTO_EXPORT __attribute__((visibility("default")))
 
@@ -41,18 +54,55 @@ struct se_gto_ctx {
 
     int            log_level;
     se_gto_log_fn *log_fn;
-    char          *log_buf;
+    uint8_t        log_async; /* Format on log thread */
+    unsigned       log_rate;  /* Messages per second per format, 0 unlimited */
 
     const char *gtodev;
 
     void *spi_buffer;
     int   spi_nbuffer;
 
+    pthread_mutex_t lock; /* Serializes exchanges, recursive */
+
     struct t1_state t1;
 
+    struct se_gto_channel_info channels[SE_GTO_MAX_CHANNELS];
+
+    struct getdata_cache getdata;
+
+    char             *state_file;
+    struct gto_state *state;
+
+    struct monitor monitor;
+
+    uint8_t         profile_enabled;
+    struct profile *profile; /* In state file, or profile_mem */
+    struct profile  profile_mem;
+
+    struct rt_config rt;
+
+    struct clktune clktune;
+
+    struct ifs_manager ifs;
+
+    struct trace trace;
+
+    struct pcap_writer pcap;
+
+    struct metrics metrics;
+
+    unsigned apdu_timeout_ms; /* Default APDU deadline, 0 if none */
+
+    int     apdu_queue;  /* Exchanges asked and not done, atomic access */
+    int32_t apdu_cookie; /* Asynchronous trace slice of last exchange   */
+
+    uint8_t nad; /* Endpoint addressed on device, 0 for protocol default */
+
     uint8_t check_alive;
 };
 
 #include "log.h"
 
+int reset_after_failure(struct se_gto_ctx *ctx, void *atr, size_t r);
+
 #endif /* ifndef LIBSE_GTO_PRIVATE_H */
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <log/log.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -33,11 +34,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libse-gto-private.h"
 #include "se-gto/libse-gto.h"
-#include "spi.h"
+#include "bus.h"
+#include "channel.h"
+#include "clktune.h"
+#include "getdata.h"
+#include "ifs.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "pcap.h"
+#include "profile.h"
+#include "rt.h"
+#include "selcache.h"
+#include "state.h"
+#include "systrace.h"
+#include "trace.h"
 
 #define SE_GTO_GTODEV "/dev/gto"
 
@@ -91,8 +106,9 @@ log_stderr(struct se_gto_ctx *ctx, const char *s)
 SE_GTO_EXPORT int
 se_gto_new(struct se_gto_ctx **c)
 {
-    const char        *env;
-    struct se_gto_ctx *ctx;
+    const char         *env;
+    struct se_gto_ctx  *ctx;
+    pthread_mutexattr_t attr;
 
     ctx = calloc(1, sizeof(struct se_gto_ctx));
     if (!ctx) {
@@ -100,9 +116,25 @@ se_gto_new(struct se_gto_ctx **c)
         return -1;
     }
 
+    /* Recursive: channel resume runs a reset */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ctx->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     isot1_init(&ctx->t1);
 
-    ctx->log_fn = log_stderr;
+    ctx->log_fn    = log_stderr;
+    ctx->log_async = 1;
+    ctx->log_rate  = 20;
+
+    ctx->clktune.error_limit = 2;
+
+    ctx->trace.records = 4096;
+    ctx->trace.sample  = 1;
+    ctx->trace.payload = TRACE_PAYLOAD_REDACT;
+
+    ctx->pcap.fd = -1;
 
     ctx->gtodev = SE_GTO_GTODEV;
 
@@ -146,6 +178,13 @@ se_gto_set_log_fn(struct se_gto_ctx *ctx, se_gto_log_fn *fn)
     ctx->log_fn = fn;
 }
 
+SE_GTO_EXPORT void
+se_gto_log_hex(struct se_gto_ctx *ctx, const char *what, const void *p, size_t n)
+{
+    if (ctx)
+        dbg_hex(what, p, n);
+}
+
 SE_GTO_EXPORT const char *
 se_gto_get_gtodev(struct se_gto_ctx *ctx)
 {
@@ -158,12 +197,163 @@ se_gto_set_gtodev(struct se_gto_ctx *ctx, const char *gtodev)
     ctx->gtodev = strdup(gtodev);
 }
 
+/* Decimal option value, at most max */
+static int
+config_uint(const char *value, unsigned max, unsigned *out)
+{
+    char         *end;
+    unsigned long v;
+
+    v = strtoul(value, &end, 10);
+    if ((end == value) || (v > max))
+        return -EINVAL;
+    *out = (unsigned)v;
+    return 0;
+}
+
+/* "enable" or "disable" option value */
+static int
+config_bool(const char *value, uint8_t *out)
+{
+    if (strncmp(value, "enable", 6) == 0)
+        *out = 1;
+    else if (strncmp(value, "disable", 7) == 0)
+        *out = 0;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+static int
+set_wait_strategy(struct se_gto_ctx *ctx, const char *value)
+{
+    if (strncmp(value, "fixed", 5) == 0)
+        ctx->t1.wait.strategy = T1_WAIT_FIXED;
+    else if (strncmp(value, "hybrid", 6) == 0)
+        ctx->t1.wait.strategy = T1_WAIT_HYBRID;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+static int
+set_t1_protocol(struct se_gto_ctx *ctx, const char *value)
+{
+    if (strncmp(value, "iso", 3) == 0)
+        isot1_set_protocol(&ctx->t1, T1_PROTO_ISO);
+    else if (strncmp(value, "gp", 2) == 0)
+        isot1_set_protocol(&ctx->t1, T1_PROTO_GP);
+    else
+        return -EINVAL;
+    return 0;
+}
+
+/* NAD sent by host, 2 hex digits: destination, then source address */
+static int
+set_nad(struct se_gto_ctx *ctx, const char *value)
+{
+    char         *end;
+    unsigned long nad;
+
+    nad = strtoul(value, &end, 16);
+    if ((end == value) || (nad & ~0x77UL) || ((nad >> 4) == (nad & 7)))
+        return -EINVAL;
+    ctx->nad = (uint8_t)nad;
+    return 0;
+}
+
 SE_GTO_EXPORT int
-se_gto_reset(struct se_gto_ctx *ctx, void *atr, size_t r)
+se_gto_set_config(struct se_gto_ctx *ctx, const char *key, const char *value)
 {
-    int err;
+    int err = -ENOENT;
 
-    err = isot1_reset(&ctx->t1);
+    if (!key || !value) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (strcmp(key, "GTO_GETDATA_CACHE") == 0)
+        err = getdata_cache_set_tags(ctx, value);
+    else if (strcmp(key, "GTO_STATE_FILE") == 0)
+        err = state_set_file(ctx, value);
+    else if (strcmp(key, "GTO_HEALTH_MONITOR") == 0)
+        err = monitor_set_period(ctx, value);
+    else if (strcmp(key, "GTO_APDU_DEADLINE") == 0)
+        err = config_uint(value, 3600 * 1000, &ctx->apdu_timeout_ms);
+    else if (strcmp(key, "GTO_WAIT_PROFILE") == 0)
+        err = config_bool(value, &ctx->profile_enabled);
+    else if (strcmp(key, "GTO_WAIT_STRATEGY") == 0)
+        err = set_wait_strategy(ctx, value);
+    else if (strcmp(key, "GTO_WAIT_POLL_US") == 0)
+        err = config_uint(value, 1000000, &ctx->t1.wait.poll_us);
+    else if (strcmp(key, "GTO_WAIT_SPIN_US") == 0)
+        err = config_uint(value, 1000000, &ctx->t1.wait.spin_us);
+    else if (strcmp(key, "GTO_WAIT_BACKOFF_MAX_US") == 0)
+        err = config_uint(value, 1000000, &ctx->t1.wait.backoff_max_us);
+    else if (strcmp(key, "GTO_WAIT_SLEEP_US") == 0)
+        err = config_uint(value, 1000000, &ctx->t1.wait.sleep_us);
+    else if (strcmp(key, "GTO_RT_POLICY") == 0)
+        err = rt_set_policy(ctx, value);
+    else if (strcmp(key, "GTO_RT_PRIORITY") == 0)
+        err = config_uint(value, 99, &ctx->rt.priority);
+    else if (strcmp(key, "GTO_RT_CPUS") == 0)
+        err = rt_set_cpus(ctx, value);
+    else if (strcmp(key, "GTO_RT_TIMER_SLACK_NS") == 0)
+        err = rt_set_timer_slack(ctx, value);
+    else if (strcmp(key, "GTO_CLK_TUNE") == 0)
+        err = config_bool(value, &ctx->clktune.enabled);
+    else if (strcmp(key, "GTO_CLK_MAX_HZ") == 0)
+        err = config_uint(value, 100000000, &ctx->clktune.max_hz);
+    else if (strcmp(key, "GTO_CLK_STEP_HZ") == 0)
+        err = config_uint(value, 100000000, &ctx->clktune.step_hz);
+    else if (strcmp(key, "GTO_CLK_ERROR_LIMIT") == 0)
+        err = config_uint(value, 1000, &ctx->clktune.error_limit);
+    else if (strcmp(key, "GTO_IFS_TUNE") == 0)
+        err = config_bool(value, &ctx->ifs.enabled);
+    else if (strcmp(key, "GTO_T1_PROTOCOL") == 0)
+        err = set_t1_protocol(ctx, value);
+    else if (strcmp(key, "GTO_NAD") == 0)
+        err = set_nad(ctx, value);
+    else if (strcmp(key, "GTO_TRACE_FILE") == 0)
+        err = trace_set_file(ctx, value);
+    else if (strcmp(key, "GTO_TRACE_RECORDS") == 0)
+        err = config_uint(value, 1 << 20, &ctx->trace.records);
+    else if (strcmp(key, "GTO_TRACE_SAMPLE") == 0)
+        err = config_uint(value, 1000000, &ctx->trace.sample);
+    else if (strcmp(key, "GTO_TRACE_PAYLOAD") == 0)
+        err = trace_set_payload(ctx, value);
+    else if (strcmp(key, "GTO_PCAP_FILE") == 0)
+        err = pcap_set_file(ctx, value);
+    else if (strcmp(key, "GTO_METRICS_FILE") == 0)
+        err = metrics_set_file(ctx, value);
+    else if (strcmp(key, "GTO_LOG_ASYNC") == 0)
+        err = config_bool(value, &ctx->log_async);
+    else if (strcmp(key, "GTO_LOG_RATE") == 0)
+        err = config_uint(value, 1000000, &ctx->log_rate);
+
+    if (err < 0) {
+        errno = -err;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+link_reset(struct se_gto_ctx *ctx, void *atr, size_t r, int again)
+{
+    struct rt_saved saved;
+    int             err = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    channel_clear_all(ctx);
+    getdata_cache_clear(ctx);
+    state_reset_begin(ctx);
+    if (again) {
+        rt_enter(ctx, &saved);
+        err = isot1_reset(&ctx->t1);
+        rt_leave(ctx, &saved);
+        monitor_activity(ctx);
+    }
     if (err < 0) {
         errno = -err;
         ctx->check_alive = 1;
@@ -172,23 +362,110 @@ se_gto_reset(struct se_gto_ctx *ctx, void *atr, size_t r)
         err = isot1_get_atr(&ctx->t1, atr, r);
         if (err < 0)
             errno = -err;
+        else {
+            dbg_hex("ATR", atr, err);
+            select_cache_reset(ctx, atr, err);
+            state_reset_done(ctx);
+        }
     }
+    pthread_mutex_unlock(&ctx->lock);
     return err;
 }
 
 SE_GTO_EXPORT int
-se_gto_apdu_transmit(struct se_gto_ctx *ctx, const void *apdu, int n, void *resp, int r)
+se_gto_reset(struct se_gto_ctx *ctx, void *atr, size_t r)
 {
-    if (!apdu || (n < 4) || !resp || (r < 2)) {
-        errno = EINVAL;
-        return -1;
+    return link_reset(ctx, atr, r, 1);
+}
+
+/* Card is not reset twice when T=1 layer has just reset it after a failed
+ * exchange, only bookkeeping of reset is done.
+ */
+int
+reset_after_failure(struct se_gto_ctx *ctx, void *atr, size_t r)
+{
+    int again, n;
+
+    pthread_mutex_lock(&ctx->lock);
+    again = !isot1_recovered(&ctx->t1);
+    if (!again)
+        dbg("card already reset after failure\n");
+    n = link_reset(ctx, atr, r, again);
+    pthread_mutex_unlock(&ctx->lock);
+    return n;
+}
+
+SE_GTO_EXPORT int
+se_gto_resume(struct se_gto_ctx *ctx, void *atr, size_t r)
+{
+    struct rt_saved saved;
+    int             err;
+
+    pthread_mutex_lock(&ctx->lock);
+    channel_clear_all(ctx);
+    getdata_cache_clear(ctx);
+    rt_enter(ctx, &saved);
+    err = state_resume(ctx);
+    rt_leave(ctx, &saved);
+    monitor_activity(ctx);
+    if (err < 0)
+        dbg("no resume from state file, %s\n", strerror(-err));
+    else
+        err = isot1_get_atr(&ctx->t1, atr, r);
+
+    if (err < 0) {
+        errno = -err;
+        err   = -1;
+    } else {
+        info("link resumed with RESYNCH\n");
+        select_cache_atr(ctx, atr, err);
     }
+    pthread_mutex_unlock(&ctx->lock);
+    return err;
+}
+
+/* Host ABORT after cancel or deadline */
+#define ABORTED(r) (((r) == -ECANCELED) || ((r) == -ETIME))
+
+static int
+apdu_transmit(struct se_gto_ctx *ctx, const void *apdu, int n, void *resp, int r)
+{
+    struct rt_saved saved;
+
+    /* Header only, data may be sensitive */
+    dbg_hex("C-APDU header", apdu, 4);
+    rt_enter(ctx, &saved);
+    trace_apdu_begin(ctx, apdu, n);
+    pcap_apdu(ctx, GTO_PCAP_APDU_CMD, apdu, n);
+    profile_before(ctx, apdu, n);
     r = isot1_transceive(&ctx->t1, apdu, n, resp, r);
+    profile_after(ctx, apdu, n, r);
+    trace_apdu_end(ctx, resp, r);
+    pcap_apdu(ctx, GTO_PCAP_APDU_RESP, resp, r);
+    rt_leave(ctx, &saved);
+    clktune_after(ctx, r);
+    ifs_after(ctx, r);
+    monitor_activity(ctx);
+    channel_apdu_done(ctx, apdu, n, resp, r);
+    select_cache_apdu_done(ctx, apdu, n, resp, r);
+    if ((r < 0) && !ABORTED(r))
+        /* Secure Element may have been reset on error */
+        getdata_cache_clear(ctx);
+    else
+        getdata_cache_store(ctx, apdu, n, resp, r);
     dbg("isot1_transceive: r=%d\n", r);
     dbg("isot1_transceive: ctx->t1.recv.end - ctx->t1.recv.start = %ld\n", ctx->t1.recv.end - ctx->t1.recv.start);
     dbg("isot1_transceive: ctx->t1.recv.size = %zu\n", ctx->t1.recv.size);
-    dbg("isot1_transceive: ctx->t1.buf[2] = %02X\n", ctx->t1.buf[2]);
-    if (r < 0) {
+    dbg("isot1_transceive: last block length = %02zX\n",
+        t1_block_length(&ctx->t1, ctx->t1.buf));
+    if (r >= 2)
+        dbg_hex("SW", (uint8_t *)resp + r - 2, 2);
+    if (ABORTED(r)) {
+        /* Link is fine, command was aborted on time */
+        info("APDU aborted, %s\n", strerror(-r));
+        errno = -r;
+        return -1;
+    } else if (r < 0) {
         errno = -r;
         err("failed to read APDU response, %s\n", strerror(-r));
     } else if (r < 2) {
@@ -201,19 +478,114 @@ se_gto_apdu_transmit(struct se_gto_ctx *ctx, const void *apdu, int n, void *resp
         return r;
 }
 
+SE_GTO_EXPORT int
+se_gto_apdu_transmit_deadline(struct se_gto_ctx *ctx, const void *apdu, int n,
+                              void *resp, int r, const struct timespec *deadline)
+{
+    const uint8_t *hdr = apdu;
+    char           name[16];
+    int32_t        cookie = 0;
+    int            len, queue, traced;
+
+    if (!apdu || (n < 4) || !resp || (r < 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Slice covers wait for exchanges of other threads */
+    queue  = __atomic_add_fetch(&ctx->apdu_queue, 1, __ATOMIC_RELAXED);
+    traced = systrace_enabled();
+    if (traced) {
+        snprintf(name, sizeof(name), "APDU %02X%02X", hdr[0], hdr[1]);
+        cookie = __atomic_add_fetch(&ctx->apdu_cookie, 1, __ATOMIC_RELAXED);
+        systrace_async_begin(name, cookie);
+        systrace_counter("se-gto APDU queue", queue);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    len = monitor_check(ctx);
+    if (len < 0) {
+        err("link lost since last APDU, channels to be opened again, %s\n", strerror(-len));
+        errno = -len;
+        len   = -1;
+    } else if ((len = getdata_cache_lookup(ctx, apdu, n, resp, r)) > 0)
+        dbg("GET DATA %02X%02X served from cache\n", ((uint8_t *)apdu)[2], ((uint8_t *)apdu)[3]);
+    else {
+        isot1_set_deadline(&ctx->t1, deadline);
+        len = apdu_transmit(ctx, apdu, n, resp, r);
+        isot1_clear_deadline(&ctx->t1);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    queue = __atomic_sub_fetch(&ctx->apdu_queue, 1, __ATOMIC_RELAXED);
+    if (traced) {
+        systrace_counter("se-gto APDU queue", queue);
+        systrace_async_end(name, cookie);
+    }
+    return len;
+}
+
+SE_GTO_EXPORT int
+se_gto_apdu_transmit(struct se_gto_ctx *ctx, const void *apdu, int n, void *resp, int r)
+{
+    struct timespec deadline;
+
+    if (!ctx->apdu_timeout_ms)
+        return se_gto_apdu_transmit_deadline(ctx, apdu, n, resp, r, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += ctx->apdu_timeout_ms / 1000;
+    deadline.tv_nsec += (ctx->apdu_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return se_gto_apdu_transmit_deadline(ctx, apdu, n, resp, r, &deadline);
+}
+
+SE_GTO_EXPORT int
+se_gto_apdu_cancel(struct se_gto_ctx *ctx)
+{
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* No lock, exchange to cancel holds it */
+    isot1_cancel(&ctx->t1);
+    return 0;
+}
+
 SE_GTO_EXPORT int
 se_gto_open(struct se_gto_ctx *ctx)
 {
     info("eSE GTO: using %s\n", ctx->gtodev);
 
-    if (spi_setup(ctx) < 0) {
+    if (bus_attach(ctx) < 0) {
         err("failed to set up se-gto.\n");
         return -1;
     }
 
     ctx->check_alive = 0;
 
-    isot1_bind(&ctx->t1, 0x2, 0x1);
+    /* GP swaps addresses: 0x21 from host, 0x12 from Secure Element */
+    if (ctx->nad)
+        isot1_bind(&ctx->t1, ctx->nad & 7, ctx->nad >> 4);
+    else if (ctx->t1.proto == T1_PROTO_GP)
+        isot1_bind(&ctx->t1, 0x1, 0x2);
+    else
+        isot1_bind(&ctx->t1, 0x2, 0x1);
+    ifs_init(ctx);
+
+    /* Not fatal, HAL will just always reset */
+    (void)state_open(ctx);
+    profile_attach(ctx);
+    (void)trace_open(ctx);
+    (void)pcap_open(ctx);
+    (void)metrics_open(ctx);
+    clktune_open(ctx);
+
+    /* Not fatal either, close will check link instead */
+    (void)monitor_start(ctx);
 
     dbg("fd: spi=%d\n", ctx->t1.spi_fd);
     return 0;
@@ -234,9 +606,9 @@ int gtoSPI_checkAlive(struct se_gto_ctx *ctx)
   unsigned char apdu[5]= {0x80,0xCA,0x9F,0x7F,0x2D};
   unsigned char resp[258] = {0,};
 
-  /*Check Alive implem*/
+  /*Check Alive implem, never answered from cache*/
   for(int count = 0; count < 3; count++) {
-      ret = se_gto_apdu_transmit(ctx, apdu, 5, resp, sizeof(resp));
+      ret = apdu_transmit(ctx, apdu, 5, resp, sizeof(resp));
       if(ret < 0){
         if (count == 2) return -1;
         /*Run SPI reset*/
@@ -253,12 +625,98 @@ se_gto_close(struct se_gto_ctx *ctx)
     int status = 0;
 
     if(ctx) dbg("se_gto_close check_alive = %d\n", ctx->check_alive);
-    if (ctx->check_alive == 1)
+    /* Health monitor already probed and recovered link while idle */
+    if (monitor_stop(ctx))
+        dbg("se_gto_close link health monitored, no check alive\n");
+    else if (ctx->check_alive == 1)
         if (gtoSPI_checkAlive(ctx) != 0) status = 0xDEAD;
 
+    /* Let card save power, only GP has a request for it */
+    (void)isot1_sleep(&ctx->t1);
+    clktune_close(ctx);
     (void)isot1_release(&ctx->t1);
-    (void)spi_teardown(ctx);
+    bus_detach(ctx);
+    state_close(ctx);
+    trace_close(ctx);
+    pcap_close(ctx);
+    metrics_close(ctx);
     log_teardown(ctx);
+    pthread_mutex_destroy(&ctx->lock);
     if(ctx) free(ctx);
     return status;
 }
+
+static void
+phase_copy(struct se_gto_phase *dst, const struct t1_phase *src)
+{
+    dst->send_us     = src->send_ns / 1000;
+    dst->wait_us     = src->wait_ns / 1000;
+    dst->read_us     = src->read_ns / 1000;
+    dst->polls       = src->polls;
+    dst->wtx         = src->wtx;
+    dst->retransmits = src->retransmits;
+    dst->chk_errors  = src->chk_errors;
+    dst->resyncs     = src->resyncs;
+    dst->resets      = src->resets;
+    dst->blocks_tx   = src->blocks_tx;
+    dst->blocks_rx   = src->blocks_rx;
+    dst->bytes_tx    = src->bytes_tx;
+    dst->bytes_rx    = src->bytes_rx;
+}
+
+SE_GTO_EXPORT int
+se_gto_get_stats(struct se_gto_ctx *ctx, struct se_gto_stats *stats)
+{
+    if (!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    stats->transceives = ctx->t1.stats.transceives;
+    phase_copy(&stats->last, &ctx->t1.stats.last);
+    phase_copy(&stats->total, &ctx->t1.stats.total);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+SE_GTO_EXPORT int
+se_gto_get_health(struct se_gto_ctx *ctx, struct se_gto_health *health)
+{
+    if (!ctx || !health) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    *health = ctx->monitor.health;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+SE_GTO_EXPORT int
+se_gto_get_wait_stats(struct se_gto_ctx *ctx, struct se_gto_wait_stats *stats)
+{
+    struct t1_wait *w;
+
+    if (!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    w = &ctx->t1.wait;
+    stats->blocks         = w->blocks;
+    stats->polls          = w->polls;
+    stats->wait_us        = w->wait_us;
+    stats->wasted_us      = w->wasted_us;
+    stats->last_polls     = w->last_polls;
+    stats->last_wait_us   = w->last_wait_us;
+    stats->last_wasted_us = w->last_wasted_us;
+    stats->wakes          = w->wakes;
+    stats->late_us        = w->late_us;
+    stats->late_max_us    = w->late_max_us;
+    stats->last_late_us   = w->last_late_us;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
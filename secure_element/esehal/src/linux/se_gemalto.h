@@ -30,7 +30,10 @@
 #define GTO_IOC_WR_POWER        _IOW(GTO_IOC_MAGIC, 1, __s32)
 #define GTO_IOC_WR_RESET        _IOW(GTO_IOC_MAGIC, 2, __s32)
 
-/* Read / Write of clock speed configuration */
+/* Read / Write of clock speed configuration
+ * Write shares its number with GTO_IOC_WR_RESET: only issue it when driver
+ * answers GTO_IOC_RD_CLK_SPEED.
+ */
 #define GTO_IOC_RD_CLK_SPEED    _IOR(GTO_IOC_MAGIC, 2, __s32)
 #define GTO_IOC_WR_CLK_SPEED    _IOW(GTO_IOC_MAGIC, 2, __s32)
 
@@ -19,69 +19,804 @@
  *
  * Logging facilities.
  *
+ * Calling thread does not format messages. It copies level, format
+ * pointer and arguments in a binary record, walking the format to know
+ * argument types, and appends record to a ring of its own. A log thread
+ * merges rings in order of a global sequence number, formats records and
+ * passes lines to log function of context. Ring has a single writer and a
+ * single reader, so no lock is taken to log, and log function runs off
+ * exchange path. Log thread is only woken up when it was idle.
+ *
+ * Format strings must outlive the record, as string literals do. String
+ * arguments are copied. When ring is full, calling thread drains rings
+ * itself, unless log thread is doing it. When GTO_LOG_ASYNC is disabled,
+ * record is formatted by calling thread.
+ *
+ * A message repeated more than GTO_LOG_RATE times in a second is dropped
+ * for the rest of the second, and number of dropped messages is logged
+ * with next one from same format. Each format has its own counter, errors
+ * and warnings are never dropped.
+ *
+ * Hex dumps are recorded as raw bytes, and encoded with a table of digit
+ * pairs when formatted.
+ *
  */
 
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <sys/types.h>
 
 #include "libse-gto-private.h"
 
+/* Two digits for each byte value */
+static const char hex_pairs[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+char *
+log_hex(char *dst, const uint8_t *p, size_t n)
+{
+    while (n--) {
+        memcpy(dst, &hex_pairs[2 * *p++], 2);
+        dst += 2;
+    }
+    *dst = 0;
+    return dst;
+}
+
 #ifdef ENABLE_LOGGING
 
-# define BUFSIZE 1024
+# define LOG_LINE_MAX   1024
+# define LOG_RECORD_MAX 512   /* Arguments beyond are dropped */
+# define LOG_RING_SIZE  16384 /* Per thread, power of 2 */
+# define LOG_RATE_SLOTS 64
+# define LOG_FULL_TRIES 100
+
+enum {
+    LOG_RECORD_FORMAT,
+    LOG_RECORD_HEX,
+    LOG_RECORD_PAD /* Skips end of ring */
+};
+
+/* Length modifiers */
+enum {
+    LOG_LEN_HH = -2,
+    LOG_LEN_H,
+    LOG_LEN_NONE,
+    LOG_LEN_L,
+    LOG_LEN_LL,
+    LOG_LEN_Z,
+    LOG_LEN_J,
+    LOG_LEN_T,
+    LOG_LEN_LD
+};
+
+struct log_record {
+    uint16_t           size;  /* Multiple of 8, header included */
+    uint8_t            kind;
+    uint8_t            level;
+    uint16_t           count; /* Arguments or bytes recorded */
+    uint32_t           length; /* Bytes to dump */
+    uint64_t           seq;
+    struct se_gto_ctx *ctx;
+    const char        *fmt;   /* Or what is dumped */
+    /* Arguments, 8 bytes each, strings null terminated */
+};
+
+struct log_ring {
+    struct log_ring *next;
+    int              dead; /* Thread has exited */
+    uint32_t         head __attribute__((aligned(64))); /* Written by thread */
+    uint32_t         tail __attribute__((aligned(64))); /* Written by log thread */
+    uint8_t          data[LOG_RING_SIZE] __attribute__((aligned(8)));
+};
+
+/* Conversion specification of a format */
+struct log_conv {
+    const char *flags;
+    int         nflags;
+    const char *width;
+    int         nwidth; /* -1 for '*' */
+    const char *prec;
+    int         nprec;  /* -1 for '*', 0 without precision */
+    int         length; /* LOG_LEN_* */
+    char        conv;
+    const char *end;
+};
+
+static struct {
+    struct log_ring *rings; /* Pushed by threads, unlinked by log thread */
+    uint64_t         seq;
+    pthread_once_t   once;
+    pthread_key_t    key;
+    int              failed;
+    pthread_mutex_t  drain; /* Single reader of rings */
+    pthread_mutex_t  lock;
+    pthread_cond_t   wake;
+    int              sleeping;
+
+    struct log_rate {
+        const char *fmt;
+        uint32_t    second;
+        uint32_t    count;
+        uint32_t    dropped;
+    } rate[LOG_RATE_SLOTS];
+} logger = {
+    .once  = PTHREAD_ONCE_INIT,
+    .drain = PTHREAD_MUTEX_INITIALIZER,
+    .lock  = PTHREAD_MUTEX_INITIALIZER,
+    .wake  = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct log_ring *log_ring;
 
 static const char *levels[] = {
-    "ERROR:", "WARNING:", "NOTICE:", "INFO:", "DEBUG:", "????:"
+    "ERROR:", "WARNING:", "NOTICE:", "INFO:", "DEBUG:"
 };
 
-void
-vsay(struct se_gto_ctx *ctx, const char *fmt, va_list args)
+static const char *
+parse_conv(const char *s, struct log_conv *c)
 {
-    static int k = 0;
-    char      *buf;
+    c->flags  = ++s;
+    c->nflags = strspn(s, "-+ #0");
+    s        += c->nflags;
 
-    if (!ctx->log_fn)
-        return;
+    c->width = s;
+    if (*s == '*') {
+        c->nwidth = -1;
+        s++;
+    } else {
+        c->nwidth = strspn(s, "0123456789");
+        s        += c->nwidth;
+    }
+
+    c->nprec = 0;
+    if (*s == '.') {
+        c->prec = ++s;
+        if (*s == '*') {
+            c->nprec = -1;
+            s++;
+        } else {
+            c->nprec = 1 + strspn(s, "0123456789");
+            s       += c->nprec - 1;
+        }
+    }
+
+    c->length = LOG_LEN_NONE;
+    for (; *s; s++) {
+        if (*s == 'l')
+            c->length++;
+        else if (*s == 'h')
+            c->length--;
+        else if (*s == 'z')
+            c->length = LOG_LEN_Z;
+        else if (*s == 'j')
+            c->length = LOG_LEN_J;
+        else if (*s == 't')
+            c->length = LOG_LEN_T;
+        else if (*s == 'L')
+            c->length = LOG_LEN_LD;
+        else
+            break;
+    }
+    c->conv = *s;
+    c->end  = *s ? s + 1 : s;
+    return c->end;
+}
+
+static int
+put_slot(uint8_t **p, const uint8_t *end, const void *v)
+{
+    if (end - *p < 8)
+        return 0;
+    memcpy(*p, v, 8);
+    *p += 8;
+    return 1;
+}
+
+static int64_t
+signed_arg(int length, va_list *args)
+{
+    switch (length) {
+    case LOG_LEN_HH:
+        return (signed char)va_arg(*args, int);
+    case LOG_LEN_H:
+        return (short)va_arg(*args, int);
+    case LOG_LEN_L:
+        return va_arg(*args, long);
+    case LOG_LEN_LL:
+        return va_arg(*args, long long);
+    case LOG_LEN_Z:
+        return (ssize_t)va_arg(*args, size_t);
+    case LOG_LEN_J:
+        return va_arg(*args, intmax_t);
+    case LOG_LEN_T:
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, int);
+    }
+}
+
+static uint64_t
+unsigned_arg(int length, va_list *args)
+{
+    switch (length) {
+    case LOG_LEN_HH:
+        return (unsigned char)va_arg(*args, unsigned);
+    case LOG_LEN_H:
+        return (unsigned short)va_arg(*args, unsigned);
+    case LOG_LEN_L:
+        return va_arg(*args, unsigned long);
+    case LOG_LEN_LL:
+        return va_arg(*args, unsigned long long);
+    case LOG_LEN_Z:
+        return va_arg(*args, size_t);
+    case LOG_LEN_J:
+        return va_arg(*args, uintmax_t);
+    case LOG_LEN_T:
+        return (size_t)va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, unsigned);
+    }
+}
+
+/* Copies arguments after record header, returns record size */
+static size_t
+encode_args(struct log_record *rec, const char *fmt, va_list *args)
+{
+    uint8_t        *p   = (uint8_t *)(rec + 1);
+    const uint8_t  *end = (uint8_t *)rec + LOG_RECORD_MAX;
+    const char     *s   = fmt;
+    struct log_conv c;
+    int64_t         i;
+    uint64_t        u;
+    double          d;
+
+    rec->count = 0;
+    while ((s = strchr(s, '%')) != NULL) {
+        s = parse_conv(s, &c);
+        if (c.conv == '%')
+            continue;
+        if (!c.conv)
+            break;
 
-    if (!ctx->log_buf) {
-        ctx->log_buf = malloc(BUFSIZE);
-        if (!ctx->log_buf)
+        if (c.nwidth < 0) {
+            i = va_arg(*args, int);
+            if (!put_slot(&p, end, &i))
+                break;
+        }
+        if (c.nprec < 0) {
+            i = va_arg(*args, int);
+            if (!put_slot(&p, end, &i))
+                break;
+        }
+
+        if (strchr("di", c.conv)) {
+            i = signed_arg(c.length, args);
+            if (!put_slot(&p, end, &i))
+                break;
+        } else if (strchr("ouxXc", c.conv)) {
+            u = unsigned_arg((c.conv == 'c') ? LOG_LEN_NONE : c.length, args);
+            if (!put_slot(&p, end, &u))
+                break;
+        } else if (c.conv == 'p') {
+            u = (uintptr_t)va_arg(*args, void *);
+            if (!put_slot(&p, end, &u))
+                break;
+        } else if (strchr("eEfFgGaA", c.conv)) {
+            d = (c.length == LOG_LEN_LD) ? (double)va_arg(*args, long double)
+                                : va_arg(*args, double);
+            if (!put_slot(&p, end, &d))
+                break;
+        } else if (c.conv == 's') {
+            const char *str = va_arg(*args, const char *);
+            size_t      n;
+
+            if (!str)
+                str = "(null)";
+            n = strlen(str);
+            if (p == end)
+                break;
+            if (n > (size_t)(end - p) - 1)
+                n = end - p - 1;
+            memcpy(p, str, n);
+            p[n] = 0;
+            p   += n + 1;
+        } else
+            break;
+        rec->count++;
+    }
+    return (p - (uint8_t *)rec + 7) & ~7;
+}
+
+static void
+append(char *line, size_t *len, const char *s, size_t n)
+{
+    if (n > LOG_LINE_MAX - 1 - *len)
+        n = LOG_LINE_MAX - 1 - *len;
+    memcpy(line + *len, s, n);
+    *len      += n;
+    line[*len] = 0;
+}
+
+static int64_t
+get_slot(const uint8_t **p)
+{
+    int64_t v;
+
+    memcpy(&v, *p, 8);
+    *p += 8;
+    return v;
+}
+
+/* Builds conversion with arguments of width and precision substituted */
+static void
+conv_spec(char *spec, size_t size, const struct log_conv *c,
+          const uint8_t **p, const char *length)
+{
+    int n;
+
+    n = snprintf(spec, size, "%%%.*s", c->nflags, c->flags);
+    if (c->nwidth < 0)
+        n += snprintf(spec + n, size - n, "%d", (int)get_slot(p));
+    else
+        n += snprintf(spec + n, size - n, "%.*s", c->nwidth, c->width);
+    if (c->nprec < 0)
+        n += snprintf(spec + n, size - n, ".%d", (int)get_slot(p));
+    else if (c->nprec > 0)
+        n += snprintf(spec + n, size - n, ".%.*s", c->nprec - 1, c->prec);
+    snprintf(spec + n, size - n, "%s%c", length, c->conv);
+}
+
+static void
+format_args(const struct log_record *rec, char *line, size_t *len)
+{
+    const uint8_t  *p = (const uint8_t *)(rec + 1);
+    const char     *s = rec->fmt, *next;
+    struct log_conv c;
+    char            spec[32];
+    int             n, k = 0;
+
+    while ((next = strchr(s, '%')) != NULL) {
+        append(line, len, s, next - s);
+        s = parse_conv(next, &c);
+        if (c.conv == '%') {
+            append(line, len, "%", 1);
+            continue;
+        }
+        if (!c.conv || (k++ == rec->count)) {
+            append(line, len, "...\n", 4);
             return;
+        }
+
+        if (strchr("dioxXu", c.conv)) {
+            conv_spec(spec, sizeof(spec), &c, &p, "ll");
+            n = snprintf(line + *len, LOG_LINE_MAX - *len, spec,
+                         (long long)get_slot(&p));
+        } else if (c.conv == 'c') {
+            conv_spec(spec, sizeof(spec), &c, &p, "");
+            n = snprintf(line + *len, LOG_LINE_MAX - *len, spec,
+                         (int)get_slot(&p));
+        } else if (c.conv == 'p') {
+            conv_spec(spec, sizeof(spec), &c, &p, "");
+            n = snprintf(line + *len, LOG_LINE_MAX - *len, spec,
+                         (void *)(uintptr_t)get_slot(&p));
+        } else if (c.conv == 's') {
+            conv_spec(spec, sizeof(spec), &c, &p, "");
+            n  = snprintf(line + *len, LOG_LINE_MAX - *len, spec, (const char *)p);
+            p += strlen((const char *)p) + 1;
+        } else {
+            double d;
+
+            conv_spec(spec, sizeof(spec), &c, &p, "");
+            memcpy(&d, p, 8);
+            p += 8;
+            n  = snprintf(line + *len, LOG_LINE_MAX - *len, spec, d);
+        }
+        if (n > 0)
+            *len += n;
+        if (*len > LOG_LINE_MAX - 1)
+            *len = LOG_LINE_MAX - 1;
+    }
+    append(line, len, s, strlen(s));
+}
+
+static void
+format_hex(const struct log_record *rec, char *line, size_t *len)
+{
+    size_t n = rec->count;
+
+    append(line, len, rec->fmt, strlen(rec->fmt));
+    append(line, len, ": ", 2);
+    if (n > (LOG_LINE_MAX - *len - 5) / 2)
+        n = (LOG_LINE_MAX - *len - 5) / 2;
+    *len = log_hex(line + *len, (const uint8_t *)(rec + 1), n) - line;
+    if (n < rec->length)
+        append(line, len, "...", 3);
+    append(line, len, "\n", 1);
+}
+
+static void
+format_record(const struct log_record *rec, char *line)
+{
+    size_t len = 0;
+
+    line[0] = 0;
+    append(line, &len, levels[rec->level], strlen(levels[rec->level]));
+    if (rec->kind == LOG_RECORD_HEX)
+        format_hex(rec, line, &len);
+    else
+        format_args(rec, line, &len);
+    if (rec->ctx->log_fn)
+        rec->ctx->log_fn(rec->ctx, line);
+}
+
+static struct log_record *
+ring_peek(struct log_ring *r)
+{
+    struct log_record *rec;
+    uint32_t           head;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (r->tail != head) {
+        rec = (struct log_record *)&r->data[r->tail & (LOG_RING_SIZE - 1)];
+        if (rec->kind != LOG_RECORD_PAD)
+            return rec;
+        __atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
     }
+    return NULL;
+}
 
-    if (fmt[0] == 1) {
-        int n = fmt[1] - '0';
-        n = (n < 0 || n > 4) ? 5 : n;
-        if (n <= ctx->log_level) {
-            if (k == 0)
-                strcpy(ctx->log_buf, levels[n]);
-            k += strlen(ctx->log_buf + k);
-            k += vsnprintf(ctx->log_buf + k, BUFSIZE - k, fmt + 2, args);
+/* Formats records of all threads in sequence, until rings are empty */
+static void
+drain(char *line, int reap)
+{
+    struct log_ring   *r, *next, *prev, *min;
+    struct log_record *rec, *first;
+
+    for (;;) {
+        first = NULL;
+        min   = NULL;
+        for (r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+            rec = ring_peek(r);
+            if (rec && (!first || (rec->seq < first->seq))) {
+                first = rec;
+                min   = r;
+            }
         }
-    } else
-        k += vsnprintf(ctx->log_buf + k, 1024 - k, fmt, args);
-
-    if (k >= BUFSIZE)
-        k = BUFSIZE - 1;
-    buf    = ctx->log_buf;
-    if (k >= 0) {
-        buf[k] = '\000';
-        if ((k > 0 && (buf[k - 1] == '\n')) || (k == (BUFSIZE - 1))) {
-            k = 0;
-            ctx->log_fn(ctx, buf);
+        if (!first)
+            break;
+        format_record(first, line);
+        __atomic_store_n(&min->tail, min->tail + first->size, __ATOMIC_RELEASE);
+    }
+
+    if (!reap)
+        return;
+
+    /* Head of list is left, threads push concurrently */
+    prev = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE);
+    for (r = prev ? prev->next : NULL; r; r = next) {
+        next = r->next;
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+            (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))) {
+            prev->next = next;
+            free(r);
+        } else
+            prev = r;
+    }
+}
+
+static int
+pending(void)
+{
+    struct log_ring *r;
+
+    for (r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        if (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) !=
+            __atomic_load_n(&r->head, __ATOMIC_SEQ_CST))
+            return 1;
+    return 0;
+}
+
+static void *
+log_thread(void *arg)
+{
+    static char line[LOG_LINE_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&logger.drain);
+        drain(line, 1);
+        pthread_mutex_unlock(&logger.drain);
+
+        pthread_mutex_lock(&logger.lock);
+        __atomic_store_n(&logger.sleeping, 1, __ATOMIC_SEQ_CST);
+        while (!pending())
+            pthread_cond_wait(&logger.wake, &logger.lock);
+        __atomic_store_n(&logger.sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&logger.lock);
+    }
+    return NULL;
+}
+
+static void
+ring_release(void *arg)
+{
+    struct log_ring *r = arg;
+
+    log_ring = NULL;
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t      thread;
+
+    if (pthread_key_create(&logger.key, ring_release)) {
+        logger.failed = 1;
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, log_thread, NULL))
+        logger.failed = 1;
+    else
+        pthread_setname_np(thread, "se-gto-log");
+    pthread_attr_destroy(&attr);
+}
+
+static struct log_ring *
+ring_get(void)
+{
+    struct log_ring *r = log_ring;
+
+    if (r)
+        return r;
+
+    pthread_once(&logger.once, log_init);
+    if (logger.failed)
+        return NULL;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    pthread_setspecific(logger.key, r);
+
+    r->next = __atomic_load_n(&logger.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&logger.rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    log_ring = r;
+    return r;
+}
+
+/* Returns 0 when ring is full */
+static int
+ring_write(struct log_ring *r, const struct log_record *rec)
+{
+    struct log_record *pad;
+    uint32_t           head = r->head;
+    uint32_t           used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint32_t           off  = head & (LOG_RING_SIZE - 1);
+    uint32_t           skip = 0;
+
+    /* Records are contiguous */
+    if (off + rec->size > LOG_RING_SIZE)
+        skip = LOG_RING_SIZE - off;
+    if (used + skip + rec->size > LOG_RING_SIZE)
+        return 0;
+
+    if (skip) {
+        pad       = (struct log_record *)&r->data[off];
+        pad->size = skip;
+        pad->kind = LOG_RECORD_PAD;
+        head     += skip;
+    }
+    memcpy(&r->data[head & (LOG_RING_SIZE - 1)], rec, rec->size);
+    __atomic_store_n(&r->head, head + rec->size, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&logger.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&logger.lock);
+        pthread_cond_signal(&logger.wake);
+        pthread_mutex_unlock(&logger.lock);
+    }
+    return 1;
+}
+
+static void
+submit(struct log_record *rec)
+{
+    struct se_gto_ctx *ctx = rec->ctx;
+    struct log_ring   *r;
+    char               line[LOG_LINE_MAX];
+    int                tries;
+
+    r = ctx->log_async ? ring_get() : NULL;
+    if (!r) {
+        format_record(rec, line);
+        return;
+    }
+
+    /* When ring is full, drain in place of log thread to keep order */
+    rec->seq = __atomic_fetch_add(&logger.seq, 1, __ATOMIC_RELAXED);
+    for (tries = 0; !ring_write(r, rec); tries++) {
+        if (tries == LOG_FULL_TRIES) {
+            format_record(rec, line);
+            return;
         }
+        if (pthread_mutex_trylock(&logger.drain) == 0) {
+            drain(line, 0);
+            pthread_mutex_unlock(&logger.drain);
+        } else
+            sched_yield();
     }
 }
 
+static void
+check_printf(3, 4)
+say_dropped(struct se_gto_ctx *ctx, int level, const char *fmt, ...)
+{
+    union {
+        struct log_record rec;
+        uint8_t           raw[LOG_RECORD_MAX];
+    } u;
+    va_list args;
+
+    va_start(args, fmt);
+    u.rec.kind  = LOG_RECORD_FORMAT;
+    u.rec.level = level;
+    u.rec.ctx   = ctx;
+    u.rec.fmt   = fmt;
+    u.rec.size  = encode_args(&u.rec, fmt, &args);
+    va_end(args);
+    submit(&u.rec);
+}
+
+/* Slot of format, claimed on first use: formats are string literals, so
+ * slots are never released. NULL when all are taken, format is not limited.
+ */
+static struct log_rate *
+rate_slot(const char *fmt)
+{
+    unsigned    h = ((uintptr_t)fmt >> 3) % LOG_RATE_SLOTS;
+    const char *cur;
+
+    for (unsigned i = 0; i < LOG_RATE_SLOTS; i++) {
+        struct log_rate *r = &logger.rate[(h + i) % LOG_RATE_SLOTS];
+
+        cur = __atomic_load_n(&r->fmt, __ATOMIC_RELAXED);
+        if (cur == fmt)
+            return r;
+        if (cur)
+            continue;
+        if (__atomic_compare_exchange_n(&r->fmt, &cur, fmt, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+            (cur == fmt))
+            return r;
+    }
+    return NULL;
+}
+
+/* Returns 0 if message from this format exceeds rate of this second */
+static int
+rate_check(struct se_gto_ctx *ctx, int level, const char *fmt)
+{
+    struct log_rate *r;
+    struct timespec  now;
+    uint32_t         dropped = 0;
+
+    /* Errors and warnings are never dropped */
+    if (!ctx->log_rate || (level <= LOG_WARN))
+        return 1;
+    r = rate_slot(fmt);
+    if (!r)
+        return 1;
+
+# ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+# else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+# endif
+
+    /* Races between threads only make count approximate */
+    if (__atomic_load_n(&r->second, __ATOMIC_RELAXED) != (uint32_t)now.tv_sec) {
+        __atomic_store_n(&r->second, (uint32_t)now.tv_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->count, 0, __ATOMIC_RELAXED);
+        dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&r->count, 1, __ATOMIC_RELAXED) > ctx->log_rate) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (dropped)
+        say_dropped(ctx, level, "%u messages dropped: %.*s\n", dropped,
+                    (int)strcspn(fmt, "\n"), fmt);
+    return 1;
+}
+
+void
+vsay(struct se_gto_ctx *ctx, int level, const char *fmt, va_list args)
+{
+    union {
+        struct log_record rec;
+        uint8_t           raw[LOG_RECORD_MAX];
+    } u;
+    va_list copy;
+
+    if (!rate_check(ctx, level, fmt))
+        return;
+
+    va_copy(copy, args);
+    u.rec.kind  = LOG_RECORD_FORMAT;
+    u.rec.level = level;
+    u.rec.ctx   = ctx;
+    u.rec.fmt   = fmt;
+    u.rec.size  = encode_args(&u.rec, fmt, &copy);
+    va_end(copy);
+    submit(&u.rec);
+}
+
+void
+say_hex(struct se_gto_ctx *ctx, int level, const char *what,
+        const void *p, size_t n)
+{
+    union {
+        struct log_record rec;
+        uint8_t           raw[LOG_RECORD_MAX];
+    } u;
+
+    if ((level > ctx->log_level) || !ctx->log_fn || !rate_check(ctx, level, what))
+        return;
+
+    u.rec.kind   = LOG_RECORD_HEX;
+    u.rec.level  = level;
+    u.rec.ctx    = ctx;
+    u.rec.fmt    = what;
+    u.rec.length = n;
+    u.rec.count  = (n < sizeof(u) - sizeof(u.rec)) ? n : sizeof(u) - sizeof(u.rec);
+    memcpy(&u.rec + 1, p, u.rec.count);
+    u.rec.size = (sizeof(u.rec) + u.rec.count + 7) & ~7;
+    submit(&u.rec);
+}
+
+/* Formats pending records of all threads */
+void
+log_flush(void)
+{
+    static char line[LOG_LINE_MAX];
+
+    pthread_mutex_lock(&logger.drain);
+    drain(line, 0);
+    pthread_mutex_unlock(&logger.drain);
+}
+
+#else /* ifdef ENABLE_LOGGING */
+
+void
+log_flush(void)
+{
+}
+
 #endif /* ifdef ENABLE_LOGGING */
 
 void
 log_teardown(struct se_gto_ctx *ctx)
 {
-    if (ctx->log_buf) {
-        free(ctx->log_buf);
-        ctx->log_buf = NULL;
-    }
+    /* Records refer to context */
+    log_flush();
 }
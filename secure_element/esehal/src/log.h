@@ -19,63 +19,92 @@
  *
  * Interface to log facilities.
  *
+ * Messages are recorded unformatted by calling thread and formatted by a
+ * log thread, see log.c. Levels above LOG_LEVEL_MAX cost nothing.
+ *
  */
 
 #ifndef LOG_H
 #define LOG_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "compiler.h"
+
+#define LOG_ERR    0
+#define LOG_WARN   1
+#define LOG_NOTICE 2
+#define LOG_INFO   3
+#define LOG_DEBUG  4
+
+/* Messages above this level are not compiled in */
+#ifndef LOG_LEVEL_MAX
+# if !defined(ENABLE_LOGGING)
+#  define LOG_LEVEL_MAX -1
+# elif defined(ENABLE_DEBUG)
+#  define LOG_LEVEL_MAX LOG_DEBUG
+# else
+#  define LOG_LEVEL_MAX LOG_INFO
+# endif
+#endif
+
+/* Format must be a string literal, it is formatted later by log thread */
+#define log_at(level, fmt, ...)                           \
+    do {                                                  \
+        if ((level) <= LOG_LEVEL_MAX)                     \
+            say(ctx, (level), fmt, ## __VA_ARGS__);       \
+    } while (0)
+
+#define log_hex_at(level, what, p, n)                     \
+    do {                                                  \
+        if ((level) <= LOG_LEVEL_MAX)                     \
+            say_hex(ctx, (level), (what), (p), (n));      \
+    } while (0)
+
+#define err(fmt, ...)    log_at(LOG_ERR, fmt, ## __VA_ARGS__)
+#define warn(fmt, ...)   log_at(LOG_WARN, fmt, ## __VA_ARGS__)
+#define notice(fmt, ...) log_at(LOG_NOTICE, fmt, ## __VA_ARGS__)
+#define info(fmt, ...)   log_at(LOG_INFO, fmt, ## __VA_ARGS__)
+#define dbg(fmt, ...)    log_at(LOG_DEBUG, fmt, ## __VA_ARGS__)
+#define dbg_hex(what, p, n) log_hex_at(LOG_DEBUG, what, p, n)
+
 #ifdef ENABLE_LOGGING
 
-# include "compiler.h"
 # include <stdarg.h>
 
-# define LOG_ESC "\001"
-# define LOG_ERR     LOG_ESC "0"
-# define LOG_WARN    LOG_ESC "1"
-# define LOG_NOTICE  LOG_ESC "2"
-# define LOG_INFO    LOG_ESC "3"
-# define LOG_DEBUG   LOG_ESC "4"
-
-# define err(fmt, ...)    say(ctx, LOG_ERR fmt, ## __VA_ARGS__)
-# define warn(fmt, ...)   say(ctx, LOG_WARN fmt, ## __VA_ARGS__)
-# define notice(fmt, ...) say(ctx, LOG_NOTICE fmt, ## __VA_ARGS__)
-# define info(fmt, ...)   say(ctx, LOG_INFO fmt, ## __VA_ARGS__)
-# ifdef ENABLE_DEBUG
-#  define dbg(fmt, ...)   say(ctx, LOG_DEBUG fmt, ## __VA_ARGS__)
-# else
-#  define dbg(fmt, ...)   nosay(ctx, LOG_DEBUG fmt, ## __VA_ARGS__)
-# endif
-
-void vsay(struct se_gto_ctx *ctx, const char *fmt, va_list args);
+void vsay(struct se_gto_ctx *ctx, int level, const char *fmt, va_list args);
+void say_hex(struct se_gto_ctx *ctx, int level, const char *what,
+             const void *p, size_t n);
 
 static inline void
-check_printf(2, 3)
-say(struct se_gto_ctx *ctx, const char *fmt, ...) {
+check_printf(3, 4)
+say(struct se_gto_ctx *ctx, int level, const char *fmt, ...) {
     va_list args;
 
+    if ((level > ctx->log_level) || !ctx->log_fn)
+        return;
+
     va_start(args, fmt);
-    vsay(ctx, fmt, args);
+    vsay(ctx, level, fmt, args);
     va_end(args);
 }
 
 #else /* ifdef ENABLE_LOGGING */
 
-# define err(fmt, ...)    nosay(ctx, fmt, ## __VA_ARGS__)
-# define warn(fmt, ...)   nosay(ctx, fmt, ## __VA_ARGS__)
-# define notice(fmt, ...) nosay(ctx, fmt, ## __VA_ARGS__)
-# define info(fmt, ...)   nosay(ctx, fmt, ## __VA_ARGS__)
-# define dbg(fmt, ...)    nosay(ctx, fmt, ## __VA_ARGS__)
+static inline void
+check_printf(3, 4)
+say(struct se_gto_ctx *ctx, int level, const char *fmt, ...) {}
+
+static inline void
+say_hex(struct se_gto_ctx *ctx, int level, const char *what,
+        const void *p, size_t n) {}
 
 #endif /* ifdef ENABLE_LOGGING */
 
-#if 0 /* when disabling logging compilation fail on nosay() definition */
-static inline void check_printf(2, 3)
-    nosay(struct se_gto_ctx *ctx, const char *fmt, ...) {}
-#else
-static inline void
-nosay(struct se_gto_ctx *ctx, const char *fmt, ...) {}
-#endif
+/* Writes 2 uppercase digits per byte and a terminating null, returns end */
+char *log_hex(char *dst, const uint8_t *p, size_t n);
 
+void log_flush(void);
 void log_teardown(struct se_gto_ctx *ctx);
 
 #endif /* ifndef LOG_H */
@@ -0,0 +1,310 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Performance counters published in a shared memory page.
+ *
+ * Monitoring samples counters often; asking the HAL through binder would
+ * compete with clients for its threads. Instead, protocol counters, health
+ * counters and latency histograms per operation are copied at end of each
+ * HAL operation to a page in the file set by GTO_METRICS_FILE, which
+ * readers map read-only.
+ *
+ * Page is protected by a sequence lock: counter is odd while page is
+ * written, readers retry until they see the same even value before and
+ * after copying it. Writer never waits for readers. Copy is skipped when
+ * another thread holds context, it will publish when done.
+ *
+ * HAL frees its context whenever last channel is closed, so page is mapped
+ * and initialised once per process, and counters of closed contexts are
+ * added to those of the live one: monitoring sees them grow for as long as
+ * HAL process runs.
+ *
+ * Page is read by gto_metrics tool.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libse-gto-private.h"
+#include "metrics.h"
+
+struct metrics_counters {
+    uint64_t             transceives;
+    uint64_t             blocks_rx;
+    uint64_t             chk_errors;
+    uint64_t             retransmits;
+    struct se_gto_phase  total;
+    struct se_gto_health health;
+    uint32_t             channels_open;
+};
+
+static struct {
+    pthread_mutex_t          lock;
+    char                    *file; /* Mapped one, NULL if none */
+    struct gto_metrics_page *map;
+
+    struct metrics_counters closed; /* Sum of contexts closed */
+} metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t
+metrics_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+metrics_set_file(struct se_gto_ctx *ctx, const char *value)
+{
+    size_t n = strcspn(value, " \t\r\n");
+
+    free(ctx->metrics.file);
+    ctx->metrics.file = NULL;
+    if (n == 0)
+        return 0;
+
+    ctx->metrics.file = strndup(value, n);
+    return ctx->metrics.file ? 0 : -ENOMEM;
+}
+
+/* Metrics lock is held */
+static int
+metrics_map(struct se_gto_ctx *ctx, const char *file)
+{
+    struct gto_metrics_page *p;
+    uint32_t                 seq;
+    int                      fd;
+
+    /* Readable by monitoring, written by HAL only */
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        warn("cannot open metrics file %s, %s\n", file, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, sizeof(*p)) < 0) {
+        warn("cannot size metrics file %s, %s\n", file, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        warn("cannot map metrics file %s, %s\n", file, strerror(errno));
+        return -errno;
+    }
+    metrics.file = strdup(file);
+    if (!metrics.file) {
+        munmap(p, sizeof(*p));
+        return -ENOMEM;
+    }
+
+    /* Page of former process may be being read: clear it as an update, seq
+     * ends different from any value seen before
+     */
+    seq = __atomic_load_n(&p->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&p->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memset(&p->pid, 0, sizeof(*p) - offsetof(struct gto_metrics_page, pid));
+    p->magic       = GTO_METRICS_MAGIC;
+    p->version     = GTO_METRICS_VERSION;
+    p->size        = sizeof(*p);
+    p->pid         = (uint32_t)getpid();
+    p->realtime_ns = (int64_t)(metrics_now_ns(CLOCK_REALTIME) -
+                               metrics_now_ns(CLOCK_MONOTONIC));
+
+    __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELEASE);
+
+    metrics.map = p;
+    return 0;
+}
+
+int
+metrics_open(struct se_gto_ctx *ctx)
+{
+    struct metrics *m   = &ctx->metrics;
+    int             err = 0;
+
+    if (!m->file)
+        return 0;
+
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.map && strcmp(metrics.file, m->file)) {
+        /* File changed in configuration, counters go on in new one */
+        munmap(metrics.map, sizeof(*metrics.map));
+        free(metrics.file);
+        metrics.file = NULL;
+        metrics.map  = NULL;
+    }
+    if (!metrics.map)
+        err = metrics_map(ctx, m->file);
+    m->map = metrics.map;
+    pthread_mutex_unlock(&metrics.lock);
+    return err;
+}
+
+static void
+metrics_read(struct se_gto_ctx *ctx, struct metrics_counters *c)
+{
+    struct se_gto_stats stats;
+
+    se_gto_get_stats(ctx, &stats);
+
+    pthread_mutex_lock(&ctx->lock);
+    c->transceives = stats.transceives;
+    c->blocks_rx   = ctx->t1.blocks_rx;
+    c->chk_errors  = ctx->t1.chk_errors;
+    c->retransmits = ctx->t1.retransmits;
+    c->total       = stats.total;
+    c->health      = ctx->monitor.health;
+
+    c->channels_open = 0;
+    for (int i = 0; i < SE_GTO_MAX_CHANNELS; i++)
+        if (ctx->channels[i].state == SE_GTO_CHANNEL_OPEN)
+            c->channels_open++;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Counts are summed, probe times are those of latest context */
+static void
+metrics_add(struct metrics_counters *dst, const struct metrics_counters *src)
+{
+    struct se_gto_phase        *t = &dst->total;
+    const struct se_gto_phase  *s = &src->total;
+    struct se_gto_health       *h = &dst->health;
+    const struct se_gto_health *g = &src->health;
+
+    dst->transceives += src->transceives;
+    dst->blocks_rx   += src->blocks_rx;
+    dst->chk_errors  += src->chk_errors;
+    dst->retransmits += src->retransmits;
+
+    t->send_us     += s->send_us;
+    t->wait_us     += s->wait_us;
+    t->read_us     += s->read_us;
+    t->polls       += s->polls;
+    t->wtx         += s->wtx;
+    t->retransmits += s->retransmits;
+    t->chk_errors  += s->chk_errors;
+    t->resyncs     += s->resyncs;
+    t->resets      += s->resets;
+    t->blocks_tx   += s->blocks_tx;
+    t->blocks_rx   += s->blocks_rx;
+    t->bytes_tx    += s->bytes_tx;
+    t->bytes_rx    += s->bytes_rx;
+
+    h->probes          += g->probes;
+    h->probe_errors    += g->probe_errors;
+    h->drift_warnings  += g->drift_warnings;
+    h->recoveries      += g->recoveries;
+    h->recovery_errors += g->recovery_errors;
+    if (g->probes) {
+        h->rtt_last_us = g->rtt_last_us;
+        h->rtt_ewma_us = g->rtt_ewma_us;
+        h->rtt_base_us = g->rtt_base_us;
+    }
+
+    dst->channels_open = src->channels_open;
+}
+
+/* Metrics lock is held, counters left as they are if c is NULL */
+static void
+metrics_write(const struct metrics_counters *c)
+{
+    struct gto_metrics_page *p = metrics.map;
+    uint32_t                 seq;
+
+    seq = p->seq;
+    __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    p->updates++;
+    p->ts_ns = metrics_now_ns(CLOCK_MONOTONIC);
+    if (c) {
+        p->transceives   = c->transceives;
+        p->blocks_rx     = c->blocks_rx;
+        p->chk_errors    = c->chk_errors;
+        p->retransmits   = c->retransmits;
+        p->total         = c->total;
+        p->health        = c->health;
+        p->channels_open = c->channels_open;
+    }
+
+    for (int i = 0; i < SE_GTO_OP_COUNT; i++)
+        latency_op_histo(i, &p->op[i]);
+
+    __atomic_store_n(&p->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Context is locked, or NULL once freed to publish latency only */
+void
+metrics_publish(struct se_gto_ctx *ctx)
+{
+    struct metrics_counters live, c;
+
+    if (ctx) {
+        if (!ctx->metrics.map)
+            return;
+        metrics_read(ctx, &live);
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.map) {
+        if (ctx) {
+            c = metrics.closed;
+            metrics_add(&c, &live);
+        }
+        metrics_write(ctx ? &c : NULL);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+/* Page stays mapped for next context */
+void
+metrics_close(struct se_gto_ctx *ctx)
+{
+    struct metrics         *m = &ctx->metrics;
+    struct metrics_counters c;
+
+    if (m->map) {
+        metrics_read(ctx, &c);
+        c.channels_open = 0;
+        pthread_mutex_lock(&metrics.lock);
+        metrics_add(&metrics.closed, &c);
+        if (metrics.map)
+            metrics_write(&metrics.closed);
+        pthread_mutex_unlock(&metrics.lock);
+    }
+    m->map = NULL;
+    free(m->file);
+    m->file = NULL;
+}
@@ -0,0 +1,71 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Performance counters published in a shared memory page.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include <se-gto/libse-gto.h>
+#include "latency.h"
+
+#define GTO_METRICS_MAGIC   0x4D475430 /* "MGT0" */
+#define GTO_METRICS_VERSION 1
+
+/* Readers copy page, and retry if seq was odd or changed meanwhile */
+struct gto_metrics_page {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;        /* Of this structure                        */
+    uint32_t seq;         /* Odd while page is updated                */
+    uint32_t pid;         /* Of writer                                */
+    uint64_t updates;
+    uint64_t ts_ns;       /* CLOCK_MONOTONIC of last update           */
+    int64_t  realtime_ns; /* CLOCK_REALTIME - CLOCK_MONOTONIC at open */
+
+    uint64_t             transceives;
+    uint64_t             blocks_rx;
+    uint64_t             chk_errors;
+    uint64_t             retransmits;
+    struct se_gto_phase  total;
+    struct se_gto_health health;
+    uint32_t             channels_open;
+    uint32_t             pad;
+
+    struct latency_histo op[SE_GTO_OP_COUNT];
+};
+
+struct metrics {
+    char                    *file;
+    struct gto_metrics_page *map; /* Page of process, NULL if not published */
+};
+
+struct se_gto_ctx;
+
+int metrics_set_file(struct se_gto_ctx *ctx, const char *value);
+int metrics_open(struct se_gto_ctx *ctx);
+void metrics_close(struct se_gto_ctx *ctx);
+void metrics_publish(struct se_gto_ctx *ctx);
+
+#endif /* METRICS_H */
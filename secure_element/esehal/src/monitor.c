@@ -0,0 +1,225 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Background link health monitor.
+ *
+ * While context is open, a thread probes Secure Element after each idle
+ * period with an IFS request, the cheapest exchange the card must answer.
+ * Response time of probes is compared to the fastest one seen: a link
+ * slowing down is only reported, a slow card still answers. If the probe
+ * fails, Secure Element is reset before a client APDU fails, but only
+ * when no channel is open: applications selected by clients would lose their state, such
+ * as secure messaging sessions, behind their back. Otherwise next client
+ * APDU fails, and the client side recovers as for any transport error.
+ *
+ * Exchanges are serialized with clients through context lock.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libse-gto-private.h"
+#include "monitor.h"
+
+#define MONITOR_DRIFT_FACTOR 4 /* Slow probe is this times baseline */
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int
+monitor_set_period(struct se_gto_ctx *ctx, const char *value)
+{
+    char         *end;
+    unsigned long period;
+
+    period = strtoul(value, &end, 10);
+    if ((end == value) || (period > 3600 * 1000))
+        return -EINVAL;
+    ctx->monitor.period_ms = (unsigned)period;
+    return 0;
+}
+
+/* Called with context lock held */
+void
+monitor_activity(struct se_gto_ctx *ctx)
+{
+    ctx->monitor.last_exchange_us = now_us();
+    ctx->monitor.suspended        = ctx->monitor.need_recovery;
+}
+
+/* Called with context lock held. Fails once after a probe found the link
+ * unhealthy while channels were open, or clock tuning suspects a reset.
+ */
+int
+monitor_check(struct se_gto_ctx *ctx)
+{
+    if (!ctx->monitor.need_recovery)
+        return 0;
+    ctx->monitor.need_recovery = 0;
+    return -ECONNRESET;
+}
+
+static void
+monitor_recover(struct se_gto_ctx *ctx)
+{
+    struct monitor *mon = &ctx->monitor;
+    uint8_t         atr[32];
+
+    if (se_gto_channel_count(ctx) > 0) {
+        warn("link unhealthy, recovery left to next client APDU\n");
+        mon->need_recovery = 1;
+        mon->suspended     = 1;
+        ctx->check_alive   = 1;
+        return;
+    }
+
+    mon->health.recoveries++;
+    if (se_gto_channel_resume(ctx, atr, sizeof(atr)) < 0) {
+        mon->health.recovery_errors++;
+        mon->suspended   = 1;
+        ctx->check_alive = 1;
+        err("proactive recovery failed, %s\n", strerror(errno));
+    } else
+        info("proactive recovery done, %d channels open\n", se_gto_channel_count(ctx));
+    mon->last_exchange_us = now_us();
+}
+
+static void
+monitor_probe(struct se_gto_ctx *ctx)
+{
+    struct monitor       *mon = &ctx->monitor;
+    struct se_gto_health *h   = &mon->health;
+    struct rt_saved       saved;
+    uint64_t              start;
+    uint32_t              rtt;
+    int                   err;
+
+    rt_enter(ctx, &saved);
+    start = now_us();
+    err   = isot1_negotiate_ifsd(&ctx->t1, ctx->t1.ifsd);
+    rt_leave(ctx, &saved);
+    mon->last_exchange_us = now_us();
+    h->probes++;
+
+    if (err < 0) {
+        h->probe_errors++;
+        warn("health probe failed, %s\n", strerror(-err));
+        monitor_recover(ctx);
+        return;
+    }
+
+    rtt = (uint32_t)(mon->last_exchange_us - start);
+    h->rtt_last_us = rtt;
+    if (!h->rtt_base_us || (rtt < h->rtt_base_us))
+        h->rtt_base_us = rtt;
+    if (!h->rtt_ewma_us)
+        h->rtt_ewma_us = rtt;
+    else
+        h->rtt_ewma_us = h->rtt_ewma_us - h->rtt_ewma_us / 8 + rtt / 8;
+
+    /* Card answered, drift alone never fails client APDUs */
+    if (rtt > MONITOR_DRIFT_FACTOR * h->rtt_base_us) {
+        h->drift_warnings++;
+        warn("health probe took %u us, baseline %u us\n", rtt, h->rtt_base_us);
+    }
+}
+
+static void *
+monitor_thread(void *arg)
+{
+    struct se_gto_ctx *ctx = arg;
+    struct monitor    *mon = &ctx->monitor;
+    struct timespec    ts;
+    uint64_t           due;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!mon->stop) {
+        due = mon->last_exchange_us + (uint64_t)mon->period_ms * 1000;
+        if (mon->suspended || (now_us() < due)) {
+            if (mon->suspended)
+                due = now_us() + (uint64_t)mon->period_ms * 1000;
+            ts.tv_sec  = due / 1000000;
+            ts.tv_nsec = (due % 1000000) * 1000;
+            pthread_cond_timedwait(&mon->cond, &ctx->lock, &ts);
+            continue;
+        }
+        monitor_probe(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+int
+monitor_start(struct se_gto_ctx *ctx)
+{
+    struct monitor    *mon = &ctx->monitor;
+    pthread_condattr_t attr;
+    int                err;
+
+    if (!mon->period_ms || mon->running)
+        return 0;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mon->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    mon->stop             = 0;
+    mon->last_exchange_us = now_us();
+    err = pthread_create(&mon->thread, NULL, monitor_thread, ctx);
+    if (err) {
+        pthread_cond_destroy(&mon->cond);
+        warn("cannot start health monitor, %s\n", strerror(err));
+        return -err;
+    }
+    mon->running = 1;
+    dbg("health monitor started, probe after %u ms idle\n", mon->period_ms);
+    return 0;
+}
+
+/* Returns 1 if monitor was running */
+int
+monitor_stop(struct se_gto_ctx *ctx)
+{
+    struct monitor *mon = &ctx->monitor;
+
+    if (!mon->running)
+        return 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    mon->stop = 1;
+    pthread_cond_signal(&mon->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(mon->thread, NULL);
+    pthread_cond_destroy(&mon->cond);
+    mon->running = 0;
+    return 1;
+}
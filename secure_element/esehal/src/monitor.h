@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Background link health monitor.
+ *
+ */
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct monitor {
+    unsigned period_ms; /* Idle time before probing, 0 when disabled */
+
+    pthread_t      thread;
+    pthread_cond_t cond;
+    uint8_t        running;
+    uint8_t        stop;
+    uint8_t        suspended; /* Recovery failed, wait for client activity */
+    uint8_t        need_recovery; /* Reported to next client APDU          */
+
+    uint64_t last_exchange_us;
+
+    struct se_gto_health health;
+};
+
+struct se_gto_ctx;
+
+int monitor_set_period(struct se_gto_ctx *ctx, const char *value);
+int monitor_start(struct se_gto_ctx *ctx);
+int monitor_stop(struct se_gto_ctx *ctx);
+void monitor_activity(struct se_gto_ctx *ctx);
+int monitor_check(struct se_gto_ctx *ctx);
+
+#endif /* MONITOR_H */
@@ -0,0 +1,250 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * pcapng capture of T=1 blocks and APDUs.
+ *
+ * With GTO_PCAP_FILE set, every block sent or read and every APDU exchanged
+ * is appended to file as an Enhanced Packet Block, with nanosecond wall
+ * clock timestamp. A new section starts each time library is opened.
+ *
+ * Link type is LINKTYPE_USER0 (147). Each packet starts with an 8 bytes
+ * struct gto_pcap_hdr: version 1, packet type, flags, retry count and wait
+ * time in microseconds, big endian. Block or APDU follows as on the wire.
+ * In Wireshark, DLT_USER protocol table is set with DLT 147 and header size
+ * 8. Flags are also written as packet comment, so that retransmissions,
+ * checksum errors and WTX show in packet list as they are.
+ *
+ * Packets are written at once, one write() each, so that capture is
+ * complete up to crash of HAL.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libse-gto-private.h"
+#include "pcap.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT  1
+#define IF_NAME      2
+#define IF_TSRESOL   9
+
+static uint64_t
+pcap_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t
+put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+    return 4;
+}
+
+/* Option with value padded to 32 bits */
+static size_t
+put_option(uint8_t *p, uint16_t code, const void *value, size_t n)
+{
+    uint16_t h[2] = { code, (uint16_t)n };
+    size_t   pad  = (4 - n % 4) % 4;
+
+    memcpy(p, h, 4);
+    if (n)
+        memcpy(p + 4, value, n);
+    memset(p + 4 + n, 0, pad);
+    return 4 + n + pad;
+}
+
+/* Fill block type and both lengths, return total */
+static size_t
+put_block(uint8_t *b, uint32_t type, size_t n)
+{
+    n += 4;
+    put32(b, type);
+    put32(b + 4, (uint32_t)n);
+    put32(b + n - 4, (uint32_t)n);
+    return n;
+}
+
+static void
+pcap_write(struct pcap_writer *pw, const uint8_t *b, size_t n)
+{
+    if (write(pw->fd, b, n) != (ssize_t)n) {
+        close(pw->fd);
+        pw->fd = -1;
+    }
+}
+
+int
+pcap_set_file(struct se_gto_ctx *ctx, const char *value)
+{
+    size_t n = strcspn(value, " \t\r\n");
+
+    free(ctx->pcap.file);
+    ctx->pcap.file = NULL;
+    if (n == 0)
+        return 0;
+
+    ctx->pcap.file = strndup(value, n);
+    return ctx->pcap.file ? 0 : -ENOMEM;
+}
+
+/* Section Header Block, then Interface Description Block */
+int
+pcap_open(struct se_gto_ctx *ctx)
+{
+    struct pcap_writer *pw = &ctx->pcap;
+    uint8_t            *b  = pw->buf;
+    size_t              n;
+    uint8_t             tsresol = 9;
+    int64_t             section = -1;
+
+    if (!pw->file)
+        return 0;
+
+    pw->fd = open(pw->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (pw->fd < 0) {
+        warn("cannot open capture file %s, %s\n", pw->file, strerror(errno));
+        return -errno;
+    }
+
+    n  = 8;
+    n += put32(b + n, 0x1A2B3C4D);
+    n += put32(b + n, 1); /* Version 1.0 */
+    memcpy(b + n, &section, 8), n += 8;
+    n += put_option(b + n, OPT_ENDOFOPT, NULL, 0);
+    n  = put_block(b, PCAPNG_SHB, n);
+
+    b += n;
+    n  = 8;
+    n += put32(b + n, GTO_PCAP_LINKTYPE);
+    n += put32(b + n, 0); /* No snaplen */
+    n += put_option(b + n, IF_NAME, ctx->gtodev, strlen(ctx->gtodev) < 64 ?
+                    strlen(ctx->gtodev) : 64);
+    n += put_option(b + n, IF_TSRESOL, &tsresol, 1);
+    n += put_option(b + n, OPT_ENDOFOPT, NULL, 0);
+    n  = put_block(b, PCAPNG_IDB, n);
+
+    pcap_write(pw, pw->buf, b + n - pw->buf);
+    if (pw->fd >= 0)
+        ctx->t1.pcap = pw;
+    return 0;
+}
+
+void
+pcap_close(struct se_gto_ctx *ctx)
+{
+    struct pcap_writer *pw = &ctx->pcap;
+
+    ctx->t1.pcap = NULL;
+    if (pw->fd >= 0)
+        close(pw->fd);
+    pw->fd = -1;
+    free(pw->file);
+    pw->file = NULL;
+}
+
+static void
+pcap_packet(struct pcap_writer *pw, int type, const uint8_t *data, size_t n,
+            unsigned flags, unsigned retry, uint32_t wait_us)
+{
+    uint8_t *b   = pw->buf;
+    uint64_t ts  = pcap_now_ns(CLOCK_REALTIME);
+    size_t   cap = n > GTO_PCAP_SNAPLEN ? GTO_PCAP_SNAPLEN : n;
+    size_t   len = 8;
+    char     comment[64];
+    int      c   = 0;
+
+    struct gto_pcap_hdr h = {
+        .version = 1,
+        .type    = (uint8_t)type,
+        .flags   = (uint8_t)flags,
+        .retry   = (uint8_t)(retry > 255 ? 255 : retry),
+        .wait_us = { wait_us >> 24, wait_us >> 16, wait_us >> 8, wait_us },
+    };
+
+    len += put32(b + len, 0); /* Interface */
+    len += put32(b + len, (uint32_t)(ts >> 32));
+    len += put32(b + len, (uint32_t)ts);
+    len += put32(b + len, (uint32_t)(sizeof(h) + cap));
+    len += put32(b + len, (uint32_t)(sizeof(h) + n));
+    memcpy(b + len, &h, sizeof(h));
+    memcpy(b + len + sizeof(h), data, cap);
+    len += sizeof(h) + cap;
+    memset(b + len, 0, (4 - len % 4) % 4);
+    len += (4 - len % 4) % 4;
+
+    if (flags & GTO_PCAP_RETRANSMIT)
+        c += snprintf(comment + c, sizeof(comment) - c, "retry %u ", retry);
+    if (flags & GTO_PCAP_BAD_CHECKSUM)
+        c += snprintf(comment + c, sizeof(comment) - c, "checksum error ");
+    if (flags & GTO_PCAP_WTX)
+        c += snprintf(comment + c, sizeof(comment) - c, "after WTX ");
+    if (flags & GTO_PCAP_ERROR)
+        c += snprintf(comment + c, sizeof(comment) - c, "failed ");
+    if (c > 0) {
+        len += put_option(b + len, OPT_COMMENT, comment, c - 1);
+        len += put_option(b + len, OPT_ENDOFOPT, NULL, 0);
+    }
+
+    len = put_block(b, PCAPNG_EPB, len);
+    pcap_write(pw, b, len);
+}
+
+/* Called with context lock held, command before exchange, then response */
+void
+pcap_apdu(struct se_gto_ctx *ctx, int type, const uint8_t *buf, int n)
+{
+    struct pcap_writer *pw = &ctx->pcap;
+    uint64_t            now;
+
+    if (!ctx->t1.pcap)
+        return;
+
+    now = pcap_now_ns(CLOCK_MONOTONIC);
+    if (type == GTO_PCAP_APDU_CMD) {
+        pw->start_ns = now;
+        pcap_packet(pw, type, buf, n, 0, 0, 0);
+    } else
+        pcap_packet(pw, type, buf, n < 0 ? 0 : n, n < 0 ? GTO_PCAP_ERROR : 0,
+                    0, (uint32_t)((now - pw->start_ns) / 1000));
+}
+
+void
+pcap_block(struct t1_state *t1, int type, const uint8_t *buf, size_t n,
+           unsigned flags, unsigned retry, uint32_t wait_us)
+{
+    if (t1->pcap)
+        pcap_packet(t1->pcap, type, buf, n, flags, retry, wait_us);
+}
@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * pcapng capture of T=1 blocks and APDUs.
+ *
+ */
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GTO_PCAP_LINKTYPE 147 /* LINKTYPE_USER0 */
+#define GTO_PCAP_SNAPLEN  4200
+
+/* Pseudo header in front of each packet, multi-byte fields big endian */
+struct gto_pcap_hdr {
+    uint8_t version; /* 1 */
+    uint8_t type;    /* GTO_PCAP_BLOCK_TX...                            */
+    uint8_t flags;   /* GTO_PCAP_RETRANSMIT...                          */
+    uint8_t retry;   /* Failed attempts before this block               */
+    uint8_t wait_us[4]; /* Block received: wait, APDU response: exchange */
+};
+
+enum {
+    GTO_PCAP_BLOCK_TX = 1,
+    GTO_PCAP_BLOCK_RX,
+    GTO_PCAP_APDU_CMD,
+    GTO_PCAP_APDU_RESP,
+};
+
+#define GTO_PCAP_RETRANSMIT   0x01 /* Block sent again                   */
+#define GTO_PCAP_BAD_CHECKSUM 0x02 /* Block received with wrong checksum */
+#define GTO_PCAP_WTX          0x04 /* Wait extended by card WTX request  */
+#define GTO_PCAP_ERROR        0x08 /* APDU exchange failed               */
+
+struct pcap_writer {
+    char *file;
+    int   fd; /* -1 if not capturing */
+
+    uint64_t start_ns; /* Of APDU exchange in progress */
+
+    /* Enhanced Packet Block: header, packet, comment, end of options */
+    uint8_t buf[28 + 8 + GTO_PCAP_SNAPLEN + 3 + 4 + 64 + 4 + 4];
+};
+
+struct se_gto_ctx;
+struct t1_state;
+
+int pcap_set_file(struct se_gto_ctx *ctx, const char *value);
+int pcap_open(struct se_gto_ctx *ctx);
+void pcap_close(struct se_gto_ctx *ctx);
+void pcap_apdu(struct se_gto_ctx *ctx, int type, const uint8_t *buf, int n);
+void pcap_block(struct t1_state *t1, int type, const uint8_t *buf, size_t n,
+                unsigned flags, unsigned retry, uint32_t wait_us);
+
+#endif /* PCAP_H */
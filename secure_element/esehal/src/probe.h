@@ -0,0 +1,73 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Statically defined tracing probes, for bpftrace or perf.
+ *
+ * When built with <sys/sdt.h>, each probe is a single nop and a note in
+ * ELF file; a tracer attaching to it replaces nop with a breakpoint. Cost
+ * is nil when no tracer is attached. Without <sys/sdt.h>, or with
+ * GTO_NO_PROBES defined, probes compile to nothing.
+ *
+ * Probes of provider se_gto, arguments are integers:
+ *   apdu_begin(cla, ins, p1, p2, length)
+ *   apdu_end(ins, result, sw)           result is length or negative errno
+ *   block_send(nad, pcb, length)
+ *   block_recv(nad, pcb, length, wait_us)
+ *   chk_error(pcb)                      block received with bad checksum
+ *   wtx(multiplier)
+ *   retry(reason, retries_left)         reason is a negative errno
+ *   reset_begin(), reset_end(result)
+ *   resync_begin(), resync_end(result)
+ *
+ * See tools/bpftrace for examples.
+ *
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#if !defined(GTO_NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define GTO_HAVE_PROBES 1
+# endif
+#endif
+
+#ifdef GTO_HAVE_PROBES
+# define GTO_PROBE0(name)             DTRACE_PROBE(se_gto, name)
+# define GTO_PROBE1(name, a)          DTRACE_PROBE1(se_gto, name, a)
+# define GTO_PROBE2(name, a, b)       DTRACE_PROBE2(se_gto, name, a, b)
+# define GTO_PROBE3(name, a, b, c)    DTRACE_PROBE3(se_gto, name, a, b, c)
+# define GTO_PROBE4(name, a, b, c, d) DTRACE_PROBE4(se_gto, name, a, b, c, d)
+# define GTO_PROBE5(name, a, b, c, d, e) \
+    DTRACE_PROBE5(se_gto, name, a, b, c, d, e)
+#else
+/* Arguments are not evaluated, only seen as used */
+# define GTO_PROBE_ARG(a)             ((void)sizeof(a))
+# define GTO_PROBE0(name)             ((void)0)
+# define GTO_PROBE1(name, a)          GTO_PROBE_ARG(a)
+# define GTO_PROBE2(name, a, b)       (GTO_PROBE_ARG(a), GTO_PROBE_ARG(b))
+# define GTO_PROBE3(name, a, b, c)    (GTO_PROBE2(name, a, b), GTO_PROBE_ARG(c))
+# define GTO_PROBE4(name, a, b, c, d) (GTO_PROBE3(name, a, b, c), GTO_PROBE_ARG(d))
+# define GTO_PROBE5(name, a, b, c, d, e) \
+    (GTO_PROBE4(name, a, b, c, d), GTO_PROBE_ARG(e))
+#endif
+
+#endif /* PROBE_H */
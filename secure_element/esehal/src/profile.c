@@ -0,0 +1,130 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Learned response time per command class.
+ *
+ * Time the card takes to answer depends mostly on command: GET DATA is
+ * answered in well under a millisecond whereas a signature takes tens of
+ * milliseconds. Wait for the first response block is averaged per class of
+ * command header (CLA type, INS, P1, Lc range), and the first poll is
+ * scheduled a little before the expected answer. Other polls then follow
+ * wait strategy.
+ *
+ * Table is kept in state file when there is one, so that it survives HAL
+ * restarts.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "profile.h"
+
+#define PROFILE_MIN_SAMPLES 3     /* Before average is trusted       */
+#define PROFILE_MAX_COUNT   65535 /* Count saturates there           */
+
+/* Class of command: proprietary bit of CLA, INS, P1 and Lc range. */
+static uint32_t
+profile_key(const uint8_t *apdu, int n)
+{
+    uint32_t lc;
+
+    if (n == 4)
+        lc = 0; /* No data, no Le */
+    else if (n == 5)
+        lc = 1; /* Le only */
+    else if (apdu[4] == 0)
+        lc = 5; /* Extended length */
+    else if (apdu[4] <= 32)
+        lc = 2;
+    else if (apdu[4] <= 128)
+        lc = 3;
+    else
+        lc = 4;
+
+    return 0x80000000u | (lc << 24) | ((uint32_t)(apdu[0] & 0x80) << 16) |
+           (apdu[1] << 8) | apdu[2];
+}
+
+static struct profile_entry *
+profile_find(struct profile *p, uint32_t key)
+{
+    for (int i = 0; i < PROFILE_SIZE; i++)
+        if (p->entry[i].key == key)
+            return &p->entry[i];
+    return NULL;
+}
+
+/* Use table in state file if mapped, else the one in context */
+void
+profile_attach(struct se_gto_ctx *ctx)
+{
+    ctx->profile = ctx->state ? &ctx->state->profile : &ctx->profile_mem;
+}
+
+/* Only single block commands: with chaining, first block waited for is
+ * an acknowledge, not the response.
+ */
+static int
+profile_applies(struct se_gto_ctx *ctx, int n)
+{
+    return ctx->profile_enabled && ctx->profile && (n >= 4) && (n <= ctx->t1.ifsc);
+}
+
+void
+profile_before(struct se_gto_ctx *ctx, const uint8_t *apdu, int n)
+{
+    struct profile_entry *e;
+
+    if (!profile_applies(ctx, n))
+        return;
+
+    e = profile_find(ctx->profile, profile_key(apdu, n));
+    if (e && (e->count >= PROFILE_MIN_SAMPLES))
+        /* Just before expected completion */
+        ctx->t1.wait.hint_us = e->ewma_us - e->ewma_us / 8;
+}
+
+void
+profile_after(struct se_gto_ctx *ctx, const uint8_t *apdu, int n, int r)
+{
+    struct profile       *p = ctx->profile;
+    struct profile_entry *e;
+    uint32_t              key, us = ctx->t1.wait.first_wait_us;
+
+    if (!profile_applies(ctx, n) || (r < 2) || !us)
+        return;
+
+    key = profile_key(apdu, n);
+    e   = profile_find(p, key);
+    if (!e) {
+        e = &p->entry[p->next % PROFILE_SIZE];
+        p->next = (p->next + 1) % PROFILE_SIZE;
+        e->key     = key;
+        e->ewma_us = us;
+        e->count   = 1;
+        return;
+    }
+
+    e->ewma_us = e->ewma_us - e->ewma_us / 8 + us / 8;
+    if (e->count < PROFILE_MAX_COUNT)
+        e->count++;
+}
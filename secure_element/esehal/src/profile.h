@@ -0,0 +1,47 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Learned response time per command class.
+ *
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#define PROFILE_SIZE 64
+
+struct profile {
+    struct profile_entry {
+        uint32_t key;     /* Command class, 0 if free            */
+        uint32_t ewma_us; /* Moving average of wait for response */
+        uint32_t count;   /* Samples seen, saturates             */
+    } entry[PROFILE_SIZE];
+    uint32_t next; /* Round robin replacement */
+};
+
+struct se_gto_ctx;
+
+void profile_attach(struct se_gto_ctx *ctx);
+void profile_before(struct se_gto_ctx *ctx, const uint8_t *apdu, int n);
+void profile_after(struct se_gto_ctx *ctx, const uint8_t *apdu, int n, int r);
+
+#endif /* PROFILE_H */
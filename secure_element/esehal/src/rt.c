@@ -0,0 +1,211 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Real-time scheduling of exchanges with Secure Element.
+ *
+ * Polling for card blocks sleeps a few hundred microseconds at a time: any
+ * scheduling delay of the thread past its wake-up time adds to APDU
+ * latency. Exchanges are run by client threads, so the calling thread is
+ * given configured policy, CPU affinity and timer slack for the time of
+ * the exchange only, and its own settings are restored afterwards.
+ *
+ * A setting refused by kernel, usually for lack of CAP_SYS_NICE, is
+ * reported once and no longer tried.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#include "libse-gto-private.h"
+#include "rt.h"
+
+#define RT_SCHED    0x01
+#define RT_AFFINITY 0x02
+#define RT_SLACK    0x04
+
+int
+rt_set_policy(struct se_gto_ctx *ctx, const char *value)
+{
+    if (strncmp(value, "fifo", 4) == 0)
+        ctx->rt.policy = SCHED_FIFO;
+    else if (strncmp(value, "rr", 2) == 0)
+        ctx->rt.policy = SCHED_RR;
+    else if (strncmp(value, "other", 5) == 0)
+        ctx->rt.policy = SCHED_OTHER;
+    else
+        return -EINVAL;
+    ctx->rt.refused &= ~RT_SCHED;
+    return 0;
+}
+
+/* List of CPUs and ranges such as "4-7" or "2,3", empty to disable */
+int
+rt_set_cpus(struct se_gto_ctx *ctx, const char *value)
+{
+    const char   *s    = value;
+    uint64_t      cpus = 0;
+    char         *end;
+    unsigned long first, last;
+
+    while (*s && (*s != '\n') && (*s != ';')) {
+        first = strtoul(s, &end, 10);
+        if (end == s)
+            return -EINVAL;
+        last = first;
+        s    = end;
+        if (*s == '-') {
+            last = strtoul(++s, &end, 10);
+            if ((end == s) || (last < first))
+                return -EINVAL;
+            s = end;
+        }
+        if (last >= RT_MAX_CPUS)
+            return -EINVAL;
+        while (first <= last)
+            cpus |= 1ULL << first++;
+        if (*s == ',')
+            s++;
+    }
+
+    ctx->rt.cpus     = cpus;
+    ctx->rt.refused &= ~RT_AFFINITY;
+    return 0;
+}
+
+int
+rt_set_timer_slack(struct se_gto_ctx *ctx, const char *value)
+{
+    char         *end;
+    unsigned long ns;
+
+    ns = strtoul(value, &end, 10);
+    if ((end == value) || (ns > 1000000))
+        return -EINVAL;
+
+    /* Slack of 0 would restore thread default, use 1 ns as minimum */
+    ctx->rt.timer_slack_ns = ns ? (unsigned)ns : 1;
+    ctx->rt.has_slack      = 1;
+    ctx->rt.refused       &= ~RT_SLACK;
+    return 0;
+}
+
+static void
+mask_to_set(uint64_t mask, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    for (int cpu = 0; cpu < RT_MAX_CPUS; cpu++)
+        if (mask & (1ULL << cpu))
+            CPU_SET(cpu, set);
+}
+
+/* Returns 0 if set holds CPUs not representable as mask */
+static uint64_t
+set_to_mask(const cpu_set_t *set)
+{
+    uint64_t mask = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, set)) {
+            if (cpu >= RT_MAX_CPUS)
+                return 0;
+            mask |= 1ULL << cpu;
+        }
+    return mask;
+}
+
+static void
+rt_refused(struct se_gto_ctx *ctx, uint8_t what, const char *name, int error)
+{
+    ctx->rt.refused |= what;
+    warn("cannot set %s for exchanges, %s\n", name, strerror(error));
+}
+
+/* Called with context lock held */
+void
+rt_enter(struct se_gto_ctx *ctx, struct rt_saved *saved)
+{
+    struct rt_config  *rt = &ctx->rt;
+    struct sched_param param;
+    cpu_set_t          set;
+    int                prio, err;
+
+    saved->applied = 0;
+
+    if ((rt->policy != SCHED_OTHER) && !(rt->refused & RT_SCHED) &&
+        !pthread_getschedparam(pthread_self(), &saved->policy, &saved->param)) {
+        prio = (int)rt->priority;
+        if (prio < sched_get_priority_min(rt->policy))
+            prio = sched_get_priority_min(rt->policy);
+        else if (prio > sched_get_priority_max(rt->policy))
+            prio = sched_get_priority_max(rt->policy);
+        param.sched_priority = prio;
+
+        err = pthread_setschedparam(pthread_self(), rt->policy, &param);
+        if (err)
+            rt_refused(ctx, RT_SCHED, "real-time policy", err);
+        else
+            saved->applied |= RT_SCHED;
+    }
+
+    /* Left alone if thread affinity could not be restored from mask */
+    if (rt->cpus && !(rt->refused & RT_AFFINITY) &&
+        !sched_getaffinity(0, sizeof(set), &set))
+        saved->cpus = set_to_mask(&set);
+    else
+        saved->cpus = 0;
+    if (saved->cpus) {
+        mask_to_set(rt->cpus, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            rt_refused(ctx, RT_AFFINITY, "CPU affinity", errno);
+        else
+            saved->applied |= RT_AFFINITY;
+    }
+
+    if (rt->has_slack && !(rt->refused & RT_SLACK)) {
+        saved->timer_slack_ns = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+        if ((saved->timer_slack_ns < 0) ||
+            (prctl(PR_SET_TIMERSLACK, rt->timer_slack_ns, 0, 0, 0) < 0))
+            rt_refused(ctx, RT_SLACK, "timer slack", errno);
+        else
+            saved->applied |= RT_SLACK;
+    }
+}
+
+void
+rt_leave(struct se_gto_ctx *ctx, struct rt_saved *saved)
+{
+    if (saved->applied & RT_SLACK)
+        prctl(PR_SET_TIMERSLACK, saved->timer_slack_ns, 0, 0, 0);
+    if (saved->applied & RT_AFFINITY) {
+        cpu_set_t set;
+
+        mask_to_set(saved->cpus, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    if (saved->applied & RT_SCHED)
+        pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+    saved->applied = 0;
+}
@@ -0,0 +1,59 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Real-time scheduling of exchanges with Secure Element.
+ *
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#include <sched.h>
+#include <stdint.h>
+
+#define RT_MAX_CPUS 64
+
+struct rt_config {
+    int       policy;         /* SCHED_FIFO, SCHED_RR or SCHED_OTHER (off) */
+    unsigned  priority;       /* For SCHED_FIFO and SCHED_RR               */
+    uint64_t  cpus;           /* Affinity mask, 0 to keep thread affinity  */
+    uint8_t   has_slack;      /* Timer slack set in configuration          */
+    unsigned  timer_slack_ns; /* Timer slack of thread while exchanging    */
+    uint8_t   refused;        /* Bitmap of settings refused by kernel      */
+};
+
+/* Settings of calling thread, restored after exchange */
+struct rt_saved {
+    uint8_t            applied; /* Bitmap of settings changed */
+    int                policy;
+    struct sched_param param;
+    uint64_t           cpus;
+    long               timer_slack_ns;
+};
+
+struct se_gto_ctx;
+
+int rt_set_policy(struct se_gto_ctx *ctx, const char *value);
+int rt_set_cpus(struct se_gto_ctx *ctx, const char *value);
+int rt_set_timer_slack(struct se_gto_ctx *ctx, const char *value);
+void rt_enter(struct se_gto_ctx *ctx, struct rt_saved *saved);
+void rt_leave(struct se_gto_ctx *ctx, struct rt_saved *saved);
+
+#endif /* RT_H */
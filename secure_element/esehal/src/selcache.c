@@ -0,0 +1,245 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Negative cache of applications not found by SELECT.
+ *
+ * The cache is shared by all contexts of the process: a context lives only
+ * while channels are open, whereas the content of the card does not change
+ * with it. Entries are tagged with device node so that two devices do not
+ * share answers.
+ *
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libse-gto-private.h"
+#include "selcache.h"
+
+#define SELCACHE_SIZE 16
+
+#define INS_SELECT     0xA4
+#define INS_STORE_DATA 0xE2
+#define INS_INSTALL    0xE6
+#define INS_LOAD       0xE8
+
+struct selcache_entry {
+    uint32_t dev;
+    uint8_t  valid;
+    uint8_t  p2;
+    uint8_t  aid_len;
+    uint8_t  aid[16];
+};
+
+static struct {
+    pthread_mutex_t       lock;
+    struct selcache_entry entry[SELCACHE_SIZE];
+    unsigned              next; /* Round robin replacement */
+
+    uint32_t atr_dev;
+    uint8_t  atr[32];
+    uint8_t  atr_length;
+
+    unsigned long hits;
+    unsigned long misses;
+} selcache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* FNV-1a of device node */
+static uint32_t
+dev_id(struct se_gto_ctx *ctx)
+{
+    const char *s = ctx->gtodev;
+    uint32_t    h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+static struct selcache_entry *
+selcache_find(uint32_t dev, const uint8_t *aid, size_t len, int p2)
+{
+    for (int i = 0; i < SELCACHE_SIZE; i++) {
+        struct selcache_entry *e = &selcache.entry[i];
+
+        if (e->valid && (e->dev == dev) && (e->p2 == (uint8_t)p2) &&
+            (e->aid_len == len) && !memcmp(e->aid, aid, len))
+            return e;
+    }
+    return NULL;
+}
+
+static void
+selcache_flush_locked(void)
+{
+    for (int i = 0; i < SELCACHE_SIZE; i++)
+        selcache.entry[i].valid = 0;
+}
+
+SE_GTO_EXPORT int
+se_gto_select_cache_lookup(struct se_gto_ctx *ctx, const void *aid,
+                           size_t len, int p2)
+{
+    uint32_t dev;
+    int      hit;
+
+    if (len > 16)
+        return 0;
+
+    pthread_mutex_lock(&selcache.lock);
+    /* Without context, device last reset is the one to be opened */
+    if (ctx)
+        dev = dev_id(ctx);
+    else if (selcache.atr_length)
+        dev = selcache.atr_dev;
+    else {
+        pthread_mutex_unlock(&selcache.lock);
+        return 0;
+    }
+    hit = selcache_find(dev, aid, len, p2) != NULL;
+    if (hit)
+        selcache.hits++;
+    else
+        selcache.misses++;
+    pthread_mutex_unlock(&selcache.lock);
+    return hit;
+}
+
+SE_GTO_EXPORT void
+se_gto_select_cache_flush(void)
+{
+    pthread_mutex_lock(&selcache.lock);
+    selcache_flush_locked();
+    pthread_mutex_unlock(&selcache.lock);
+}
+
+SE_GTO_EXPORT void
+se_gto_select_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    pthread_mutex_lock(&selcache.lock);
+    if (hits)
+        *hits = selcache.hits;
+    if (misses)
+        *misses = selcache.misses;
+    pthread_mutex_unlock(&selcache.lock);
+}
+
+/* Applications may have been installed through another interface while
+ * link was down, so card reset always flushes. Resuming with RESYNCH only
+ * flushes when ATR is not the one cache was filled with.
+ */
+static void
+selcache_atr(struct se_gto_ctx *ctx, const uint8_t *atr, size_t n, int reset)
+{
+    uint32_t dev = dev_id(ctx);
+
+    if (n > sizeof(selcache.atr))
+        n = sizeof(selcache.atr);
+
+    pthread_mutex_lock(&selcache.lock);
+    if (reset || (selcache.atr_dev != dev) || (selcache.atr_length != n) ||
+        memcmp(selcache.atr, atr, n)) {
+        selcache_flush_locked();
+        selcache.atr_dev    = dev;
+        selcache.atr_length = (uint8_t)n;
+        memcpy(selcache.atr, atr, n);
+    }
+    pthread_mutex_unlock(&selcache.lock);
+}
+
+void
+select_cache_reset(struct se_gto_ctx *ctx, const uint8_t *atr, size_t n)
+{
+    selcache_atr(ctx, atr, n, 1);
+}
+
+void
+select_cache_atr(struct se_gto_ctx *ctx, const uint8_t *atr, size_t n)
+{
+    selcache_atr(ctx, atr, n, 0);
+}
+
+/* Learn from SELECT by name outcome, and forget everything when content
+ * may have been installed.
+ */
+void
+select_cache_apdu_done(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                       const uint8_t *resp, int r)
+{
+    struct selcache_entry *e;
+    const uint8_t         *aid;
+    uint32_t               dev;
+    size_t                 len;
+    uint16_t               sw;
+
+    switch (apdu[1]) {
+        case INS_SELECT:
+            break;
+
+        case INS_STORE_DATA:
+        case INS_INSTALL:
+        case INS_LOAD:
+            /* Even without response, card may have executed command */
+            se_gto_select_cache_flush();
+            return;
+
+        default:
+            return;
+    }
+
+    if (r < 2)
+        return;
+
+    /* Only SELECT by DF name with AID of 5 to 16 bytes */
+    if ((apdu[2] != 0x04) || (n < 5 + 5) || (apdu[4] > 16) ||
+        (5 + apdu[4] > n))
+        return;
+
+    aid = apdu + 5;
+    len = apdu[4];
+    dev = dev_id(ctx);
+    sw  = (resp[r - 2] << 8) | resp[r - 1];
+
+    pthread_mutex_lock(&selcache.lock);
+    if (sw == 0x6A82) {
+        if (!selcache_find(dev, aid, len, apdu[3])) {
+            e = &selcache.entry[selcache.next];
+            selcache.next = (selcache.next + 1) % SELCACHE_SIZE;
+            e->valid   = 1;
+            e->dev     = dev;
+            e->p2      = apdu[3];
+            e->aid_len = (uint8_t)len;
+            memcpy(e->aid, aid, len);
+        }
+    } else if ((resp[r - 2] == 0x90) || (resp[r - 2] == 0x61) ||
+               (resp[r - 2] == 0x62) || (resp[r - 2] == 0x63)) {
+        /* Application is selectable now, whatever P2 */
+        for (int i = 0; i < SELCACHE_SIZE; i++) {
+            e = &selcache.entry[i];
+            if ((e->dev == dev) && (e->aid_len == len) &&
+                !memcmp(e->aid, aid, len))
+                e->valid = 0;
+        }
+    }
+    pthread_mutex_unlock(&selcache.lock);
+}
@@ -0,0 +1,34 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Internal interface to the negative SELECT cache.
+ *
+ */
+
+#ifndef SELCACHE_H
+#define SELCACHE_H
+
+struct se_gto_ctx;
+
+void select_cache_reset(struct se_gto_ctx *ctx, const uint8_t *atr, size_t n);
+void select_cache_atr(struct se_gto_ctx *ctx, const uint8_t *atr, size_t n);
+void select_cache_apdu_done(struct se_gto_ctx *ctx, const uint8_t *apdu, int n,
+                            const uint8_t *resp, int r);
+
+#endif /* SELCACHE_H */
@@ -98,3 +98,38 @@ spi_read(int fd, void *buf, size_t count)
 
     return (int)n;
 }
+
+int
+spi_get_clock(int fd, uint32_t *hz)
+{
+    __s32 speed;
+
+    if (ioctl(fd, GTO_IOC_RD_CLK_SPEED, &speed) < 0)
+        return -errno;
+    if (speed <= 0)
+        return -EINVAL;
+    *hz = (uint32_t)speed;
+    return 0;
+}
+
+/* Same request number as GTO_IOC_WR_RESET, a driver without clock control
+ * would reset Secure Element instead. Only written once driver has answered
+ * GTO_IOC_RD_CLK_SPEED with another speed, caller checks speed read back,
+ * see GTO_CLK_TUNE.
+ */
+int
+spi_set_clock(int fd, uint32_t hz)
+{
+    __s32    speed = (__s32)hz;
+    uint32_t cur;
+    int      err;
+
+    err = spi_get_clock(fd, &cur);
+    if (err < 0)
+        return err;
+    if (cur == hz)
+        return 0;
+    if (ioctl(fd, GTO_IOC_WR_CLK_SPEED, &speed) < 0)
+        return -errno;
+    return 0;
+}
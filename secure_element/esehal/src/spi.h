@@ -28,5 +28,7 @@ int spi_setup(struct se_gto_ctx *ctx);
 int spi_teardown(struct se_gto_ctx *ctx);
 int spi_write(int fd, const void *buf, size_t count);
 int spi_read(int fd, void *buf, size_t count);
+int spi_get_clock(int fd, uint32_t *hz);
+int spi_set_clock(int fd, uint32_t hz);
 
 #endif /* SPI_H */
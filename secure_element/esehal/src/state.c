@@ -0,0 +1,235 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Link state kept in a file across HAL process restarts.
+ *
+ * Secure Element stays powered when the HAL process dies. A new process
+ * can then restart T=1 sequence numbers with RESYNCH instead of paying for
+ * a RESET and ATR, provided it knows the link parameters in use, which are
+ * saved here after each reset.
+ *
+ * File is kept on persistent storage for learned parameters, but link
+ * state is only valid for the boot it was saved in: Secure Element is
+ * powered off with device, and channels recorded open are gone.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libse-gto-private.h"
+#include "state.h"
+
+#define INS_MANAGE_CHANNEL 0x70
+
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+/* Reads identifier of current boot, empty string if unknown */
+static void
+read_boot_id(char *buf, size_t size)
+{
+    ssize_t n = -1;
+    int     fd;
+
+    fd = open(BOOT_ID_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        n = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (n < 0)
+        n = 0;
+    buf[n] = 0;
+    buf[strcspn(buf, "\n")] = 0;
+}
+
+int
+state_set_file(struct se_gto_ctx *ctx, const char *value)
+{
+    size_t n = strcspn(value, " \t\r\n");
+
+    free(ctx->state_file);
+    ctx->state_file = NULL;
+    if (n == 0)
+        return 0;
+
+    ctx->state_file = strndup(value, n);
+    return ctx->state_file ? 0 : -ENOMEM;
+}
+
+int
+state_open(struct se_gto_ctx *ctx)
+{
+    struct gto_state *st;
+    char              boot_id[sizeof(st->boot_id)];
+    int               fd;
+
+    if (!ctx->state_file)
+        return 0;
+
+    fd = open(ctx->state_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        warn("cannot open state file %s, %s\n", ctx->state_file, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, sizeof(*st)) < 0) {
+        warn("cannot size state file %s, %s\n", ctx->state_file, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED) {
+        warn("cannot map state file %s, %s\n", ctx->state_file, strerror(errno));
+        return -errno;
+    }
+
+    /* New file is all zeroes, older layout is discarded */
+    if ((st->magic != GTO_STATE_MAGIC) || (st->version != GTO_STATE_VERSION) ||
+        (st->size != sizeof(*st))) {
+        memset(st, 0, sizeof(*st));
+        st->magic   = GTO_STATE_MAGIC;
+        st->version = GTO_STATE_VERSION;
+        st->size    = sizeof(*st);
+    }
+
+    /* Link of another boot cannot be resumed, nor one of unknown boot */
+    read_boot_id(boot_id, sizeof(boot_id));
+    if (!boot_id[0] || strncmp(st->boot_id, boot_id, sizeof(boot_id))) {
+        dbg("state file from another boot, link not resumable\n");
+        st->valid    = 0;
+        st->channels = 0;
+        memcpy(st->boot_id, boot_id, sizeof(boot_id));
+    }
+    ctx->state = st;
+    return 0;
+}
+
+void
+state_close(struct se_gto_ctx *ctx)
+{
+    if (ctx->state)
+        munmap(ctx->state, sizeof(*ctx->state));
+    ctx->state = NULL;
+    free(ctx->state_file);
+    ctx->state_file = NULL;
+}
+
+void
+state_reset_begin(struct se_gto_ctx *ctx)
+{
+    if (ctx->state)
+        ctx->state->valid = 0;
+}
+
+void
+state_reset_done(struct se_gto_ctx *ctx)
+{
+    struct gto_state *st = ctx->state;
+    struct t1_state  *t1 = &ctx->t1;
+
+    if (!st)
+        return;
+
+    strncpy(st->gtodev, ctx->gtodev, sizeof(st->gtodev) - 1);
+    st->atr_length = t1->atr_length;
+    memcpy(st->atr, t1->atr, t1->atr_length);
+    st->proto    = t1->proto;
+    st->ifsc     = t1->ifsc;
+    st->ifsd     = t1->ifsd;
+    st->bwt      = t1->bwt;
+    st->chk_algo = t1->chk_algo;
+    st->channels = 0;
+    st->valid    = 1;
+}
+
+void
+state_channel(struct se_gto_ctx *ctx, int channel, int open)
+{
+    if (!ctx->state || (channel <= 0) || (channel >= SE_GTO_MAX_CHANNELS))
+        return;
+
+    if (open)
+        ctx->state->channels |= 1u << channel;
+    else
+        ctx->state->channels &= ~(1u << channel);
+}
+
+/* Close logical channels a former process left open on card */
+static int
+state_close_channels(struct se_gto_ctx *ctx)
+{
+    uint8_t apdu[4];
+    uint8_t resp[2];
+    int     r;
+
+    for (int i = 1; i < SE_GTO_MAX_CHANNELS; i++) {
+        if (!(ctx->state->channels & (1u << i)))
+            continue;
+
+        apdu[0] = (uint8_t)se_gto_channel_cla(0x00, i);
+        apdu[1] = INS_MANAGE_CHANNEL;
+        apdu[2] = 0x80;
+        apdu[3] = (uint8_t)i;
+        r = isot1_transceive(&ctx->t1, apdu, sizeof(apdu), resp, sizeof(resp));
+        if (r < 0)
+            return r;
+        if ((r != 2) || (resp[0] != 0x90))
+            warn("failed to close stale channel %d\n", i);
+        else
+            dbg("stale channel %d closed\n", i);
+    }
+    ctx->state->channels = 0;
+    return 0;
+}
+
+/* Restore link parameters and restart sequence numbers with RESYNCH */
+int
+state_resume(struct se_gto_ctx *ctx)
+{
+    struct gto_state *st = ctx->state;
+    struct t1_state  *t1 = &ctx->t1;
+    int               err;
+
+    if (!st || !st->valid || (st->atr_length > sizeof(t1->atr)) ||
+        (st->proto != t1->proto) ||
+        strncmp(st->gtodev, ctx->gtodev, sizeof(st->gtodev)))
+        return -ENODATA;
+
+    t1->atr_length = st->atr_length;
+    memcpy(t1->atr, st->atr, st->atr_length);
+    t1->ifsc       = st->ifsc;
+    t1->bwt        = st->bwt;
+    t1->chk_algo   = st->chk_algo;
+    t1->need_reset = 0;
+
+    err = isot1_resync(t1);
+    /* Card may have gone back to initial IFSD with RESYNCH */
+    if (err >= 0)
+        err = isot1_negotiate_ifsd(t1, st->ifsd);
+    if (err >= 0)
+        err = state_close_channels(ctx);
+    if (err < 0)
+        t1->need_reset = 1;
+    return err;
+}
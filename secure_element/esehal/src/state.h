@@ -0,0 +1,73 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Link state kept in a file across HAL process restarts.
+ *
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+
+#include "profile.h"
+
+#define GTO_STATE_MAGIC   0x53475430 /* "SGT0" */
+#define GTO_STATE_VERSION 5
+
+/* File is mapped shared: a store is on disk as soon as process dies. */
+struct gto_state {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+
+    char gtodev[64];  /* Device node the link below belongs to */
+    char boot_id[40]; /* Boot the link below belongs to */
+
+    uint8_t valid; /* Cleared while reset is in progress */
+    uint8_t atr_length;
+    uint8_t atr[32]; /* Historical bytes of CIP with GP */
+    uint8_t proto;   /* Link below is only resumed with same protocol */
+    uint8_t chk_algo;
+    uint16_t ifsc;
+    uint16_t ifsd;
+    uint32_t bwt;    /* Set by CIP with GP */
+
+    uint32_t channels; /* Logical channels open on card, basic excluded */
+
+    /* SPI clock tuning, see clktune.c */
+    uint32_t clk_base_hz; /* Driver speed before any tuning              */
+    uint32_t clk_hz;      /* Fastest speed with errors within limit      */
+    uint32_t clk_bad_hz;  /* Slowest speed seen over limit, 0 if none    */
+
+    struct profile profile; /* Learned response times */
+};
+
+struct se_gto_ctx;
+
+int state_set_file(struct se_gto_ctx *ctx, const char *value);
+int state_open(struct se_gto_ctx *ctx);
+void state_close(struct se_gto_ctx *ctx);
+void state_reset_begin(struct se_gto_ctx *ctx);
+void state_reset_done(struct se_gto_ctx *ctx);
+void state_channel(struct se_gto_ctx *ctx, int channel, int open);
+int state_resume(struct se_gto_ctx *ctx);
+
+#endif /* STATE_H */
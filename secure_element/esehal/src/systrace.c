@@ -0,0 +1,157 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Slices and counters on system trace timeline.
+ *
+ * APDU exchanges and T=1 phases are shown next to NFC stack and
+ * application activity in Perfetto or systrace. On Android, events go
+ * through atrace with HAL tag, and cost a flag check unless HAL tracing
+ * is enabled. On other Linux systems they are written to trace_marker of
+ * tracefs, in same text format, when it can be opened.
+ *
+ * Names must be the same for begin and end of an asynchronous slice.
+ *
+ */
+
+#ifdef __ANDROID__
+# define ATRACE_TAG ATRACE_TAG_HAL
+# include <cutils/trace.h>
+#else
+# include <fcntl.h>
+# include <pthread.h>
+# include <stdio.h>
+# include <unistd.h>
+#endif
+
+#include "systrace.h"
+
+#ifdef __ANDROID__
+
+int
+systrace_enabled(void)
+{
+    return ATRACE_ENABLED();
+}
+
+void
+systrace_begin(const char *name)
+{
+    ATRACE_BEGIN(name);
+}
+
+void
+systrace_end(void)
+{
+    ATRACE_END();
+}
+
+void
+systrace_async_begin(const char *name, int32_t cookie)
+{
+    ATRACE_ASYNC_BEGIN(name, cookie);
+}
+
+void
+systrace_async_end(const char *name, int32_t cookie)
+{
+    ATRACE_ASYNC_END(name, cookie);
+}
+
+void
+systrace_counter(const char *name, int32_t value)
+{
+    ATRACE_INT(name, value);
+}
+
+#else /* !__ANDROID__ */
+
+static pthread_once_t marker_once = PTHREAD_ONCE_INIT;
+static int            marker_fd   = -1;
+
+static void
+marker_open(void)
+{
+    marker_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (marker_fd < 0)
+        marker_fd = open("/sys/kernel/debug/tracing/trace_marker",
+                         O_WRONLY | O_CLOEXEC);
+}
+
+int
+systrace_enabled(void)
+{
+    pthread_once(&marker_once, marker_open);
+    return marker_fd >= 0;
+}
+
+/* Format of atrace: kind, pid, then name and value if any */
+static void
+marker_write(char kind, const char *name, int has_value, int32_t value)
+{
+    char buf[128];
+    int  n;
+
+    if (!systrace_enabled())
+        return;
+
+    if (!name)
+        n = snprintf(buf, sizeof(buf), "%c|%d", kind, getpid());
+    else if (!has_value)
+        n = snprintf(buf, sizeof(buf), "%c|%d|%s", kind, getpid(), name);
+    else
+        n = snprintf(buf, sizeof(buf), "%c|%d|%s|%d", kind, getpid(), name,
+                     value);
+    if (n >= (int)sizeof(buf))
+        n = sizeof(buf) - 1;
+    if (n > 0)
+        (void)write(marker_fd, buf, n);
+}
+
+void
+systrace_begin(const char *name)
+{
+    marker_write('B', name, 0, 0);
+}
+
+void
+systrace_end(void)
+{
+    marker_write('E', NULL, 0, 0);
+}
+
+void
+systrace_async_begin(const char *name, int32_t cookie)
+{
+    marker_write('S', name, 1, cookie);
+}
+
+void
+systrace_async_end(const char *name, int32_t cookie)
+{
+    marker_write('F', name, 1, cookie);
+}
+
+void
+systrace_counter(const char *name, int32_t value)
+{
+    marker_write('C', name, 1, value);
+}
+
+#endif /* __ANDROID__ */
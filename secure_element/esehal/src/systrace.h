@@ -0,0 +1,37 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Slices and counters on system trace timeline.
+ *
+ */
+
+#ifndef SYSTRACE_H
+#define SYSTRACE_H
+
+#include <stdint.h>
+
+int systrace_enabled(void);
+void systrace_begin(const char *name);
+void systrace_end(void);
+void systrace_async_begin(const char *name, int32_t cookie);
+void systrace_async_end(const char *name, int32_t cookie);
+void systrace_counter(const char *name, int32_t value);
+
+#endif /* SYSTRACE_H */
@@ -0,0 +1,263 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Binary trace of APDUs and T=1 blocks, in a file mapped as a ring.
+ *
+ * Each APDU and each block sent or received is one fixed size record:
+ * direction, NAD and PCB, length, timestamps and payload as configured.
+ * Nothing is formatted on the fly, so that trace may stay enabled. File is
+ * mapped shared, records are on disk even if HAL crashes, and a record
+ * sequence number is stored last so that decoder skips one written
+ * partially. With sampling, only one APDU exchange out of N is recorded
+ * with its blocks; blocks outside exchanges, such as resets, always are.
+ *
+ * Payload may be left out, or redacted to command header and status word,
+ * which is default. Only first TRACE_DATA_MAX bytes are kept.
+ *
+ * File is decoded offline by gto_trace tool.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libse-gto-private.h"
+#include "trace.h"
+
+static uint64_t
+trace_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+trace_set_file(struct se_gto_ctx *ctx, const char *value)
+{
+    size_t n = strcspn(value, " \t\r\n");
+
+    free(ctx->trace.file);
+    ctx->trace.file = NULL;
+    if (n == 0)
+        return 0;
+
+    ctx->trace.file = strndup(value, n);
+    return ctx->trace.file ? 0 : -ENOMEM;
+}
+
+int
+trace_set_payload(struct se_gto_ctx *ctx, const char *value)
+{
+    if (strncmp(value, "none", 4) == 0)
+        ctx->trace.payload = TRACE_PAYLOAD_NONE;
+    else if (strncmp(value, "redact", 6) == 0)
+        ctx->trace.payload = TRACE_PAYLOAD_REDACT;
+    else if (strncmp(value, "full", 4) == 0)
+        ctx->trace.payload = TRACE_PAYLOAD_FULL;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+int
+trace_open(struct se_gto_ctx *ctx)
+{
+    struct trace            *tr = &ctx->trace;
+    struct gto_trace_header *h;
+    size_t                   size;
+    int                      fd;
+
+    if (!tr->file || !tr->records)
+        return 0;
+
+    size = sizeof(*h) + (size_t)tr->records * sizeof(struct gto_trace_record);
+    fd   = open(tr->file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        warn("cannot open trace file %s, %s\n", tr->file, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, size) < 0) {
+        warn("cannot size trace file %s, %s\n", tr->file, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        warn("cannot map trace file %s, %s\n", tr->file, strerror(errno));
+        return -errno;
+    }
+
+    /* Ring of same geometry goes on after restart, to see what came before */
+    if ((h->magic != GTO_TRACE_MAGIC) || (h->version != GTO_TRACE_VERSION) ||
+        (h->record_size != sizeof(struct gto_trace_record)) ||
+        (h->records != tr->records)) {
+        memset(h, 0, size);
+        h->magic       = GTO_TRACE_MAGIC;
+        h->version     = GTO_TRACE_VERSION;
+        h->record_size = sizeof(struct gto_trace_record);
+        h->records     = tr->records;
+    }
+    h->sample      = tr->sample;
+    h->realtime_ns = (int64_t)(trace_now_ns(CLOCK_REALTIME) -
+                               trace_now_ns(CLOCK_MONOTONIC));
+
+    tr->map      = h;
+    tr->map_size = size;
+    ctx->t1.trace = tr;
+    return 0;
+}
+
+void
+trace_close(struct se_gto_ctx *ctx)
+{
+    struct trace *tr = &ctx->trace;
+
+    ctx->t1.trace = NULL;
+    if (tr->map)
+        munmap(tr->map, tr->map_size);
+    tr->map = NULL;
+    free(tr->file);
+    tr->file = NULL;
+}
+
+static struct gto_trace_record *
+trace_begin_record(struct trace *tr, int kind)
+{
+    struct gto_trace_header *h = tr->map;
+    struct gto_trace_record *rec;
+
+    rec = (struct gto_trace_record *)(h + 1) + h->head % h->records;
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memset(&rec->ts_ns, 0, sizeof(*rec) - sizeof(rec->seq));
+    rec->ts_ns = trace_now_ns(CLOCK_MONOTONIC);
+    rec->kind  = (uint8_t)kind;
+    rec->xid   = tr->xid;
+    return rec;
+}
+
+static void
+trace_end_record(struct trace *tr, struct gto_trace_record *rec)
+{
+    struct gto_trace_header *h = tr->map;
+
+    h->head++;
+    __atomic_store_n(&rec->seq, h->head, __ATOMIC_RELEASE);
+}
+
+static void
+trace_data(struct gto_trace_record *rec, const uint8_t *s, size_t n)
+{
+    if (n > TRACE_DATA_MAX)
+        n = TRACE_DATA_MAX;
+    memcpy(rec->data, s, n);
+    rec->data_length = (uint8_t)n;
+}
+
+/* Called with context lock held, before exchange */
+void
+trace_apdu_begin(struct se_gto_ctx *ctx, const uint8_t *apdu, int n)
+{
+    struct trace            *tr = &ctx->trace;
+    struct gto_trace_record *rec;
+
+    if (!tr->map)
+        return;
+
+    if (++tr->exchanges == 0)
+        tr->exchanges = 1;
+    tr->skip = (tr->sample > 1) && (tr->exchanges % tr->sample);
+    if (tr->skip) {
+        tr->map->skipped++;
+        return;
+    }
+    tr->xid = tr->exchanges;
+
+    rec = trace_begin_record(tr, TRACE_APDU_CMD);
+    tr->start_ns = rec->ts_ns;
+    rec->length  = (uint16_t)n;
+    if (tr->payload == TRACE_PAYLOAD_FULL)
+        trace_data(rec, apdu, n);
+    else if (tr->payload == TRACE_PAYLOAD_REDACT)
+        /* CLA INS P1 P2 only */
+        trace_data(rec, apdu, n < 4 ? n : 4);
+    trace_end_record(tr, rec);
+}
+
+void
+trace_apdu_end(struct se_gto_ctx *ctx, const uint8_t *resp, int r)
+{
+    struct trace            *tr = &ctx->trace;
+    struct gto_trace_record *rec;
+
+    if (!tr->map)
+        return;
+
+    if (!tr->skip) {
+        rec = trace_begin_record(tr, TRACE_APDU_RESP);
+        rec->dur_us = (uint32_t)((rec->ts_ns - tr->start_ns) / 1000);
+        rec->result = r;
+        if (r > 0) {
+            rec->length = (uint16_t)r;
+            if (tr->payload == TRACE_PAYLOAD_FULL)
+                trace_data(rec, resp, r);
+            else if ((tr->payload == TRACE_PAYLOAD_REDACT) && (r >= 2))
+                /* Status word only */
+                trace_data(rec, resp + r - 2, 2);
+        }
+        trace_end_record(tr, rec);
+    }
+    tr->xid  = 0;
+    tr->skip = 0;
+}
+
+/* Block as sent or read, checksum not verified */
+void
+trace_block(struct t1_state *t1, int kind, const uint8_t *buf, size_t n,
+            uint32_t dur_us)
+{
+    struct trace            *tr = t1->trace;
+    struct gto_trace_record *rec;
+    size_t                   hdr = t1_prologue_length(t1);
+
+    if (!tr || tr->skip || (n < hdr))
+        return;
+
+    rec = trace_begin_record(tr, kind);
+    rec->dur_us = dur_us;
+    rec->length = (uint16_t)n;
+    rec->nad    = buf[0];
+    rec->pcb    = buf[1];
+    if (tr->payload == TRACE_PAYLOAD_FULL)
+        trace_data(rec, buf, n);
+    else if (tr->payload == TRACE_PAYLOAD_REDACT)
+        /* I-BLOCK carry APDU, S-BLOCK only link parameters */
+        trace_data(rec, buf, ((buf[1] & 0xC0) == 0xC0) ? n : hdr);
+    trace_end_record(tr, rec);
+}
@@ -0,0 +1,101 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Binary trace of APDUs and T=1 blocks, in a file mapped as a ring.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GTO_TRACE_MAGIC   0x54475430 /* "TGT0" */
+#define GTO_TRACE_VERSION 1
+
+#define TRACE_DATA_MAX 28
+
+enum {
+    TRACE_APDU_CMD = 1,
+    TRACE_APDU_RESP,
+    TRACE_BLOCK_TX,
+    TRACE_BLOCK_RX,
+};
+
+enum { TRACE_PAYLOAD_NONE, TRACE_PAYLOAD_REDACT, TRACE_PAYLOAD_FULL };
+
+/* File starts with header, followed by records of ring */
+struct gto_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t records; /* Ring capacity */
+    uint32_t sample;  /* One exchange recorded out of that many */
+
+    uint64_t head;        /* Records ever written, next seq is head + 1 */
+    uint64_t skipped;     /* Exchanges not sampled                      */
+    int64_t  realtime_ns; /* CLOCK_REALTIME - CLOCK_MONOTONIC at open   */
+};
+
+/* Fixed size, seq written last so that a torn record is seen as such */
+struct gto_trace_record {
+    uint64_t seq;    /* From 1, 0 while record is written          */
+    uint64_t ts_ns;  /* CLOCK_MONOTONIC                             */
+    uint32_t xid;    /* Exchange, 0 for blocks outside APDU exchange */
+    uint32_t dur_us; /* Response: since command, block received: wait */
+    int32_t  result; /* Response: length or negative errno          */
+    uint16_t length; /* Full length, data may hold less             */
+    uint8_t  kind;   /* TRACE_APDU_CMD...                           */
+    uint8_t  pcb;    /* Blocks only, with NAD                       */
+    uint8_t  nad;
+    uint8_t  data_length;
+    uint8_t  pad[2];
+    uint8_t  data[TRACE_DATA_MAX];
+};
+
+struct trace {
+    char    *file;
+    unsigned records; /* Configured capacity */
+    unsigned sample;
+    uint8_t  payload;
+
+    struct gto_trace_header *map; /* NULL if not tracing */
+    size_t                   map_size;
+
+    uint32_t xid;       /* Exchange in progress, 0 if none    */
+    uint8_t  skip;      /* Exchange in progress not sampled   */
+    uint32_t exchanges; /* Number of last exchange, from 1     */
+    uint64_t start_ns;
+};
+
+struct se_gto_ctx;
+struct t1_state;
+
+int trace_set_file(struct se_gto_ctx *ctx, const char *value);
+int trace_set_payload(struct se_gto_ctx *ctx, const char *value);
+int trace_open(struct se_gto_ctx *ctx);
+void trace_close(struct se_gto_ctx *ctx);
+void trace_apdu_begin(struct se_gto_ctx *ctx, const uint8_t *apdu, int n);
+void trace_apdu_end(struct se_gto_ctx *ctx, const uint8_t *resp, int r);
+void trace_block(struct t1_state *t1, int kind, const uint8_t *buf, size_t n,
+                 uint32_t dur_us);
+
+#endif /* TRACE_H */
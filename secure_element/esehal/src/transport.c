@@ -27,16 +27,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 #include <time.h>
 
 #include "iso7816_t1.h"
 #include "transport.h"
+#include "bus.h"
+#include "probe.h"
 #include "spi.h"
+#include "trace.h"
 
 #define NSEC_PER_SEC  1000000000L
 #define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
 
-#define ESE_NAD 0x21
+#define WAIT_BACKOFF_MIN_NS (50 * NSEC_PER_USEC)
 
 /* < 0 if t1 < t2,
  * > 0 if t1 > t2,
@@ -76,6 +81,99 @@ ts_add_ns(const struct timespec ta, uint64_t ns)
     return ts;
 }
 
+static int64_t
+ts_diff_ns(const struct timespec *t1, const struct timespec *t0)
+{
+    return (int64_t)(t1->tv_sec - t0->tv_sec) * NSEC_PER_SEC +
+           (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* Account how late thread is running after sleep until ts */
+static void
+wait_jitter(struct t1_state *t1, const struct timespec *ts)
+{
+    struct t1_wait *w = &t1->wait;
+    struct timespec now;
+    int64_t         late;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = ts_diff_ns(&now, ts);
+    if (late < 0)
+        late = 0;
+
+    w->wakes++;
+    w->last_late_us = (uint32_t)(late / NSEC_PER_USEC);
+    w->late_us     += w->last_late_us;
+    if (w->last_late_us > w->late_max_us)
+        w->late_max_us = w->last_late_us;
+}
+
+/* Sleep until absolute time, on timerfd when available */
+static void
+wait_until(struct t1_state *t1, const struct timespec *ts)
+{
+    struct itimerspec its = { .it_interval = { 0, 0 }, .it_value = *ts };
+    uint64_t          expirations;
+
+    if (t1->wait.timer_fd < 0)
+        t1->wait.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if ((t1->wait.timer_fd >= 0) &&
+        (timerfd_settime(t1->wait.timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)) {
+        while (read(t1->wait.timer_fd, &expirations, sizeof(expirations)) < 0)
+            if (errno != EINTR)
+                break;
+    } else
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR)
+            ;
+
+    wait_jitter(t1, ts);
+}
+
+/* Time to wait before next poll, 0 to poll at once */
+static int64_t
+wait_interval(struct t1_state *t1, int64_t elapsed, int64_t *backoff)
+{
+    struct t1_wait *w = &t1->wait;
+    int64_t         interval;
+
+    if (w->strategy == T1_WAIT_FIXED)
+        return (int64_t)w->poll_us * NSEC_PER_USEC;
+
+    /* Hybrid: spin, then exponential backoff, then long sleep */
+    if (elapsed < (int64_t)w->spin_us * NSEC_PER_USEC)
+        return 0;
+    if (elapsed >= 10 * (int64_t)w->backoff_max_us * NSEC_PER_USEC)
+        return (int64_t)w->sleep_us * NSEC_PER_USEC;
+
+    interval = *backoff;
+    if (*backoff < (int64_t)w->backoff_max_us * NSEC_PER_USEC)
+        *backoff *= 2;
+    if (interval > (int64_t)w->backoff_max_us * NSEC_PER_USEC)
+        interval = (int64_t)w->backoff_max_us * NSEC_PER_USEC;
+    return interval;
+}
+
+static void
+wait_account(struct t1_state *t1, const struct timespec *start,
+             const struct timespec *end, uint32_t polls, int64_t last)
+{
+    struct t1_wait *w = &t1->wait;
+
+    w->blocks++;
+    w->polls         += polls;
+    w->last_polls     = polls;
+    w->last_wait_us   = (uint32_t)(ts_diff_ns(end, start) / NSEC_PER_USEC);
+    w->last_wasted_us = (uint32_t)(last / NSEC_PER_USEC);
+    w->wait_us       += w->last_wait_us;
+    w->wasted_us     += w->last_wasted_us;
+
+    T1_STAT_ADD(t1, polls, polls);
+    T1_STAT_ADD(t1, wait_ns, ts_diff_ns(end, start));
+    /* Every poll reads a byte */
+    T1_STAT_ADD(t1, bytes_rx, polls);
+}
+
 static int
 crc_length(struct t1_state *t1)
 {
@@ -87,19 +185,48 @@ crc_length(struct t1_state *t1)
             break;
 
         case CHECKSUM_CRC:
+        case CHECKSUM_CRC16:
             n = 2;
             break;
     }
     return n;
 }
 
+/* A turn is one block sent and card answer, bus is not shared meanwhile */
+void
+block_turn_begin(struct t1_state *t1)
+{
+    bus_turn_begin(t1->bus);
+}
+
+void
+block_turn_end(struct t1_state *t1)
+{
+    bus_turn_end(t1->bus);
+}
+
 int
 block_send(struct t1_state *t1, const void *block, size_t n)
 {
+    struct timespec start, end;
+    int             r;
+
     if (n < 4)
         return -EINVAL;
 
-    return spi_write(t1->spi_fd, block, n);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    r = spi_write(t1->spi_fd, block, n);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    T1_STAT_ADD(t1, send_ns, ts_diff_ns(&end, &start));
+    if (r >= 0) {
+        GTO_PROBE3(block_send, ((const uint8_t *)block)[0],
+                   ((const uint8_t *)block)[1], n);
+        T1_STAT_ADD(t1, blocks_tx, 1);
+        T1_STAT_ADD(t1, bytes_tx, n);
+        trace_block(t1, TRACE_BLOCK_TX, block, n, 0);
+    }
+    return r;
 }
 
 int
@@ -107,11 +234,14 @@ block_recv(struct t1_state *t1, void *block, size_t n)
 {
     uint8_t  c;
     int      fd;
-    uint8_t *s, i;
-    int      len, max;
+    uint8_t *s;
+    int      len, max, hdr;
     long     bwt;
 
-    struct timespec ts, ts_timeout;
+    struct timespec start, ts, ts_timeout, end;
+    int64_t         interval = 0, backoff = WAIT_BACKOFF_MIN_NS, hint = 0;
+    uint32_t        polls    = 0;
+    uint8_t         first    = t1->wait.first;
 
     if (n < 4)
         return -EINVAL;
@@ -119,50 +249,81 @@ block_recv(struct t1_state *t1, void *block, size_t n)
     fd = t1->spi_fd;
     s  = block;
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     bwt     = t1->bwt * (t1->wtx ? t1->wtx : 1);
     t1->wtx = 1;
 
-    ts_timeout = ts_add_ns(ts, bwt * NSEC_PER_MSEC);
+    ts_timeout = ts_add_ns(start, bwt * NSEC_PER_MSEC);
 
-    /* Pull every 2ms */
-    i = 0;
-    do {
-        /* Wait for 2ms */
-        ts = ts_add_ns(ts, 2 * NSEC_PER_MSEC);
-        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
-            if  (errno != EINTR)
-                break;
+    /* First poll of APDU response when it is expected */
+    if (first)
+        hint = (int64_t)t1->wait.hint_us * NSEC_PER_USEC;
+    t1->wait.first   = 0;
+    t1->wait.hint_us = 0;
 
+    /* Poll on absolute schedule, as set by wait strategy */
+    ts = start;
+    do {
+        if (hint > 0)
+            interval = hint, hint = -1;
+        else if ((hint < 0) && (t1->wait.strategy == T1_WAIT_FIXED) &&
+                 (backoff < (int64_t)t1->wait.poll_us * NSEC_PER_USEC))
+            /* Missed expected time, response is close: poll finely */
+            interval = backoff, backoff *= 2;
+        else
+            interval = wait_interval(t1, ts_diff_ns(&ts, &start), &backoff);
+        if (interval) {
+            ts = ts_add_ns(ts, interval);
+            if (ts_compare(&ts, &ts_timeout) > 0)
+                ts = ts_timeout;
+            wait_until(t1, &ts);
+        } else
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        polls++;
         len = spi_read(fd, &c, 1);
         if (len < 0)
             return len;
 
-        if (ts_compare(&ts, &ts_timeout) >= 0)
+        if (ts_compare(&ts, &ts_timeout) >= 0) {
+            wait_account(t1, &start, &ts, polls, 0);
             return -ETIMEDOUT;
-    } while (c != ESE_NAD);
+        }
+    } while (c != t1->nadc);
 
-    s[i++] = c;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    wait_account(t1, &start, &ts, polls, interval);
+    if (first)
+        t1->wait.first_wait_us = t1->wait.last_wait_us;
 
-    /* Minimal length is 3 + sizeof(checksum) */
-    max = 2 + crc_length(t1);
-    len = spi_read(fd, s + 1, max);
+    s[0] = c;
+
+    /* Minimal length is prologue + sizeof(checksum) */
+    hdr = (int)t1_prologue_length(t1) + crc_length(t1);
+    len = spi_read(fd, s + 1, hdr - 1);
     if (len < 0)
         return len;
 
-    i += len;
-
     /* verify that buffer is large enough. */
-    max += s[2];
+    max = hdr + (int)t1_block_length(t1, s);
     if ((size_t)max > n)
         return -ENOMEM;
 
-    /* get block remaining if present */
-    if (s[2]) {
-        len = spi_read(fd, s + 4, s[2]);
+    /* get block remaining if present, after what was read already */
+    if (max > hdr) {
+        len = spi_read(fd, s + hdr, max - hdr);
         if (len < 0)
             return len;
     }
 
-    return max + 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    T1_STAT_ADD(t1, read_ns, ts_diff_ns(&end, &ts));
+    T1_STAT_ADD(t1, blocks_rx, 1);
+    /* NAD already counted with polls */
+    T1_STAT_ADD(t1, bytes_rx, max - 1);
+
+    GTO_PROBE4(block_recv, s[0], s[1], max, t1->wait.last_wait_us);
+
+    trace_block(t1, TRACE_BLOCK_RX, s, max, t1->wait.last_wait_us);
+    return max;
 }
@@ -31,5 +31,7 @@ int transport_setup(struct se_gto_ctx *ctx);
 int transport_teardown(struct se_gto_ctx *ctx);
 int block_send(struct t1_state *t1, const void *block, size_t n);
 int block_recv(struct t1_state *t1, void *block, size_t n);
+void block_turn_begin(struct t1_state *t1);
+void block_turn_end(struct t1_state *t1);
 
 #endif /* TRANSPORT_H */
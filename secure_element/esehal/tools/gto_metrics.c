@@ -0,0 +1,215 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Reader of metrics page published with GTO_METRICS_FILE.
+ *
+ * Usage: gto_metrics [-i MS] [-n COUNT] FILE
+ *
+ * Page is mapped read-only and sampled every MS milliseconds (1000 by
+ * default), COUNT times or forever. For each interval, changes of protocol
+ * counters are printed, followed by percentiles of operations completed
+ * during the interval, computed from histogram differences. HAL is never
+ * called.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static const char *const op_names[SE_GTO_OP_COUNT] = {
+    [SE_GTO_OP_TRANSMIT]             = "transmit",
+    [SE_GTO_OP_OPEN_LOGICAL_CHANNEL] = "openLogicalChannel",
+    [SE_GTO_OP_OPEN_BASIC_CHANNEL]   = "openBasicChannel",
+    [SE_GTO_OP_CLOSE_CHANNEL]        = "closeChannel",
+    [SE_GTO_OP_RESET]                = "reset",
+};
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-i MS] [-n COUNT] FILE\n", name);
+    exit(2);
+}
+
+/* Consistent copy of page, 0 if page is not valid */
+static int
+metrics_read(const struct gto_metrics_page *map, struct gto_metrics_page *p)
+{
+    uint32_t seq;
+
+    for (int tries = 0;; tries++) {
+        seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            memcpy(p, map, sizeof(*p));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq)
+                break;
+        }
+        /* Writer was preempted, let it finish */
+        if (tries > 100)
+            usleep(100);
+    }
+
+    return (p->magic == GTO_METRICS_MAGIC) &&
+           (p->version == GTO_METRICS_VERSION) && (p->size == sizeof(*p));
+}
+
+/* Value under which lie per10k / 10000 of samples of bucket differences */
+static uint32_t
+delta_percentile(const struct latency_histo *h, const struct latency_histo *h0,
+                 uint64_t count, unsigned per10k)
+{
+    uint64_t rank = (count * per10k + 9999) / 10000, seen = 0;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->bucket[b] - h0->bucket[b];
+        if (seen >= rank)
+            return latency_bucket_max(b);
+    }
+    return latency_bucket_max(LATENCY_BUCKETS - 1);
+}
+
+static void
+print_time(const struct gto_metrics_page *p)
+{
+    uint64_t  ns = p->ts_ns + p->realtime_ns;
+    time_t    t  = (time_t)(ns / 1000000000ULL);
+    struct tm tm;
+    char      s[32];
+
+    localtime_r(&t, &tm);
+    strftime(s, sizeof(s), "%H:%M:%S", &tm);
+    printf("%s.%03u", s, (unsigned)(ns % 1000000000ULL / 1000000));
+}
+
+#define DELTA(field) ((unsigned long long)(p->field - p0->field))
+
+static void
+print_delta(const struct gto_metrics_page *p, const struct gto_metrics_page *p0)
+{
+    print_time(p);
+    printf(" %llu exchanges, %llu/%llu bytes, %llu polls, %llu WTX, "
+           "%llu retransmits, %llu checksum errors, %llu resyncs, "
+           "%llu resets, %u channels\n",
+           DELTA(transceives), DELTA(total.bytes_tx), DELTA(total.bytes_rx),
+           DELTA(total.polls), DELTA(total.wtx), DELTA(total.retransmits),
+           DELTA(total.chk_errors), DELTA(total.resyncs), DELTA(total.resets),
+           p->channels_open);
+    printf("  send %llu us, wait %llu us, read %llu us, health %llu probes, "
+           "%llu recoveries\n",
+           DELTA(total.send_us), DELTA(total.wait_us), DELTA(total.read_us),
+           DELTA(health.probes), DELTA(health.recoveries));
+
+    for (int i = 0; i < SE_GTO_OP_COUNT; i++) {
+        const struct latency_histo *h  = &p->op[i];
+        const struct latency_histo *h0 = &p0->op[i];
+        uint64_t                    count = 0;
+
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            count += h->bucket[b] - h0->bucket[b];
+        if (!count)
+            continue;
+
+        printf("  %-18s %6llu  mean %6llu  p50 %6u  p90 %6u  p99 %6u  "
+               "p99.9 %6u us\n",
+               op_names[i], (unsigned long long)count,
+               (unsigned long long)((h->sum_us - h0->sum_us) / count),
+               delta_percentile(h, h0, count, 5000),
+               delta_percentile(h, h0, count, 9000),
+               delta_percentile(h, h0, count, 9900),
+               delta_percentile(h, h0, count, 9990));
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct gto_metrics_page page[2];
+    const struct gto_metrics_page *map;
+    unsigned long                  interval_ms = 1000, count = 0;
+    int                            c, fd, cur = 0;
+
+    while ((c = getopt(argc, argv, "i:n:")) != -1) {
+        switch (c) {
+            case 'i':
+                interval_ms = strtoul(optarg, NULL, 0);
+                if (!interval_ms)
+                    usage(argv[0]);
+                break;
+
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    map = mmap(NULL, sizeof(*map), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if (!metrics_read(map, &page[cur])) {
+        fprintf(stderr, "%s: not a metrics page\n", argv[optind]);
+        return 1;
+    }
+    printf("# pid %u, %llu exchanges since start\n", page[cur].pid,
+           (unsigned long long)page[cur].transceives);
+
+    for (unsigned long n = 0; !count || (n < count); n++) {
+        const struct gto_metrics_page *p0 = &page[cur];
+
+        usleep(interval_ms * 1000);
+        /* Former copy stays the baseline until a read succeeds */
+        if (!metrics_read(map, &page[cur ^ 1]))
+            continue;
+        cur ^= 1;
+
+        /* HAL restarted, counters start again */
+        if ((page[cur].pid != p0->pid) || (page[cur].updates < p0->updates)) {
+            printf("# pid %u, restarted\n", page[cur].pid);
+            continue;
+        }
+        print_delta(&page[cur], p0);
+    }
+
+    munmap((void *)map, sizeof(*map));
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Replay of a trace written with GTO_TRACE_FILE against simulated card.
+ *
+ * Usage: gto_replay [-s SPEED] [-o KEY=VALUE]... FILE
+ *
+ * Each APDU exchange of trace is sent again through libse-gto, at same
+ * time offset from start as recorded, divided by SPEED (0 for back to
+ * back). Command has recorded length and header, response has recorded
+ * length and status word. Simulated card takes as long to answer as real
+ * one did: the time its blocks were waited for, from last command block
+ * to first response block, WTX included. Polling granularity of recorded
+ * HAL is thus part of card time.
+ *
+ * As bus transfers take no time in simulation, what exceeds card time is
+ * host side overhead: library, scheduling and wait strategy. Options -o are
+ * passed to se_gto_set_config(), so that settings can be compared on same
+ * workload. Exchanges that failed in trace are not replayed.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <se-gto/libse-gto.h>
+#include "simcard.h"
+#include "trace_file.h"
+
+struct exchange {
+    uint64_t ts_ns;
+    uint32_t cmd_length;
+    uint8_t  header[4];
+    uint32_t recorded_us; /* Whole exchange, as recorded */
+
+    struct simcard_answer answer;
+};
+
+static uint8_t apdu[65536 + 9];
+static uint8_t resp[65536 + 2];
+
+/* Exchanges with their card time, from records of one exchange */
+static size_t
+collect(const struct trace_file *tf, struct exchange *ex, size_t *failed)
+{
+    struct exchange *x    = NULL;
+    size_t           n    = 0;
+    int              sent = 0; /* Last command block sent */
+
+    for (size_t i = 0; i < tf->n; i++) {
+        const struct gto_trace_record *r = tf->order[i];
+
+        if (!r->xid)
+            continue;
+
+        if (r->kind == TRACE_APDU_CMD) {
+            x = &ex[n];
+            memset(x, 0, sizeof(*x));
+            x->ts_ns      = r->ts_ns;
+            x->cmd_length = r->length;
+            memcpy(x->header, r->data, r->data_length < 4 ? r->data_length : 4);
+            sent = 0;
+        } else if (!x)
+            continue;
+        else if (r->kind == TRACE_BLOCK_TX) {
+            /* I-BLOCK without more bit ends command. WTX responses and
+             * R-BLOCKs sent while waiting leave card time running.
+             */
+            if ((r->pcb & 0x80) == 0)
+                sent = (r->pcb & 0x20) == 0;
+        } else if ((r->kind == TRACE_BLOCK_RX) && sent) {
+            x->answer.busy_us += r->dur_us;
+            if ((r->pcb & 0x80) == 0)
+                sent = 0;
+        } else if (r->kind == TRACE_APDU_RESP) {
+            if (r->result < 0) {
+                (*failed)++;
+                x = NULL;
+                continue;
+            }
+            x->recorded_us        = r->dur_us;
+            x->answer.resp_length = r->length;
+            x->answer.sw[0]       = 0x90;
+            /* Redacted to status word, or full and short enough */
+            if ((r->data_length == 2) ||
+                ((r->data_length >= 2) && (r->data_length == r->length)))
+                memcpy(x->answer.sw, r->data + r->data_length - 2, 2);
+            n++;
+            x = NULL;
+        }
+    }
+    return n;
+}
+
+/* ATR from RESET response if its content was kept */
+static void
+collect_atr(const struct trace_file *tf)
+{
+    for (size_t i = tf->n; i-- > 0;) {
+        const struct gto_trace_record *r = tf->order[i];
+
+        if ((r->kind == TRACE_BLOCK_RX) && (r->pcb == 0xE5) &&
+            (r->data_length >= 4) && (r->data_length >= 4 + r->data[2])) {
+            simcard_set_atr(r->data + 3, r->data[2]);
+            return;
+        }
+    }
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+print_stats(const char *what, int64_t *v, size_t n)
+{
+    int64_t sum = 0;
+
+    if (!n)
+        return;
+    qsort(v, n, sizeof(*v), cmp_i64);
+    for (size_t i = 0; i < n; i++)
+        sum += v[i];
+    printf("%-24s mean %8lld  p50 %8lld  p99 %8lld  max %8lld us\n", what,
+           (long long)(sum / (int64_t)n), (long long)v[n / 2],
+           (long long)v[n * 99 / 100], (long long)v[n - 1]);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s SPEED] [-o KEY=VALUE]... FILE\n", name);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct se_gto_ctx *ctx;
+    struct trace_file  tf;
+    struct exchange   *ex;
+    int64_t           *recorded, *replayed, *overhead, *late;
+    int64_t            t0, target, start, d;
+    double             speed  = 1.0;
+    size_t             n, failed = 0, errors = 0;
+    uint8_t            atr[32];
+    char              *eq;
+    int                c, r;
+
+    if (se_gto_new(&ctx) < 0)
+        return 1;
+    se_gto_set_log_level(ctx, 2);
+
+    while ((c = getopt(argc, argv, "s:o:")) != -1) {
+        switch (c) {
+            case 's':
+                speed = atof(optarg);
+                break;
+
+            case 'o':
+                eq = strchr(optarg, '=');
+                if (!eq)
+                    usage(argv[0]);
+                *eq = 0;
+                if (se_gto_set_config(ctx, optarg, eq + 1) < 0) {
+                    fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                    return 2;
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        usage(argv[0]);
+
+    if (trace_file_load(&tf, argv[optind]) < 0)
+        return 1;
+
+    ex       = calloc(tf.n ? tf.n : 1, sizeof(*ex));
+    recorded = calloc(tf.n ? tf.n : 1, sizeof(*recorded));
+    replayed = calloc(tf.n ? tf.n : 1, sizeof(*replayed));
+    overhead = calloc(tf.n ? tf.n : 1, sizeof(*overhead));
+    late     = calloc(tf.n ? tf.n : 1, sizeof(*late));
+    if (!ex || !recorded || !replayed || !overhead || !late)
+        return 1;
+
+    n = collect(&tf, ex, &failed);
+    collect_atr(&tf);
+    printf("# %zu exchanges to replay, %zu failed in trace not replayed\n",
+           n, failed);
+    if (!n)
+        return 0;
+
+    se_gto_set_gtodev(ctx, "simcard");
+    if ((se_gto_open(ctx) < 0) || (se_gto_reset(ctx, atr, sizeof(atr)) < 0)) {
+        fprintf(stderr, "cannot start simulated card\n");
+        return 1;
+    }
+
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        struct exchange *x   = &ex[i];
+        size_t           len = x->cmd_length;
+
+        /* Open loop: recorded arrivals, whatever previous exchange took */
+        if (speed > 0) {
+            target = t0 + (int64_t)((x->ts_ns - ex[0].ts_ns) / speed);
+            d      = target - now_ns();
+            if (d > 0) {
+                struct timespec ts = { d / 1000000000LL, d % 1000000000LL };
+                nanosleep(&ts, NULL);
+            }
+            late[i] = (now_ns() - target) / 1000;
+        }
+
+        if (len < 4)
+            len = 4;
+        if (len > sizeof(apdu))
+            len = sizeof(apdu);
+        memset(apdu, 0, len);
+        memcpy(apdu, x->header, 4);
+
+        simcard_answer(&x->answer);
+        start = now_ns();
+        r     = se_gto_apdu_transmit(ctx, apdu, (int)len, resp, sizeof(resp));
+        d     = (now_ns() - start) / 1000;
+        if (r < 0)
+            errors++;
+
+        recorded[i] = x->recorded_us;
+        replayed[i] = d;
+        overhead[i] = d - x->answer.busy_us;
+    }
+
+    printf("# replayed in %.3f s, %zu errors\n", (now_ns() - t0) / 1e9, errors);
+    print_stats("recorded exchange", recorded, n);
+    print_stats("replayed exchange", replayed, n);
+    print_stats("host overhead", overhead, n);
+    if (speed > 0)
+        print_stats("start lateness", late, n);
+
+    se_gto_close(ctx);
+    trace_file_free(&tf);
+    return 0;
+}
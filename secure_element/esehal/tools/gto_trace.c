@@ -0,0 +1,147 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Decoder of trace file written with GTO_TRACE_FILE.
+ *
+ * Usage: gto_trace FILE
+ *
+ * Records are printed oldest first, one per line, with wall clock time,
+ * exchange number, direction and decoded PCB. A record written partially
+ * when HAL died is skipped.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace_file.h"
+
+static const char *const s_names[16] = {
+    [0x00] = "RESYNCH", [0x01] = "IFS",   [0x02] = "ABORT",   [0x03] = "WTX",
+    [0x04] = "CIP",     [0x05] = "RESET", [0x06] = "RELEASE", [0x0F] = "SWR",
+};
+
+static void
+print_time(const struct gto_trace_header *h, uint64_t ts_ns)
+{
+    uint64_t  ns = ts_ns + h->realtime_ns;
+    time_t    t  = (time_t)(ns / 1000000000ULL);
+    struct tm tm;
+    char      s[32];
+
+    localtime_r(&t, &tm);
+    strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u", s, (unsigned)(ns % 1000000000ULL / 1000));
+}
+
+static void
+print_pcb(uint8_t pcb)
+{
+    const char *name;
+
+    if ((pcb & 0x80) == 0)
+        printf("I(%u%s)", (pcb >> 6) & 1, (pcb & 0x20) ? ",M" : "");
+    else if ((pcb & 0x40) == 0)
+        printf("R(%u)%s", (pcb >> 4) & 1,
+               (pcb & 0x0F) == 1 ? " checksum error" :
+               (pcb & 0x0F) ? " error" : "");
+    else {
+        name = s_names[pcb & 0x0F];
+        if ((pcb & 0x10) || !name)
+            printf("S(%02X)", pcb);
+        else
+            printf("S(%s %s)", name, (pcb & 0x20) ? "response" : "request");
+    }
+}
+
+static void
+print_record(const struct gto_trace_header *h, const struct gto_trace_record *r)
+{
+    printf("%8llu ", (unsigned long long)r->seq);
+    print_time(h, r->ts_ns);
+    if (r->xid)
+        printf(" #%-6u ", r->xid);
+    else
+        printf("  %-6s ", "-");
+
+    switch (r->kind) {
+        case TRACE_APDU_CMD:
+            printf(">> APDU %u bytes", r->length);
+            break;
+
+        case TRACE_APDU_RESP:
+            if (r->result < 0)
+                printf("<< APDU failed, %s", strerror(-r->result));
+            else
+                printf("<< APDU %u bytes", r->length);
+            printf(" in %uus", r->dur_us);
+            break;
+
+        case TRACE_BLOCK_TX:
+        case TRACE_BLOCK_RX:
+            printf("%s %02X ", r->kind == TRACE_BLOCK_TX ? "->" : "<-", r->nad);
+            print_pcb(r->pcb);
+            printf(" %u bytes", r->length);
+            if (r->kind == TRACE_BLOCK_RX)
+                printf(" after %uus", r->dur_us);
+            break;
+
+        default:
+            printf("?? kind %u", r->kind);
+            break;
+    }
+
+    if (r->data_length) {
+        printf(" ");
+        for (int i = 0; i < r->data_length && i < TRACE_DATA_MAX; i++)
+            printf("%02X", r->data[i]);
+        if (r->data_length < r->length)
+            printf("..");
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct trace_file        tf;
+    struct gto_trace_header *h;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 2;
+    }
+
+    if (trace_file_load(&tf, argv[1]) < 0)
+        return 1;
+    h = tf.h;
+
+    printf("# %u records in ring, %llu written, sampling 1/%u, "
+           "%llu exchanges skipped\n", h->records,
+           (unsigned long long)h->head, h->sample ? h->sample : 1,
+           (unsigned long long)h->skipped);
+
+    for (size_t i = 0; i < tf.n; i++)
+        print_record(h, tf.order[i]);
+
+    trace_file_free(&tf);
+    return 0;
+}
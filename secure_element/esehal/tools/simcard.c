@@ -0,0 +1,275 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Simulated Secure Element behind SPI, for replay of traces.
+ *
+ * Replaces spi.c: library under test is unchanged above SPI read and
+ * write. Card speaks ISO7816 T=1 with LRC as the real one does after
+ * reset: RESET, RESYNCH, IFS and ABORT requests, chaining both ways and
+ * retransmission. Bus transfers take no time, card is only busy while it
+ * processes a command, for time set by simcard_answer(). Until then, it
+ * answers polls with zeroes, and asks for more time with WTX when that is
+ * long, as real card does.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "libse-gto-private.h"
+#include "spi.h"
+#include "simcard.h"
+
+#define SIM_WTX_AFTER_NS (100 * 1000000LL) /* Well within default BWT */
+
+static struct {
+    uint8_t atr[32];
+    uint8_t atr_length;
+    uint8_t ifsc; /* Announced in ATR */
+    uint8_t ifsd; /* Set by host      */
+    uint8_t ns;   /* N(S) of next I-BLOCK sent     */
+    uint8_t nr;   /* N(S) of next I-BLOCK expected */
+
+    struct simcard_answer answer;
+
+    uint8_t  resp[65536 + 2];
+    uint32_t resp_length;
+    uint32_t resp_pos;  /* Acknowledged so far                */
+    uint32_t chunk;     /* Size of last I-BLOCK sent          */
+    uint8_t  busy;      /* Command received, answer not ready */
+    int64_t  ready_ns;  /* End of processing                  */
+
+    /* Block waiting for host to read it */
+    uint8_t out[3 + 254 + 1];
+    size_t  out_length;
+    size_t  out_pos;
+    int64_t out_ns; /* Not visible before */
+} sim = {
+    .atr        = { 0x80, 0x81, 0x11, 0xFE, 0xEE },
+    .atr_length = 5,
+    .ifsc       = 0xFE,
+    .ifsd       = 32,
+    .answer     = { 0, 2, { 0x90, 0x00 } },
+};
+
+static int64_t
+sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t
+sim_lrc(const uint8_t *s, size_t n)
+{
+    uint8_t c = 0;
+
+    while (n--)
+        c ^= *s++;
+    return c;
+}
+
+static void
+sim_emit(uint8_t pcb, const uint8_t *inf, size_t n, int64_t at_ns)
+{
+    sim.out[0] = 0x21;
+    sim.out[1] = pcb;
+    sim.out[2] = (uint8_t)n;
+    if (n)
+        memcpy(sim.out + 3, inf, n);
+    sim.out[3 + n] = sim_lrc(sim.out, 3 + n);
+    sim.out_length = 4 + n;
+    sim.out_pos    = 0;
+    sim.out_ns     = at_ns;
+}
+
+/* Next response block, or WTX request while still busy */
+static void
+sim_respond(int64_t now)
+{
+    uint8_t  wtx = 1;
+    uint32_t n;
+    uint8_t  pcb;
+
+    if (sim.busy && (sim.ready_ns - now > SIM_WTX_AFTER_NS)) {
+        sim_emit(0xC3, &wtx, 1, now + SIM_WTX_AFTER_NS);
+        return;
+    }
+
+    n   = sim.resp_length - sim.resp_pos;
+    pcb = sim.ns ? 0x40 : 0;
+    if (n > sim.ifsd)
+        n = sim.ifsd, pcb |= 0x20;
+    sim_emit(pcb, sim.resp + sim.resp_pos, n, sim.busy ? sim.ready_ns : now);
+    sim.chunk = n;
+    sim.ns ^= 1;
+    sim.busy = 0;
+}
+
+static void
+sim_command(int64_t now)
+{
+    struct simcard_answer *a = &sim.answer;
+
+    sim.resp_length = a->resp_length < 2 ? 2 : a->resp_length;
+    if (sim.resp_length > sizeof(sim.resp))
+        sim.resp_length = sizeof(sim.resp);
+    memset(sim.resp, 0, sim.resp_length - 2);
+    memcpy(sim.resp + sim.resp_length - 2, a->sw, 2);
+    sim.resp_pos = 0;
+    sim.chunk    = 0;
+    sim.busy     = 1;
+    sim.ready_ns = now + a->busy_us * 1000LL;
+    sim_respond(now);
+}
+
+void
+simcard_set_atr(const uint8_t *atr, size_t n)
+{
+    if (n > sizeof(sim.atr))
+        n = sizeof(sim.atr);
+    memcpy(sim.atr, atr, n);
+    sim.atr_length = (uint8_t)n;
+}
+
+void
+simcard_answer(const struct simcard_answer *a)
+{
+    sim.answer = *a;
+}
+
+int
+spi_setup(struct se_gto_ctx *ctx)
+{
+    ctx->t1.spi_fd = 0;
+    return 0;
+}
+
+int
+spi_teardown(struct se_gto_ctx *ctx)
+{
+    ctx->t1.spi_fd = -1;
+    return 0;
+}
+
+int
+spi_write(int fd, const void *buf, size_t count)
+{
+    const uint8_t *b   = buf;
+    int64_t        now = sim_now_ns();
+    uint8_t        pcb, len;
+
+    (void)fd;
+    if ((count < 4) || ((size_t)b[2] + 4 != count) ||
+        (sim_lrc(b, count - 1) != b[count - 1])) {
+        sim_emit(0x81 | (sim.nr << 4), NULL, 0, now);
+        return (int)count;
+    }
+    pcb = b[1];
+    len = b[2];
+
+    if ((pcb & 0xC0) == 0xC0) {
+        switch (pcb & 0x3F) {
+            case 0x05: /* RESET */
+                sim.ns = sim.nr = 0;
+                sim.ifsd = 32;
+                sim.busy = 0;
+                sim_emit(0xE5, sim.atr, sim.atr_length, now);
+                break;
+
+            case 0x00: /* RESYNCH */
+                sim.ns = sim.nr = 0;
+                sim_emit(0xE0, NULL, 0, now);
+                break;
+
+            case 0x01: /* IFS */
+                if (len == 1)
+                    sim.ifsd = b[3];
+                sim_emit(0xE1, b + 3, len, now);
+                break;
+
+            case 0x02: /* ABORT */
+                sim.busy        = 0;
+                sim.resp_length = sim.resp_pos = 0;
+                sim_emit(0xE2, NULL, 0, now);
+                break;
+
+            case 0x23: /* WTX response */
+                sim_respond(now);
+                break;
+
+            default:
+                sim_emit(0x82 | (sim.nr << 4), NULL, 0, now);
+                break;
+        }
+    } else if ((pcb & 0xC0) == 0x80) {
+        if ((pcb & 0x0F) || (!!(pcb & 0x10) != sim.ns))
+            /* Error, or last block not acknowledged: send it again */
+            sim.out_pos = 0, sim.out_ns = now;
+        else if (sim.resp_pos + sim.chunk < sim.resp_length) {
+            /* Next block of chained response */
+            sim.resp_pos += sim.chunk;
+            sim_respond(now);
+        }
+    } else {
+        if (!!(pcb & 0x40) == sim.nr) {
+            sim.nr ^= 1;
+            if (pcb & 0x20)
+                sim_emit(0x80 | (sim.nr << 4), NULL, 0, now);
+            else
+                sim_command(now);
+        } else
+            /* Already seen, acknowledgement was lost */
+            sim.out_pos = 0, sim.out_ns = now;
+    }
+    return (int)count;
+}
+
+int
+spi_read(int fd, void *buf, size_t count)
+{
+    uint8_t *b = buf;
+
+    (void)fd;
+    if (sim_now_ns() < sim.out_ns) {
+        memset(b, 0, count);
+        return (int)count;
+    }
+    for (size_t i = 0; i < count; i++)
+        b[i] = (sim.out_pos < sim.out_length) ? sim.out[sim.out_pos++] : 0;
+    return (int)count;
+}
+
+int
+spi_get_clock(int fd, uint32_t *hz)
+{
+    (void)fd, (void)hz;
+    return -ENOTTY;
+}
+
+int
+spi_set_clock(int fd, uint32_t hz)
+{
+    (void)fd, (void)hz;
+    return -ENOTTY;
+}
@@ -0,0 +1,41 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Simulated Secure Element behind SPI, for replay of traces.
+ *
+ */
+
+#ifndef SIMCARD_H
+#define SIMCARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What card does on next command */
+struct simcard_answer {
+    uint32_t busy_us;     /* From last command block to first answer */
+    uint32_t resp_length; /* Status word included                    */
+    uint8_t  sw[2];
+};
+
+void simcard_set_atr(const uint8_t *atr, size_t n);
+void simcard_answer(const struct simcard_answer *a);
+
+#endif /* SIMCARD_H */
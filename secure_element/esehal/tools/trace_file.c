@@ -0,0 +1,103 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Loading of trace file written with GTO_TRACE_FILE, for tools.
+ *
+ * Whole file is read, then records whose slot matches their sequence
+ * number are sorted. Others were written partially when HAL died, or are
+ * left from a ring of another size.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_file.h"
+
+static int
+by_seq(const void *a, const void *b)
+{
+    const struct gto_trace_record *ra = *(const struct gto_trace_record *const *)a;
+    const struct gto_trace_record *rb = *(const struct gto_trace_record *const *)b;
+
+    return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+/* 0 on success, message printed otherwise */
+int
+trace_file_load(struct trace_file *tf, const char *path)
+{
+    const struct gto_trace_record *recs;
+    struct gto_trace_header       *h;
+    FILE                          *f;
+    long                           size;
+
+    memset(tf, 0, sizeof(*tf));
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    h = malloc(size > 0 ? size : 1);
+    if (!h || (size < (long)sizeof(*h)) || (fread(h, size, 1, f) != 1)) {
+        fprintf(stderr, "%s: cannot read trace\n", path);
+        fclose(f);
+        free(h);
+        return -EIO;
+    }
+    fclose(f);
+
+    if ((h->magic != GTO_TRACE_MAGIC) || (h->version != GTO_TRACE_VERSION) ||
+        (h->record_size != sizeof(struct gto_trace_record)) ||
+        (sizeof(*h) + (size_t)h->records * h->record_size > (size_t)size)) {
+        fprintf(stderr, "%s: not a trace of version %u\n", path,
+                GTO_TRACE_VERSION);
+        free(h);
+        return -EINVAL;
+    }
+
+    tf->h     = h;
+    tf->order = calloc(h->records ? h->records : 1, sizeof(*tf->order));
+    if (!tf->order) {
+        trace_file_free(tf);
+        return -ENOMEM;
+    }
+
+    recs = (const struct gto_trace_record *)(h + 1);
+    for (uint32_t i = 0; i < h->records; i++)
+        if (recs[i].seq && ((recs[i].seq - 1) % h->records == i))
+            tf->order[tf->n++] = &recs[i];
+    qsort(tf->order, tf->n, sizeof(*tf->order), by_seq);
+    return 0;
+}
+
+void
+trace_file_free(struct trace_file *tf)
+{
+    free(tf->order);
+    free(tf->h);
+    memset(tf, 0, sizeof(*tf));
+}
@@ -0,0 +1,41 @@
+/*****************************************************************************
+ * Copyright ©2017-2019 Gemalto – a Thales Company. All rights Reserved.
+ *
+ * This copy is licensed under the Apache License, Version 2.0 (the "License");
+ * You may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *     http://www.apache.org/licenses/LICENSE-2.0 or https://www.apache.org/licenses/LICENSE-2.0.html
+ *
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and limitations under the License.
+
+ ****************************************************************************/
+
+
+/**
+ * @file
+ * $Author$
+ * $Revision$
+ * $Date$
+ *
+ * Loading of trace file written with GTO_TRACE_FILE, for tools.
+ *
+ */
+
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+#include <stddef.h>
+
+#include "trace.h"
+
+struct trace_file {
+    struct gto_trace_header        *h;
+    const struct gto_trace_record **order; /* Valid records, oldest first */
+    size_t                          n;
+};
+
+int trace_file_load(struct trace_file *tf, const char *path);
+void trace_file_free(struct trace_file *tf);
+
+#endif /* TRACE_FILE_H */